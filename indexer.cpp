@@ -4,9 +4,15 @@
 #include <cstring>
 #include <cerrno>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <time.h>
 
+#include <atomic>
+#include <mutex>
+#include <thread>
+
 static double now_sec_monotonic() {
     struct timespec ts;
     clock_gettime(CLOCK_MONOTONIC, &ts);
@@ -31,6 +37,22 @@ static uint64_t fnv1a_64(const char* s, int len) {
     return h ? h : 1;
 }
 
+// lexicon.mph hashing (must match search_cli): keys are fnv1a_64 of the
+// term, remixed per level and mapped onto the level with a multiply-shift.
+static inline uint64_t mph_mix(uint64_t x) {
+    x ^= x >> 33; x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33; x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+static inline uint64_t mph_pos(uint64_t h, uint32_t level, uint64_t bits) {
+    uint64_t x = mph_mix(h + (uint64_t)(level + 1) * 0x9E3779B97F4A7C15ULL);
+    return (uint64_t)(((unsigned __int128)x * bits) >> 64);
+}
+static inline uint16_t mph_fingerprint(uint64_t h) {
+    return (uint16_t)(mph_mix(h ^ 0x5851F42D4C957F2DULL) >> 48);
+}
+
 static void ensure_dir(const char* path) {
     struct stat st;
     if (stat(path, &st) == 0) {
@@ -44,6 +66,32 @@ static void ensure_dir(const char* path) {
     }
 }
 
+// Removes *.blk left by a previous run: the merge picks up every .blk in the
+// directory, and threaded/single runs name blocks differently, so stale ones
+// would be merged in as duplicate docs (and sum up their tf).
+static void clear_blocks_dir(const char* dir) {
+    DIR* d = opendir(dir);
+    if (!d) { std::fprintf(stderr, "opendir %s failed: %s\n", dir, std::strerror(errno)); std::exit(1); }
+    size_t dl = std::strlen(dir);
+    struct dirent* ent;
+    while ((ent = readdir(d)) != NULL) {
+        const char* nm = ent->d_name;
+        size_t l = std::strlen(nm);
+        if (l < 4 || std::strcmp(nm + (l-4), ".blk") != 0) continue;
+        char* full = (char*)std::malloc(dl + 1 + l + 1);
+        if (!full) { std::fprintf(stderr, "malloc path failed\n"); std::exit(1); }
+        std::memcpy(full, dir, dl);
+        full[dl] = '/';
+        std::memcpy(full + dl + 1, nm, l + 1);
+        if (unlink(full) != 0) {
+            std::fprintf(stderr, "unlink(%s) failed: %s\n", full, std::strerror(errno));
+            std::exit(1);
+        }
+        std::free(full);
+    }
+    closedir(d);
+}
+
 struct Arena {
     char*  buf = nullptr;
     size_t cap = 0;
@@ -82,6 +130,20 @@ struct U32List {
 
     void free_mem() { std::free(a); a=nullptr; n=cap=0; }
 
+    void reserve(uint32_t need) {
+        if (cap >= need) return;
+        uint32_t new_cap = cap ? cap : 8;
+        while (new_cap < need) new_cap *= 2;
+        uint32_t* nb = (uint32_t*)std::realloc(a, (size_t)new_cap * sizeof(uint32_t));
+        if (!nb) { std::fprintf(stderr, "realloc postings failed\n"); std::exit(1); }
+        a = nb; cap = new_cap;
+    }
+
+    void push(uint32_t v) {
+        if (n == cap) reserve(cap ? cap*2 : 8);
+        a[n++] = v;
+    }
+
     void push_unique_sorted(uint32_t v) {
         if (n > 0 && a[n-1] == v) return;
         if (n == cap) {
@@ -99,28 +161,52 @@ struct TermEntry {
     const char* term = nullptr;
     uint16_t    len = 0;
     U32List     post;
+    U32List     tf;
+    U32List     pos;   // with_pos: token positions, tf[i] of them per posting
 };
 
+// Largest power-of-two slot count up to max_cap whose table takes at most a
+// quarter of budget bytes (at least 1024 slots), so the slots alone never
+// reach the flush limit.
+static size_t term_table_cap(uint64_t budget, size_t max_cap) {
+    size_t cap = 1024;
+    while (cap * 2 <= max_cap && (uint64_t)(cap * 2) * sizeof(TermEntry) <= budget / 4) cap *= 2;
+    return cap;
+}
+
 struct TermTable {
     TermEntry* tab = nullptr;
     size_t cap = 0; 
+    size_t base_cap = 0;   // init size; clear() shrinks a grown table back to it
     size_t used = 0;
+    size_t post_bytes = 0;
+    int with_tf = 0;
+    int with_pos = 0;   // implies with_tf
     Arena arena;
 
     void init(size_t cap_pow2, size_t arena_bytes) {
-        cap = cap_pow2;
+        cap = base_cap = cap_pow2;
         tab = (TermEntry*)std::calloc(cap, sizeof(TermEntry));
         if (!tab) { std::fprintf(stderr, "calloc term table failed\n"); std::exit(1); }
         used = 0;
+        post_bytes = 0;
         arena.init(arena_bytes);
     }
 
     void clear() {
         for (size_t i=0;i<cap;i++) {
-            if (tab[i].hash != 0) tab[i].post.free_mem();
+            if (tab[i].hash != 0) { tab[i].post.free_mem(); tab[i].tf.free_mem(); tab[i].pos.free_mem(); }
             tab[i].hash = 0; tab[i].term=nullptr; tab[i].len=0;
         }
+        if (cap > base_cap) {
+            // the grown slots count against the memory limit of every block
+            std::free(tab);
+            cap = base_cap;
+            tab = (TermEntry*)std::calloc(cap, sizeof(TermEntry));
+            if (!tab) { std::fprintf(stderr, "calloc term table failed\n"); std::exit(1); }
+        }
         used = 0;
+        post_bytes = 0;
         arena.reset();
     }
 
@@ -168,6 +254,8 @@ struct TermTable {
                 tab[pos].term = stored;
                 tab[pos].len = (uint16_t)len;
                 tab[pos].post = U32List{};
+                tab[pos].tf = U32List{};
+                tab[pos].pos = U32List{};
                 used++;
                 return &tab[pos];
             }
@@ -179,14 +267,29 @@ struct TermTable {
         }
     }
 
+    void add_posting(TermEntry* e, uint32_t doc_id) {
+        uint32_t old_cap = e->post.cap;
+        e->post.push_unique_sorted(doc_id);
+        post_bytes += (size_t)(e->post.cap - old_cap) * sizeof(uint32_t);
+    }
+
+    void add_posting_tf(TermEntry* e, uint32_t doc_id, uint32_t tf) {
+        uint32_t old_cap = e->post.cap + e->tf.cap;
+        e->post.push(doc_id);
+        e->tf.push(tf);
+        post_bytes += (size_t)(e->post.cap + e->tf.cap - old_cap) * sizeof(uint32_t);
+    }
+
+    void add_positions(TermEntry* e, const uint32_t* p, uint32_t n) {
+        uint32_t old_cap = e->pos.cap;
+        e->pos.reserve(e->pos.n + n);
+        std::memcpy(e->pos.a + e->pos.n, p, (size_t)n * sizeof(uint32_t));
+        e->pos.n += n;
+        post_bytes += (size_t)(e->pos.cap - old_cap) * sizeof(uint32_t);
+    }
+
     size_t approx_mem_bytes() const {
-        size_t bytes = 0;
-        bytes += cap * sizeof(TermEntry);
-        bytes += arena.used;
-        for (size_t i=0;i<cap;i++) {
-            if (tab[i].hash != 0) bytes += (size_t)tab[i].post.cap * sizeof(uint32_t);
-        }
-        return bytes;
+        return cap * sizeof(TermEntry) + arena.used + post_bytes;
     }
 };
 
@@ -194,6 +297,9 @@ struct DocSetEntry {
     uint64_t hash = 0; 
     const char* term = nullptr;
     uint16_t len = 0;
+    uint32_t count = 0;
+    uint32_t ord = 0;    // index in touched
+    uint32_t fill = 0;   // positions: next free slot in DocTermSet::tok_pos
 };
 
 struct DocTermSet {
@@ -201,33 +307,57 @@ struct DocTermSet {
     size_t cap = 0;
     size_t used = 0;
     Arena arena; 
+    // slots filled since the last reset, so reset() and the per-document
+    // tf walk touch only this document's terms
+    uint32_t* touched = nullptr;
+    // positions: touched index of every token of the document, and the
+    // token positions regrouped per term at document end
+    U32List tok_ords;
+    U32List tok_pos;
 
     void init(size_t cap_pow2, size_t arena_bytes) {
         cap = cap_pow2;
         tab = (DocSetEntry*)std::calloc(cap, sizeof(DocSetEntry));
         if (!tab) { std::fprintf(stderr, "calloc DocTermSet failed\n"); std::exit(1); }
+        touched = (uint32_t*)std::malloc(cap * sizeof(uint32_t));
+        if (!touched) { std::fprintf(stderr, "malloc DocTermSet failed\n"); std::exit(1); }
         used = 0;
         arena.init(arena_bytes);
     }
 
     void reset() {
-
-        std::memset(tab, 0, cap * sizeof(DocSetEntry));
+        for (size_t i=0;i<used;i++) tab[touched[i]] = DocSetEntry{};
         used = 0;
+        tok_ords.n = 0;
         arena.reset();
     }
 
     void destroy() {
         std::free(tab); tab=nullptr; cap=used=0;
+        std::free(touched); touched=nullptr;
+        tok_ords.free_mem(); tok_pos.free_mem();
         arena.destroy();
     }
 
-    int contains_or_add(const char* s, int len) {
-
-        if (len <= 0) return 1;
-        if (used * 10 >= cap * 8) {
-            return 0;
+    void grow() {
+        size_t new_cap = cap * 2;
+        DocSetEntry* nt = (DocSetEntry*)std::calloc(new_cap, sizeof(DocSetEntry));
+        uint32_t* ntouch = (uint32_t*)std::malloc(new_cap * sizeof(uint32_t));
+        if (!nt || !ntouch) { std::fprintf(stderr, "grow DocTermSet failed\n"); std::exit(1); }
+        size_t mask = new_cap - 1;
+        for (size_t i=0;i<used;i++) {
+            const DocSetEntry& e = tab[touched[i]];
+            size_t pos = (size_t)e.hash & mask;
+            while (nt[pos].hash != 0) pos = (pos + 1) & mask;
+            nt[pos] = e;
+            ntouch[i] = (uint32_t)pos;
         }
+        std::free(tab); std::free(touched);
+        tab = nt; touched = ntouch; cap = new_cap;
+    }
+
+    DocSetEntry* find_or_add(const char* s, int len, int* added) {
+        if (used * 10 >= cap * 8) grow();
 
         uint64_t h = fnv1a_64(s, len);
         size_t mask = cap - 1;
@@ -239,16 +369,27 @@ struct DocTermSet {
                 tab[pos].hash = h;
                 tab[pos].term = stored;
                 tab[pos].len = (uint16_t)len;
-                used++;
-                return 0; 
+                tab[pos].count = 0;
+                tab[pos].ord = (uint32_t)used;
+                touched[used++] = (uint32_t)pos;
+                *added = 1;
+                return &tab[pos];
             }
             if (tab[pos].hash == h && tab[pos].len == (uint16_t)len &&
                 std::memcmp(tab[pos].term, s, (size_t)len) == 0) {
-                return 1;
+                *added = 0;
+                return &tab[pos];
             }
             pos = (pos + 1) & mask;
         }
     }
+
+    int contains_or_add(const char* s, int len) {
+        if (len <= 0) return 1;
+        int added = 0;
+        find_or_add(s, len, &added);
+        return !added;
+    }
 };
 
 
@@ -287,10 +428,20 @@ struct DocRec {
     uint64_t url_off;
     uint32_t url_len;
 };
+
+// doclen.bin: header + uint32 token count per doc id
+struct DocLenHeader {
+    char     magic[4];
+    uint32_t version;
+    uint32_t doc_count;
+    uint64_t total_len;
+    uint8_t  reserved[32];
+};
 #pragma pack(pop)
 
 struct DocsBuilder {
     DocRec* recs = nullptr;
+    uint32_t* lens = nullptr;
     uint32_t n = 0;
     uint32_t cap = 0;
     Arena pool;
@@ -298,7 +449,8 @@ struct DocsBuilder {
     void init(uint32_t cap_docs, size_t pool_bytes) {
         cap = cap_docs ? cap_docs : 1024;
         recs = (DocRec*)std::malloc((size_t)cap * sizeof(DocRec));
-        if (!recs) { std::fprintf(stderr, "malloc docs recs failed\n"); std::exit(1); }
+        lens = (uint32_t*)std::calloc(cap, sizeof(uint32_t));
+        if (!recs || !lens) { std::fprintf(stderr, "malloc docs recs failed\n"); std::exit(1); }
         n = 0;
         pool.init(pool_bytes);
     }
@@ -307,8 +459,11 @@ struct DocsBuilder {
         if (n < cap) return;
         uint32_t new_cap = cap * 2;
         DocRec* nb = (DocRec*)std::realloc(recs, (size_t)new_cap * sizeof(DocRec));
-        if (!nb) { std::fprintf(stderr, "realloc docs recs failed\n"); std::exit(1); }
+        uint32_t* nl = (uint32_t*)std::realloc(lens, (size_t)new_cap * sizeof(uint32_t));
+        if (!nb || !nl) { std::fprintf(stderr, "realloc docs recs failed\n"); std::exit(1); }
+        std::memset(nl + cap, 0, (size_t)(new_cap - cap) * sizeof(uint32_t));
         recs = nb;
+        lens = nl;
         cap = new_cap;
     }
 
@@ -343,8 +498,26 @@ struct DocsBuilder {
         std::fclose(f);
     }
 
+    void write_lens_to(const char* path) {
+        FILE* f = std::fopen(path, "wb");
+        if (!f) { std::fprintf(stderr, "open %s failed: %s\n", path, std::strerror(errno)); std::exit(1); }
+
+        DocLenHeader h{};
+        h.magic[0]='D'; h.magic[1]='L'; h.magic[2]='E'; h.magic[3]='N';
+        h.version = 1;
+        h.doc_count = n;
+        h.total_len = 0;
+        for (uint32_t i=0;i<n;i++) h.total_len += lens[i];
+        std::memset(h.reserved, 0, sizeof(h.reserved));
+
+        std::fwrite(&h, sizeof(h), 1, f);
+        std::fwrite(lens, sizeof(uint32_t), n, f);
+        std::fclose(f);
+    }
+
     void destroy() {
         std::free(recs); recs=nullptr; n=cap=0;
+        std::free(lens); lens=nullptr;
         pool.destroy();
     }
 };
@@ -378,7 +551,7 @@ static void write_block(const char* path, TermTable* tt) {
     if (!f) { std::fprintf(stderr, "open block %s failed: %s\n", path, std::strerror(errno)); std::exit(1); }
 
     BlockHeader bh{};
-    bh.magic[0]='B'; bh.magic[1]='L'; bh.magic[2]='K'; bh.magic[3]='1';
+    bh.magic[0]='B'; bh.magic[1]='L'; bh.magic[2]='K'; bh.magic[3]= tt->with_pos ? '3' : (tt->with_tf ? '2' : '1');
     bh.term_count = (uint32_t)k;
     std::fwrite(&bh, sizeof(bh), 1, f);
 
@@ -390,6 +563,8 @@ static void write_block(const char* path, TermTable* tt) {
         std::fwrite(&df, sizeof(df), 1, f);
         std::fwrite(e->term, 1, tlen, f);
         std::fwrite(e->post.a, sizeof(uint32_t), df, f);
+        if (tt->with_tf) std::fwrite(e->tf.a, sizeof(uint32_t), df, f);
+        if (tt->with_pos) std::fwrite(e->pos.a, sizeof(uint32_t), e->pos.n, f);
     }
 
     std::fclose(f);
@@ -411,64 +586,337 @@ struct LexRec {
     uint32_t df;
     uint64_t postings_off;
     uint32_t postings_len;
-    uint32_t reserved;
+    float    max_tf_score;   // LEX_F_BLOCKMAX: max BM25 tf-part over the list, else 0
+};
+// lexicon.bin v3 (--lexicon fst): LexHeader, then term_count LexRec3; the
+// terms themselves are only in lexicon.fst.
+struct LexRec3 {
+    uint64_t postings_off;
+    uint32_t postings_len;
+    uint32_t df;
+    uint16_t flags;
+    uint16_t reserved;
+    float    max_tf_score;
+};
+// lexicon.bin v2: LexHeader2, then the terms in blocks of block_terms. In
+// a block the first term is stored whole (VByte length + bytes), the others
+// as VByte(shared prefix) VByte(suffix length) + suffix; each term is
+// followed by VByte flags, df, postings_len, VByte postings_off (absolute for
+// the first term of a block, else the delta to the previous term) and, with
+// LEX_F_BLOCKMAX, the float max_tf_score. nblocks+1 uint64 block offsets
+// (from the start of the file) sit at table_off.
+struct LexHeader2 {
+    char magic[4];
+    uint32_t version;
+    uint32_t term_count;
+    uint32_t block_terms;
+    uint32_t nblocks;
+    uint64_t table_off;
+    uint8_t reserved[24];
+};
+// lexicon.mph (optional): minimal perfect hash of the terms, BBHash-style.
+// Level l is a bit array of level_bits[l+1]-level_bits[l] bits; a term goes
+// to the first level whose bit at mph_pos() is set. After the header:
+// nlevels+1 uint64 level start bits, the total_bits/64 uint64 words,
+// total_bits/64+1 uint32 ranks (set bits before each word), then per slot
+// (= rank of the term's bit) the uint32 lexicon ordinal and a uint16
+// fingerprint (mph_fingerprint) to reject most absent terms early.
+struct MphHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t term_count;
+    uint32_t nlevels;
+    uint64_t total_bits;
+    uint8_t reserved[24];
+};
+// lexicon.fst (optional): minimal acyclic automaton of the sorted terms in
+// which the arc outputs along a term's path add up to its lexicon ordinal.
+// Nodes (node_bytes after the header, children before parents, root at
+// root_off) start with VByte (narcs << 2 | dense << 1 | final). A sparse
+// node then has per arc in label order: label byte, VByte output = final +
+// terms below the earlier arcs (omitted for the first arc, where it is just
+// final) and VByte (node offset - target offset). A dense node (at least
+// FST_DENSE_ARCS arcs) has a byte each for the output and delta widths, then
+// the narcs labels, the narcs outputs and the narcs deltas, little-endian at
+// those widths. Terms below a node = last arc's output + terms below its
+// target.
+struct FstHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t term_count;
+    uint32_t max_term_len;
+    uint64_t root_off;
+    uint64_t node_bytes;
+    uint8_t reserved[16];
+};
+// lexicon.kgram (optional): k-gram index of the terms, for wildcards that
+// the sorted order cannot answer (*ization, *matrix*). Every term is padded
+// with '$' on both sides and each k-gram of the result ("$ab$" with k = 3:
+// "$ab", "ab$") lists the term. After the header: gram_count+1 uint64 list
+// offsets (relative to the lists), gram_count uint32 keys (the k bytes
+// big-endian, ascending), then the lists: VByte first ordinal, then VByte
+// gaps, ascending.
+struct KgramHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t term_count;
+    uint32_t k;
+    uint32_t gram_count;
+    uint32_t reserved0;
+    uint64_t list_bytes;
+    uint8_t reserved[16];
 };
 struct PostHeader {
     char magic[4];
     uint32_t version;
-    uint8_t reserved[32];
+    float bm25_k1;           // parameters the block-max bounds were computed with
+    float bm25_b;
+    uint8_t reserved[24];
+};
+// positions.bin: header, per-term position data, then a table of
+// term_count+1 uint64 offsets (lexicon order) at table_off. doc_count and
+// postings_bytes (size of the postings.bin written alongside) let the
+// reader reject a positions file left over from another build.
+struct PosHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t term_count;
+    uint64_t table_off;
+    uint32_t doc_count;
+    uint32_t reserved0;
+    uint64_t postings_bytes;
+    uint8_t reserved[8];
+};
+// postings.bin v2, LEX_F_VBYTE lists: a directory of ceil(df/128) entries
+// followed by the d-gap VByte stream. byte_off is relative to the stream.
+struct PostBlockDir {
+    uint32_t last_doc;
+    uint32_t byte_off;
+};
+// postings.bin v3 (roaring), LEX_F_ROARING lists at 8-byte aligned offsets:
+// RoarHead, nchunks RoarChunk entries (ascending key = doc id >> 16), then
+// the containers holding the low 16 bits. Offsets are relative to the list.
+struct RoarHead {
+    uint32_t nchunks;
+    uint32_t tf_off;         // end of the containers, 4-byte aligned: v1 tf/block-max data follow
+};
+struct RoarChunk {
+    uint16_t key;
+    uint16_t type;           // ROAR_ARRAY / ROAR_BITMAP / ROAR_RUN
+    uint32_t n;              // array: values, bitmap: set bits, run: runs
+    uint32_t rank;           // postings in the chunks before this one
+    uint32_t off;
 };
 #pragma pack(pop)
 
+static const uint16_t LEX_F_VBYTE = 0x0001;
+// Term frequencies follow the doc ids: v1 as uint16 (saturated, padded to
+// 4 bytes), v2 as VByte right after each block's d-gaps.
+static const uint16_t LEX_F_TF    = 0x0002;
+// A float upper bound of the BM25 tf-part per 128-posting block follows the
+// list (after the tfs for v1, at the end of postings_len for v2).
+static const uint16_t LEX_F_BLOCKMAX = 0x0004;
+// Dense terms (--bitmap-frac): ceil(doc_count/64) uint64 words, bit d set
+// for doc d, at an 8-byte aligned postings_off; tf and block-max data follow
+// as for v1. postings_len is the byte size, df the number of set bits.
+static const uint16_t LEX_F_BITMAP = 0x0008;
+static const uint16_t LEX_F_ROARING = 0x0010;
+// Container kinds: sorted uint16 values; 1024 uint64 words (8-byte aligned);
+// uint16 (start, last) pairs of consecutive values.
+static const uint16_t ROAR_ARRAY = 0, ROAR_BITMAP = 1, ROAR_RUN = 2;
+static const uint32_t ROAR_BITMAP_BYTES = 8192;
+static const uint32_t POSTINGS_BLOCK = 128;
+static const uint32_t MPH_MAX_LEVELS = 64;
+static const uint32_t FST_DENSE_ARCS = 8;
+static const uint32_t KGRAM_K = 3;
+
+struct ByteBuf {
+    uint8_t* a = nullptr;
+    size_t n = 0;
+    size_t cap = 0;
+
+    void free_mem() { std::free(a); a=nullptr; n=cap=0; }
+    void reserve(size_t need) {
+        if (cap >= need) return;
+        size_t nc = cap ? cap : 256;
+        while (nc < need) nc *= 2;
+        uint8_t* nb = (uint8_t*)std::realloc(a, nc);
+        if (!nb) { std::fprintf(stderr, "realloc ByteBuf failed\n"); std::exit(1); }
+        a = nb; cap = nc;
+    }
+    void put(const void* p, size_t len) {
+        reserve(n + len);
+        std::memcpy(a + n, p, len);
+        n += len;
+    }
+    void put_vbyte(uint32_t v) {
+        reserve(n + 5);
+        while (v >= 0x80) { a[n++] = (uint8_t)(v | 0x80); v >>= 7; }
+        a[n++] = (uint8_t)v;
+    }
+    void put_vbyte64(uint64_t v) {
+        reserve(n + 10);
+        while (v >= 0x80) { a[n++] = (uint8_t)(v | 0x80); v >>= 7; }
+        a[n++] = (uint8_t)v;
+    }
+};
+
+static void encode_vbyte_blocks(const uint32_t* ids, const uint32_t* tfs, uint32_t n, ByteBuf* out) {
+    out->n = 0;
+    uint32_t nblocks = (n + POSTINGS_BLOCK - 1) / POSTINGS_BLOCK;
+    out->reserve((size_t)nblocks * sizeof(PostBlockDir) + (size_t)n * 2);
+    out->n = (size_t)nblocks * sizeof(PostBlockDir);
+
+    size_t data_start = out->n;
+    uint32_t prev = 0;
+    for (uint32_t b=0; b<nblocks; b++) {
+        uint32_t lo = b * POSTINGS_BLOCK;
+        uint32_t hi = lo + POSTINGS_BLOCK;
+        if (hi > n) hi = n;
+        PostBlockDir dir{ ids[hi-1], (uint32_t)(out->n - data_start) };
+        for (uint32_t i=lo; i<hi; i++) {
+            out->put_vbyte(ids[i] - prev);
+            prev = ids[i];
+        }
+        if (tfs) for (uint32_t i=lo; i<hi; i++) out->put_vbyte(tfs[i]);
+        std::memcpy(out->a + (size_t)b * sizeof(PostBlockDir), &dir, sizeof(dir));
+    }
+}
+
+// Streams one .blk file through a reusable read-ahead buffer. term/docs
+// point into that buffer (or into `al` when the record's ids are not
+// 4-byte aligned there) and stay valid only until the next call to next().
 struct BlockReader {
-    FILE* f = nullptr;
+    int fd = -1;
     uint32_t remaining = 0;
 
-    char* term = nullptr;
+    char*  buf = nullptr;
+    size_t cap = 0;
+    size_t pos = 0;
+    size_t end = 0;
+    int    eof = 0;
+
+    uint32_t* al = nullptr;  // aligned copy of docs/tfs/positions
+    size_t al_cap = 0;
+
+    const char* term = nullptr;
     uint16_t term_len = 0;
     uint32_t df = 0;
-    uint32_t* docs = nullptr;
-
-    void open(const char* path) {
-        f = std::fopen(path, "rb");
-        if (!f) { std::fprintf(stderr, "open %s failed: %s\n", path, std::strerror(errno)); std::exit(1); }
-        BlockHeader bh{};
-        if (std::fread(&bh, sizeof(bh), 1, f) != 1) { std::fprintf(stderr, "bad block header\n"); std::exit(1); }
-        if (std::memcmp(bh.magic, "BLK1", 4) != 0) { std::fprintf(stderr, "bad block magic\n"); std::exit(1); }
+    const uint32_t* docs = nullptr;
+    const uint32_t* tfs = nullptr;  // BLK2/BLK3
+    const uint32_t* positions = nullptr;  // BLK3: sum(tfs) token positions
+    uint32_t npos = 0;
+    int has_tf = 0;
+    int has_pos = 0;
+
+    void open(const char* path, size_t readahead_bytes) {
+        fd = ::open(path, O_RDONLY);
+        if (fd < 0) { std::fprintf(stderr, "open %s failed: %s\n", path, std::strerror(errno)); std::exit(1); }
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        cap = readahead_bytes < 4096 ? 4096 : readahead_bytes;
+        buf = (char*)std::malloc(cap);
+        if (!buf) { std::fprintf(stderr, "malloc block buffer failed\n"); std::exit(1); }
+        pos = end = 0; eof = 0;
+
+        if (!fill(sizeof(BlockHeader))) { std::fprintf(stderr, "bad block header\n"); std::exit(1); }
+        BlockHeader bh;
+        std::memcpy(&bh, buf + pos, sizeof(bh));
+        pos += sizeof(bh);
+        has_tf = has_pos = 0;
+        if (std::memcmp(bh.magic, "BLK1", 4) == 0) {}
+        else if (std::memcmp(bh.magic, "BLK2", 4) == 0) has_tf = 1;
+        else if (std::memcmp(bh.magic, "BLK3", 4) == 0) has_tf = has_pos = 1;
+        else { std::fprintf(stderr, "bad block magic\n"); std::exit(1); }
         remaining = bh.term_count;
-        term = nullptr; docs = nullptr;
+        term = nullptr; docs = nullptr; tfs = nullptr; positions = nullptr; npos = 0;
         term_len = 0; df = 0;
         next();
     }
 
     void close() {
-        if (f) std::fclose(f);
-        f = nullptr;
-        std::free(term); term=nullptr;
-        std::free(docs); docs=nullptr;
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+        std::free(buf); buf=nullptr; cap=pos=end=0;
+        std::free(al); al=nullptr; al_cap=0;
+        term = nullptr; docs = nullptr;
         remaining = 0;
     }
 
-    int has() const { return (f != nullptr) && (term != nullptr); }
+    int has() const { return (fd >= 0) && (term != nullptr); }
+
+    // Makes at least `need` unread bytes available at buf+pos.
+    int fill(size_t need) {
+        if (end - pos >= need) return 1;
+        if (pos > 0) {
+            std::memmove(buf, buf + pos, end - pos);
+            end -= pos;
+            pos = 0;
+        }
+        if (need > cap) {
+            size_t nc = cap;
+            while (nc < need) nc *= 2;
+            char* nb = (char*)std::realloc(buf, nc);
+            if (!nb) { std::fprintf(stderr, "realloc block buffer failed\n"); std::exit(1); }
+            buf = nb; cap = nc;
+        }
+        while (end < need && !eof) {
+            ssize_t r = ::read(fd, buf + end, cap - end);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                std::fprintf(stderr, "read block failed: %s\n", std::strerror(errno));
+                std::exit(1);
+            }
+            if (r == 0) eof = 1;
+            end += (size_t)r;
+        }
+        return end >= need;
+    }
 
     void next() {
-        std::free(term); term=nullptr;
-        std::free(docs); docs=nullptr;
-        term_len = 0; df = 0;
+        term = nullptr; docs = nullptr; tfs = nullptr; positions = nullptr;
+        term_len = 0; df = 0; npos = 0;
 
         if (remaining == 0) { return; }
 
-        if (std::fread(&term_len, sizeof(term_len), 1, f) != 1) { std::fprintf(stderr, "read term_len failed\n"); std::exit(1); }
-        if (std::fread(&df, sizeof(df), 1, f) != 1) { std::fprintf(stderr, "read df failed\n"); std::exit(1); }
-
-        term = (char*)std::malloc((size_t)term_len + 1);
-        if (!term) { std::fprintf(stderr, "malloc term failed\n"); std::exit(1); }
-        if (std::fread(term, 1, term_len, f) != term_len) { std::fprintf(stderr, "read term bytes failed\n"); std::exit(1); }
-        term[term_len] = '\0';
+        const size_t hdr = sizeof(uint16_t) + sizeof(uint32_t);
+        if (!fill(hdr)) { std::fprintf(stderr, "read term header failed\n"); std::exit(1); }
+        std::memcpy(&term_len, buf + pos, sizeof(term_len));
+        std::memcpy(&df, buf + pos + sizeof(term_len), sizeof(df));
+
+        size_t rec = hdr + (size_t)term_len + (size_t)df * sizeof(uint32_t) * (has_tf ? 2 : 1);
+        if (!fill(rec)) { std::fprintf(stderr, "read term record failed\n"); std::exit(1); }
+        if (has_pos) {
+            // the position count is implied by the tfs; fill() may move buf
+            const char* tp = buf + pos + hdr + term_len + (size_t)df * sizeof(uint32_t);
+            uint64_t sum = 0;
+            for (uint32_t i=0;i<df;i++) { uint32_t v; std::memcpy(&v, tp + (size_t)i * 4, 4); sum += v; }
+            npos = (uint32_t)sum;
+            rec += (size_t)npos * sizeof(uint32_t);
+            if (!fill(rec)) { std::fprintf(stderr, "read term positions failed\n"); std::exit(1); }
+        }
 
-        docs = (uint32_t*)std::malloc((size_t)df * sizeof(uint32_t));
-        if (!docs) { std::fprintf(stderr, "malloc docs failed\n"); std::exit(1); }
-        if (df > 0 && std::fread(docs, sizeof(uint32_t), df, f) != df) { std::fprintf(stderr, "read postings failed\n"); std::exit(1); }
+        term = buf + pos + hdr;
+        // term_len is arbitrary, so the ids are usually misaligned in buf
+        const char* p = buf + pos + hdr + term_len;
+        size_t nw = (rec - hdr - term_len) / sizeof(uint32_t);
+        if (((uintptr_t)p & (alignof(uint32_t) - 1)) == 0) {
+            docs = (const uint32_t*)p;
+        } else {
+            if (nw > al_cap) {
+                size_t nc = al_cap ? al_cap : 1024;
+                while (nc < nw) nc *= 2;
+                uint32_t* na = (uint32_t*)std::realloc(al, nc * sizeof(uint32_t));
+                if (!na) { std::fprintf(stderr, "realloc block ids failed\n"); std::exit(1); }
+                al = na; al_cap = nc;
+            }
+            std::memcpy(al, p, nw * sizeof(uint32_t));
+            docs = al;
+        }
+        if (has_tf) tfs = docs + df;
+        if (has_pos) positions = tfs + df;
+        pos += rec;
 
         remaining--;
     }
@@ -481,25 +929,78 @@ static int lex_cmp_str(const char* a, uint16_t alen, const char* b, uint16_t ble
     return (alen < blen) ? -1 : (alen > blen ? 1 : 0);
 }
 
-static uint32_t* merge_union_u32(const uint32_t* a, uint32_t na, const uint32_t* b, uint32_t nb, uint32_t* out_n) {
-    uint32_t cap = na + nb;
-    uint32_t* out = (uint32_t*)std::malloc((size_t)cap * sizeof(uint32_t));
-    if (!out) { std::fprintf(stderr, "malloc merge out failed\n"); std::exit(1); }
-
+// Union of two sorted lists. With out_tf the frequencies of a doc present
+// in both are summed; a missing input tf array counts as tf=1.
+static uint32_t merge_union_u32(const uint32_t* a, const uint32_t* atf, uint32_t na,
+                                const uint32_t* b, const uint32_t* btf, uint32_t nb,
+                                uint32_t* out, uint32_t* out_tf) {
     uint32_t i=0,j=0,k=0;
-    while (i<na && j<nb) {
-        uint32_t x=a[i], y=b[j];
-        uint32_t v;
-        if (x==y) { v=x; i++; j++; }
-        else if (x<y) { v=x; i++; }
-        else { v=y; j++; }
-        if (k==0 || out[k-1]!=v) out[k++]=v;
-    }
-    while (i<na) { uint32_t v=a[i++]; if (k==0||out[k-1]!=v) out[k++]=v; }
-    while (j<nb) { uint32_t v=b[j++]; if (k==0||out[k-1]!=v) out[k++]=v; }
-
-    *out_n = k;
-    return out;
+    while (i<na || j<nb) {
+        uint32_t v, f;
+        if (j>=nb || (i<na && a[i]<b[j])) { v=a[i]; f=atf ? atf[i] : 1; i++; }
+        else if (i>=na || b[j]<a[i])      { v=b[j]; f=btf ? btf[j] : 1; j++; }
+        else { v=a[i]; f=(atf ? atf[i] : 1) + (btf ? btf[j] : 1); i++; j++; }
+        if (k>0 && out[k-1]==v) { if (out_tf) out_tf[k-1] += f; continue; }
+        if (out_tf) out_tf[k] = f;
+        out[k++]=v;
+    }
+    return k;
+}
+
+// Min-heap of block indices ordered by (current term, block index).
+// Ties go to the lower block so equal terms come out in doc-id order.
+struct BlockHeap {
+    BlockReader* br = nullptr;
+    uint32_t* h = nullptr;
+    size_t n = 0;
+
+    void init(BlockReader* readers, size_t count) {
+        br = readers;
+        h = (uint32_t*)std::malloc((count ? count : 1) * sizeof(uint32_t));
+        if (!h) { std::fprintf(stderr, "malloc heap failed\n"); std::exit(1); }
+        n = 0;
+        for (size_t i=0;i<count;i++) if (br[i].has()) h[n++] = (uint32_t)i;
+        for (size_t i=n/2;i-->0;) sift_down(i);
+    }
+    void destroy() { std::free(h); h=nullptr; n=0; }
+
+    int less(uint32_t x, uint32_t y) const {
+        int c = lex_cmp_str(br[x].term, br[x].term_len, br[y].term, br[y].term_len);
+        if (c != 0) return c < 0;
+        return x < y;
+    }
+
+    void sift_down(size_t i) {
+        uint32_t v = h[i];
+        while (1) {
+            size_t l = 2*i + 1;
+            if (l >= n) break;
+            size_t m = (l+1 < n && less(h[l+1], h[l])) ? l+1 : l;
+            if (!less(h[m], v)) break;
+            h[i] = h[m];
+            i = m;
+        }
+        h[i] = v;
+    }
+
+    uint32_t top() const { return h[0]; }
+
+    // Call after advancing the top reader.
+    void fix_top() {
+        if (!br[h[0]].has()) {
+            h[0] = h[--n];
+            if (n == 0) return;
+        }
+        sift_down(0);
+    }
+};
+
+static int block_name_cmp(const void* pa, const void* pb) {
+    const char* a = *(const char* const*)pa;
+    const char* b = *(const char* const*)pb;
+    size_t la = std::strlen(a), lb = std::strlen(b);
+    if (la != lb) return (la < lb) ? -1 : 1;
+    return std::strcmp(a, b);
 }
 
 static char* g_lex_pool_for_sort = nullptr;
@@ -522,6 +1023,204 @@ static int lexrec_cmp_by_term(const void* pa, const void* pb) {
     return 0;
 }
 
+// Builds lexicon.fst from terms added in sorted order (Daciuk et al.): the
+// states on the previous term's path stay open; when a term diverges, the
+// open states below the shared prefix are frozen, each one either replaced
+// by an equal frozen state from the register or written out.
+struct FstBuilder {
+    struct OpenArc { uint8_t label; uint64_t target; uint32_t count; };
+    struct OpenState {
+        OpenArc* arcs = nullptr;
+        uint32_t n = 0, cap = 0;
+        int final = 0;
+    };
+    // register entry: a written node and its (final, arcs) signature in sig
+    struct Reg { uint64_t hash; uint64_t off; uint64_t sig_at; uint32_t narcs; uint32_t count; int final; };
+
+    ByteBuf out;
+    OpenState* path = nullptr;    // path[d]: open state at depth d
+    uint32_t path_cap = 0;
+    char* prev = nullptr;
+    uint32_t prev_len = 0, prev_cap = 0;
+    uint32_t max_len = 0, terms = 0;
+    Reg* reg = nullptr;
+    size_t reg_cap = 0, reg_n = 0;
+    uint64_t* sig = nullptr;
+    size_t sig_n = 0, sig_cap = 0;
+    uint32_t nodes = 0;
+    uint64_t arcs = 0;
+
+    void init() {
+        reg_cap = 1024;
+        reg = (Reg*)std::calloc(reg_cap, sizeof(Reg));
+        if (!reg) { std::fprintf(stderr, "calloc fst register failed\n"); std::exit(1); }
+        ensure_depth(0);
+    }
+
+    void ensure_depth(uint32_t d) {
+        if (d < path_cap) return;
+        uint32_t nc = path_cap ? path_cap : 64;
+        while (nc <= d) nc *= 2;
+        OpenState* nb = (OpenState*)std::realloc(path, (size_t)nc * sizeof(OpenState));
+        if (!nb) { std::fprintf(stderr, "realloc fst path failed\n"); std::exit(1); }
+        for (uint32_t i=path_cap; i<nc; i++) nb[i] = OpenState();
+        path = nb; path_cap = nc;
+    }
+
+    static void push_arc(OpenState* st, uint8_t label) {
+        if (st->n == st->cap) {
+            uint32_t nc = st->cap ? st->cap * 2 : 4;
+            OpenArc* nb = (OpenArc*)std::realloc(st->arcs, (size_t)nc * sizeof(OpenArc));
+            if (!nb) { std::fprintf(stderr, "realloc fst arcs failed\n"); std::exit(1); }
+            st->arcs = nb; st->cap = nc;
+        }
+        st->arcs[st->n++] = OpenArc{label, 0, 0};
+    }
+
+    void reg_grow() {
+        size_t nc = reg_cap * 2;
+        Reg* nb = (Reg*)std::calloc(nc, sizeof(Reg));
+        if (!nb) { std::fprintf(stderr, "calloc fst register failed\n"); std::exit(1); }
+        for (size_t i=0; i<reg_cap; i++) {
+            if (!reg[i].hash) continue;
+            size_t k = (size_t)reg[i].hash & (nc - 1);
+            while (nb[k].hash) k = (k + 1) & (nc - 1);
+            nb[k] = reg[i];
+        }
+        std::free(reg);
+        reg = nb; reg_cap = nc;
+    }
+
+    // Replaces the open state st by a frozen node; returns its offset.
+    uint64_t freeze(const OpenState* st, uint32_t* out_count) {
+        uint64_t h = (uint64_t)st->final * 0x9E3779B97F4A7C15ULL + st->n;
+        uint32_t count = (uint32_t)st->final;
+        for (uint32_t i=0; i<st->n; i++) {
+            h = mph_mix(h ^ (((uint64_t)st->arcs[i].label << 56) | st->arcs[i].target));
+            count += st->arcs[i].count;
+        }
+        if (!h) h = 1;
+        size_t k = (size_t)h & (reg_cap - 1);
+        for (; reg[k].hash; k = (k + 1) & (reg_cap - 1)) {
+            const Reg& r = reg[k];
+            if (r.hash != h || r.final != st->final || r.narcs != st->n) continue;
+            uint32_t i = 0;
+            while (i < st->n && sig[r.sig_at + i] == (((uint64_t)st->arcs[i].label << 56) | st->arcs[i].target)) i++;
+            if (i == st->n) { *out_count = r.count; return r.off; }
+        }
+
+        uint64_t off = out.n;
+        int dense = st->n >= FST_DENSE_ARCS;
+        out.put_vbyte((st->n << 2) | ((uint32_t)dense << 1) | (uint32_t)st->final);
+        if (dense) {
+            uint8_t wo = 1, wd = 1;
+            uint32_t acc = (uint32_t)st->final;
+            for (uint32_t i=0; i<st->n; i++) {
+                while (wo < 4 && (acc >> (8 * wo))) wo++;
+                while (wd < 8 && ((off - st->arcs[i].target) >> (8 * wd))) wd++;
+                acc += st->arcs[i].count;
+            }
+            out.put(&wo, 1);
+            out.put(&wd, 1);
+            for (uint32_t i=0; i<st->n; i++) out.put(&st->arcs[i].label, 1);
+            acc = (uint32_t)st->final;
+            for (uint32_t i=0; i<st->n; i++) {
+                uint8_t b[4] = { (uint8_t)acc, (uint8_t)(acc >> 8), (uint8_t)(acc >> 16), (uint8_t)(acc >> 24) };
+                out.put(b, wo);
+                acc += st->arcs[i].count;
+            }
+            for (uint32_t i=0; i<st->n; i++) {
+                uint64_t d = off - st->arcs[i].target;
+                uint8_t b[8];
+                for (int k=0; k<8; k++) b[k] = (uint8_t)(d >> (8 * k));
+                out.put(b, wd);
+            }
+        } else {
+            uint32_t acc = (uint32_t)st->final;
+            for (uint32_t i=0; i<st->n; i++) {
+                out.put(&st->arcs[i].label, 1);
+                if (i > 0) out.put_vbyte(acc);
+                out.put_vbyte64(off - st->arcs[i].target);
+                acc += st->arcs[i].count;
+            }
+        }
+        nodes++;
+        arcs += st->n;
+
+        if (sig_n + st->n > sig_cap) {
+            size_t nc = sig_cap ? sig_cap : 1024;
+            while (nc < sig_n + st->n) nc *= 2;
+            uint64_t* nb = (uint64_t*)std::realloc(sig, nc * sizeof(uint64_t));
+            if (!nb) { std::fprintf(stderr, "realloc fst signatures failed\n"); std::exit(1); }
+            sig = nb; sig_cap = nc;
+        }
+        Reg r{h, off, (uint64_t)sig_n, st->n, count, st->final};
+        for (uint32_t i=0; i<st->n; i++) sig[sig_n++] = ((uint64_t)st->arcs[i].label << 56) | st->arcs[i].target;
+        reg[k] = r;
+        if (++reg_n * 2 > reg_cap) reg_grow();
+        *out_count = count;
+        return off;
+    }
+
+    // Freezes the open states deeper than depth d.
+    void freeze_below(uint32_t d) {
+        for (uint32_t i=prev_len; i>d; i--) {
+            OpenArc& a = path[i - 1].arcs[path[i - 1].n - 1];
+            a.target = freeze(&path[i], &a.count);
+            path[i].n = 0;
+            path[i].final = 0;
+        }
+    }
+
+    // t must sort after the previous term (lexrec_cmp_by_term order).
+    void add(const char* t, uint32_t len) {
+        uint32_t common = 0;
+        while (common < len && common < prev_len && t[common] == prev[common]) common++;
+        freeze_below(common);
+        ensure_depth(len);
+        for (uint32_t d=common; d<len; d++) push_arc(&path[d], (uint8_t)t[d]);
+        path[len].final = 1;
+        if (len > prev_cap) {
+            uint32_t nc = prev_cap ? prev_cap : 64;
+            while (nc < len) nc *= 2;
+            char* nb = (char*)std::realloc(prev, nc);
+            if (!nb) { std::fprintf(stderr, "realloc fst term failed\n"); std::exit(1); }
+            prev = nb; prev_cap = nc;
+        }
+        std::memcpy(prev, t, len);
+        prev_len = len;
+        if (len > max_len) max_len = len;
+        terms++;
+    }
+
+    void write_to(const char* path_out) {
+        freeze_below(0);
+        uint32_t count;
+        uint64_t root = freeze(&path[0], &count);
+        FILE* f = std::fopen(path_out, "wb");
+        if (!f) { std::fprintf(stderr, "open %s failed: %s\n", path_out, std::strerror(errno)); std::exit(1); }
+        FstHeader h{};
+        h.magic[0]='F'; h.magic[1]='S'; h.magic[2]='T'; h.magic[3]='D';
+        h.version = 1;
+        h.term_count = terms;
+        h.max_term_len = max_len;
+        h.root_off = root;
+        h.node_bytes = out.n;
+        std::fwrite(&h, sizeof(h), 1, f);
+        std::fwrite(out.a, 1, out.n, f);
+        std::fclose(f);
+    }
+
+    void destroy() {
+        for (uint32_t i=0; i<path_cap; i++) std::free(path[i].arcs);
+        std::free(path); path = nullptr; path_cap = 0;
+        std::free(prev); prev = nullptr; prev_len = prev_cap = 0;
+        std::free(reg); reg = nullptr; reg_cap = reg_n = 0;
+        std::free(sig); sig = nullptr; sig_n = sig_cap = 0;
+        out.free_mem();
+    }
+};
+
 struct LexBuilder {
     LexRec* recs = nullptr;
     uint32_t n = 0;
@@ -546,28 +1245,104 @@ struct LexBuilder {
         recs = nb; cap = new_cap;
     }
 
-    void add_term(const char* term, uint16_t tlen, uint64_t postings_off, uint32_t postings_len) {
+    void add_term(const char* term, uint16_t tlen, uint64_t postings_off, uint32_t df,
+                  uint32_t postings_len, uint16_t flags, float max_tf_score) {
         ensure();
         uint64_t off = (uint64_t)pool.used;
         pool.add(term, (int)tlen);
         LexRec r{};
         r.term_off = off;
         r.term_len = tlen;
-        r.flags = 0;
-        r.df = postings_len;
+        r.flags = flags;
+        r.df = df;
         r.postings_off = postings_off;
         r.postings_len = postings_len;
-        r.reserved = 0;
+        r.max_tf_score = max_tf_score;
         recs[n++] = r;
         sum_term_len += (uint64_t)tlen;
     }
 
-    void write_to(const char* path) {
+    // v2: front-coded blocks (see LexHeader2).
+    void write_front_coded(FILE* f, uint32_t block_terms) {
+        uint32_t nblocks = (n + block_terms - 1) / block_terms;
+        uint64_t* offs = (uint64_t*)std::malloc(((size_t)nblocks + 1) * sizeof(uint64_t));
+        if (!offs) { std::fprintf(stderr, "malloc lexicon block table failed\n"); std::exit(1); }
+        ByteBuf enc;
+        LexHeader2 h{};
+        std::fwrite(&h, sizeof(h), 1, f);
+        uint64_t cursor = sizeof(LexHeader2);
+        for (uint32_t b=0; b<nblocks; b++) {
+            enc.n = 0;
+            offs[b] = cursor;
+            uint32_t lo = b * block_terms, hi = lo + block_terms < n ? lo + block_terms : n;
+            for (uint32_t i=lo; i<hi; i++) {
+                const LexRec& r = recs[i];
+                const char* t = pool.buf + r.term_off;
+                if (i == lo) {
+                    enc.put_vbyte(r.term_len);
+                    enc.put(t, r.term_len);
+                } else {
+                    const LexRec& q = recs[i-1];
+                    const char* u = pool.buf + q.term_off;
+                    uint32_t shared = 0;
+                    while (shared < r.term_len && shared < q.term_len && t[shared] == u[shared]) shared++;
+                    enc.put_vbyte(shared);
+                    enc.put_vbyte(r.term_len - shared);
+                    enc.put(t + shared, r.term_len - shared);
+                }
+                enc.put_vbyte(r.flags);
+                enc.put_vbyte(r.df);
+                enc.put_vbyte(r.postings_len);
+                enc.put_vbyte64(i == lo ? r.postings_off : r.postings_off - recs[i-1].postings_off);
+                if (r.flags & LEX_F_BLOCKMAX) enc.put(&r.max_tf_score, sizeof(float));
+            }
+            std::fwrite(enc.a, 1, enc.n, f);
+            cursor += enc.n;
+        }
+        offs[nblocks] = cursor;
+        std::fwrite(offs, sizeof(uint64_t), (size_t)nblocks + 1, f);
+        std::free(offs);
+        enc.free_mem();
+
+        h.magic[0]='L'; h.magic[1]='E'; h.magic[2]='X'; h.magic[3]='I';
+        h.version = 2;
+        h.term_count = n;
+        h.block_terms = block_terms;
+        h.nblocks = nblocks;
+        h.table_off = cursor;
+        std::fseek(f, 0, SEEK_SET);
+        std::fwrite(&h, sizeof(h), 1, f);
+    }
+
+    void write_to(const char* path, uint32_t version, uint32_t block_terms) {
         g_lex_pool_for_sort = pool.buf;
         std::qsort(recs, n, sizeof(LexRec), lexrec_cmp_by_term);
         g_lex_pool_for_sort = nullptr;
         FILE* f = std::fopen(path, "wb");
         if (!f) { std::fprintf(stderr, "open %s failed: %s\n", path, std::strerror(errno)); std::exit(1); }
+        if (version == 2) {
+            write_front_coded(f, block_terms);
+            std::fclose(f);
+            return;
+        }
+        if (version == 3) {
+            LexHeader h{};
+            h.magic[0]='L'; h.magic[1]='E'; h.magic[2]='X'; h.magic[3]='I';
+            h.version = 3;
+            h.term_count = n;
+            std::fwrite(&h, sizeof(h), 1, f);
+            for (uint32_t i=0; i<n; i++) {
+                LexRec3 r{};
+                r.postings_off = recs[i].postings_off;
+                r.postings_len = recs[i].postings_len;
+                r.df = recs[i].df;
+                r.flags = recs[i].flags;
+                r.max_tf_score = recs[i].max_tf_score;
+                std::fwrite(&r, sizeof(r), 1, f);
+            }
+            std::fclose(f);
+            return;
+        }
 
         LexHeader h{};
         h.magic[0]='L'; h.magic[1]='E'; h.magic[2]='X'; h.magic[3]='I';
@@ -582,6 +1357,187 @@ struct LexBuilder {
         std::fclose(f);
     }
 
+    // lexicon.fst for the sorted terms (after write_to).
+    void write_fst(const char* path) {
+        FstBuilder fb;
+        fb.init();
+        for (uint32_t i=0; i<n; i++) fb.add(pool.buf + recs[i].term_off, recs[i].term_len);
+        fb.write_to(path);
+        std::printf("[INDEX STATS] fst_nodes=%u fst_arcs=%llu fst_bytes=%llu term_pool_bytes=%llu\n",
+                    fb.nodes, (unsigned long long)fb.arcs, (unsigned long long)(sizeof(FstHeader) + fb.out.n),
+                    (unsigned long long)pool.used);
+        fb.destroy();
+    }
+
+    // lexicon.kgram for the sorted terms (after write_to). (gram << 32 | ordinal)
+    // pairs come out in ordinal order; a stable LSD radix sort on the 24-bit
+    // gram groups them without reordering the ordinals.
+    void write_kgram(const char* path) {
+        uint64_t np = 0;
+        for (uint32_t i=0; i<n; i++) np += (uint64_t)recs[i].term_len + 3 - KGRAM_K;
+        uint64_t* a = (uint64_t*)std::malloc((size_t)(np ? np : 1) * sizeof(uint64_t));
+        uint64_t* b = (uint64_t*)std::malloc((size_t)(np ? np : 1) * sizeof(uint64_t));
+        if (!a || !b) { std::fprintf(stderr, "malloc kgram pairs failed\n"); std::exit(1); }
+        size_t m = 0;
+        for (uint32_t i=0; i<n; i++) {
+            const uint8_t* t = (const uint8_t*)pool.buf + recs[i].term_off;
+            uint32_t len = recs[i].term_len + 2;
+            uint32_t g = 0;
+            for (uint32_t j=0; j<len; j++) {
+                uint32_t c = (j == 0 || j == len - 1) ? '$' : t[j - 1];
+                g = ((g << 8) | c) & ((1u << (8 * KGRAM_K)) - 1);
+                if (j + 1 >= KGRAM_K) a[m++] = (uint64_t)g << 32 | i;
+            }
+        }
+        for (uint32_t sh=32; sh<32 + 8*KGRAM_K; sh+=8) {
+            size_t cnt[257] = {0};
+            for (size_t i=0;i<m;i++) cnt[((a[i] >> sh) & 255) + 1]++;
+            for (int k=0;k<256;k++) cnt[k + 1] += cnt[k];
+            for (size_t i=0;i<m;i++) b[cnt[(a[i] >> sh) & 255]++] = a[i];
+            uint64_t* t = a; a = b; b = t;
+        }
+
+        ByteBuf lists, keys, offs;
+        uint32_t grams = 0;
+        size_t i = 0;
+        while (i < m) {
+            uint32_t g = (uint32_t)(a[i] >> 32);
+            uint64_t off = lists.n;
+            offs.put(&off, 8);
+            keys.put(&g, 4);
+            grams++;
+            uint32_t prev = 0;
+            int first = 1;
+            for (; i < m && (uint32_t)(a[i] >> 32) == g; i++) {
+                uint32_t o = (uint32_t)a[i];
+                if (!first && o == prev) continue;     // gram repeated within the term
+                lists.put_vbyte(first ? o : o - prev);
+                prev = o;
+                first = 0;
+            }
+        }
+        uint64_t end = lists.n;
+        offs.put(&end, 8);
+
+        FILE* f = std::fopen(path, "wb");
+        if (!f) { std::fprintf(stderr, "open %s failed: %s\n", path, std::strerror(errno)); std::exit(1); }
+        KgramHeader kh{};
+        kh.magic[0]='K'; kh.magic[1]='G'; kh.magic[2]='R'; kh.magic[3]='M';
+        kh.version = 1;
+        kh.term_count = n;
+        kh.k = KGRAM_K;
+        kh.gram_count = grams;
+        kh.list_bytes = lists.n;
+        std::fwrite(&kh, sizeof(kh), 1, f);
+        std::fwrite(offs.a, 1, offs.n, f);
+        if (keys.n) std::fwrite(keys.a, 1, keys.n, f);
+        if (lists.n) std::fwrite(lists.a, 1, lists.n, f);
+        std::fclose(f);
+        std::printf("[INDEX STATS] kgram_grams=%u kgram_pairs=%llu kgram_bytes=%llu\n", grams, (unsigned long long)m,
+                    (unsigned long long)(sizeof(kh) + offs.n + keys.n + lists.n));
+        lists.free_mem(); keys.free_mem(); offs.free_mem();
+        std::free(a); std::free(b);
+    }
+
+    // lexicon.mph for the sorted terms (after write_to). Each level takes
+    // gamma bits per key still unplaced; keys that collide there go on to
+    // the next level. Returns 0 without writing if keys are left after
+    // MPH_MAX_LEVELS levels.
+    int write_mph(const char* path, double gamma) {
+        size_t nn = n ? n : 1;
+        uint64_t* h = (uint64_t*)std::malloc(nn * sizeof(uint64_t));
+        uint64_t* gpos = (uint64_t*)std::malloc(nn * sizeof(uint64_t));
+        uint32_t* pend = (uint32_t*)std::malloc(nn * sizeof(uint32_t));
+        if (!h || !gpos || !pend) { std::fprintf(stderr, "malloc mph keys failed\n"); std::exit(1); }
+        for (uint32_t i=0; i<n; i++) {
+            h[i] = fnv1a_64(pool.buf + recs[i].term_off, recs[i].term_len);
+            pend[i] = i;
+        }
+
+        ByteBuf words;
+        uint64_t level_bits[MPH_MAX_LEVELS + 1];
+        uint32_t nlevels = 0, np = n;
+        uint64_t base = 0;
+        while (np > 0 && nlevels < MPH_MAX_LEVELS) {
+            uint64_t bits = ((uint64_t)(gamma * np) + 63) & ~(uint64_t)63;
+            if (bits < 64) bits = 64;
+            size_t nw = (size_t)(bits / 64);
+            uint64_t* seen = (uint64_t*)std::calloc(nw, sizeof(uint64_t));
+            uint64_t* coll = (uint64_t*)std::calloc(nw, sizeof(uint64_t));
+            if (!seen || !coll) { std::fprintf(stderr, "calloc mph level failed\n"); std::exit(1); }
+            for (uint32_t k=0; k<np; k++) {
+                uint64_t p = mph_pos(h[pend[k]], nlevels, bits);
+                uint64_t m = 1ULL << (p & 63);
+                if (seen[p >> 6] & m) coll[p >> 6] |= m;
+                else seen[p >> 6] |= m;
+            }
+            uint32_t keep = 0;
+            for (uint32_t k=0; k<np; k++) {
+                uint32_t i = pend[k];
+                uint64_t p = mph_pos(h[i], nlevels, bits);
+                if ((coll[p >> 6] >> (p & 63)) & 1) pend[keep++] = i;
+                else gpos[i] = base + p;
+            }
+            for (size_t w=0; w<nw; w++) seen[w] &= ~coll[w];
+            words.put(seen, nw * sizeof(uint64_t));
+            std::free(seen); std::free(coll);
+            level_bits[nlevels++] = base;
+            base += bits;
+            np = keep;
+        }
+        level_bits[nlevels] = base;
+        if (np > 0) {
+            std::fprintf(stderr, "WARN: %u terms unplaced after %u mph levels, %s not written\n", np, nlevels, path);
+            words.free_mem();
+            std::free(h); std::free(gpos); std::free(pend);
+            return 0;
+        }
+
+        const uint64_t* wd = (const uint64_t*)words.a;
+        size_t nw = (size_t)(base / 64), nr = nw + 1;
+        uint32_t* rank = (uint32_t*)std::malloc(nr * sizeof(uint32_t));
+        uint32_t* ord = (uint32_t*)std::malloc(nn * sizeof(uint32_t));
+        uint16_t* fp = (uint16_t*)std::malloc(nn * sizeof(uint16_t));
+        if (!rank || !ord || !fp) { std::fprintf(stderr, "malloc mph tables failed\n"); std::exit(1); }
+        uint32_t c = 0;
+        for (size_t w=0; w<nw; w++) {
+            rank[w] = c;
+            c += (uint32_t)__builtin_popcountll(wd[w]);
+        }
+        rank[nw] = c;
+        for (uint32_t i=0; i<n; i++) {
+            uint64_t p = gpos[i];
+            size_t w = (size_t)(p >> 6);
+            uint32_t slot = rank[w] + (uint32_t)__builtin_popcountll(wd[w] & ((1ULL << (p & 63)) - 1));
+            ord[slot] = i;
+            fp[slot] = mph_fingerprint(h[i]);
+        }
+
+        FILE* f = std::fopen(path, "wb");
+        if (!f) { std::fprintf(stderr, "open %s failed: %s\n", path, std::strerror(errno)); std::exit(1); }
+        MphHeader mh{};
+        mh.magic[0]='M'; mh.magic[1]='P'; mh.magic[2]='H'; mh.magic[3]='F';
+        mh.version = 1;
+        mh.term_count = n;
+        mh.nlevels = nlevels;
+        mh.total_bits = base;
+        std::fwrite(&mh, sizeof(mh), 1, f);
+        std::fwrite(level_bits, sizeof(uint64_t), (size_t)nlevels + 1, f);
+        std::fwrite(wd, sizeof(uint64_t), nw, f);
+        std::fwrite(rank, sizeof(uint32_t), nr, f);
+        std::fwrite(ord, sizeof(uint32_t), n, f);
+        std::fwrite(fp, sizeof(uint16_t), n, f);
+        std::fclose(f);
+        std::printf("[INDEX STATS] mph_levels=%u mph_bits_per_term=%.2f mph_bytes=%llu\n", nlevels,
+                    n ? (double)base / n : 0.0,
+                    (unsigned long long)(sizeof(mh) + ((size_t)nlevels + 1) * 8 + nw * 8 + nr * 4 + (size_t)n * 6));
+
+        words.free_mem();
+        std::free(rank); std::free(ord); std::free(fp);
+        std::free(h); std::free(gpos); std::free(pend);
+        return 1;
+    }
+
     double avg_term_len() const {
         if (n == 0) return 0.0;
         return (double)sum_term_len / (double)n;
@@ -594,7 +1550,308 @@ struct LexBuilder {
     }
 };
 
-static void merge_blocks_to_index(const char* blocks_dir, const char* out_lex, const char* out_post) {
+struct MergeOpts {
+    size_t readahead_bytes = (size_t)4 << 20;
+    uint32_t postings_version = 1;
+    // block-max bounds (written with tf)
+    const uint32_t* doc_lens = nullptr;
+    uint32_t doc_count = 0;
+    double avg_doc_len = 0.0;
+    float bm25_k1 = 1.2f;
+    float bm25_b = 0.75f;
+    // terms with df > bitmap_frac * doc_count are written as bitmaps (0 = never)
+    double bitmap_frac = 0.0;
+    // lexicon.bin format; v2 front-codes lex_block terms per block, v3 keeps
+    // only the records (terms in lexicon.fst)
+    uint32_t lexicon_version = 1;
+    uint32_t lex_block = 32;
+    // > 0: also write lexicon.mph, gamma bits per key and level
+    double mph_gamma = 0.0;
+    // also write lexicon.fst (implied by lexicon v3)
+    int write_fst = 0;
+    // also write lexicon.kgram
+    int write_kgram = 0;
+};
+
+// Max of tf*(k1+1) / (tf + k1*(1-b+b*dl/avgdl)) over each block, rounded up
+// so that query-time sums in double never exceed the stored bound.
+static float block_max_tf_scores(const MergeOpts& mo, const uint32_t* ids, const uint32_t* tfs,
+                                 uint32_t n, ByteBuf* out) {
+    float term_max = 0.0f;
+    double k1 = mo.bm25_k1, b = mo.bm25_b;
+    for (uint32_t lo=0; lo<n; lo+=POSTINGS_BLOCK) {
+        uint32_t hi = lo + POSTINGS_BLOCK < n ? lo + POSTINGS_BLOCK : n;
+        double m = 0.0;
+        for (uint32_t i=lo; i<hi; i++) {
+            double norm = k1;
+            if (mo.avg_doc_len > 0.0 && ids[i] < mo.doc_count)
+                norm = k1 * (1.0 - b + b * (double)mo.doc_lens[ids[i]] / mo.avg_doc_len);
+            double tf = (double)tfs[i];
+            double v = tf * (k1 + 1.0) / (tf + norm);
+            if (v > m) m = v;
+        }
+        float f = (float)(m * (1.0 + 1e-6));
+        out->put(&f, sizeof(f));
+        if (f > term_max) term_max = f;
+    }
+    return term_max;
+}
+
+// Union for lists carrying positions (runs of tf[i] positions per id). A doc
+// present in both gets the sorted union of its two runs.
+static void merge_union_pos(const U32List& a, const U32List& atf, const U32List& apos,
+                            const uint32_t* b, const uint32_t* btf, const uint32_t* bpos, uint32_t nb,
+                            U32List* o, U32List* otf, U32List* opos) {
+    o->n = otf->n = opos->n = 0;
+    uint32_t i = 0, j = 0;
+    const uint32_t* pa = apos.a;
+    const uint32_t* pb = bpos;
+    while (i < a.n || j < nb) {
+        int take_a = (j >= nb) || (i < a.n && a.a[i] <= b[j]);
+        int take_b = (i >= a.n) || (j < nb && b[j] <= a.a[i]);
+        uint32_t doc = take_a ? a.a[i] : b[j];
+        uint32_t na = take_a ? atf.a[i] : 0, nbp = take_b ? btf[j] : 0;
+        opos->reserve(opos->n + na + nbp);
+        uint32_t x = 0, y = 0, cnt = 0;
+        while (x < na || y < nbp) {
+            uint32_t v;
+            if (y >= nbp || (x < na && pa[x] < pb[y])) v = pa[x++];
+            else if (x >= na || pb[y] < pa[x]) v = pb[y++];
+            else { v = pa[x++]; y++; }
+            opos->a[opos->n++] = v;
+            cnt++;
+        }
+        o->push(doc);
+        otf->push(cnt);
+        if (take_a) { pa += na; i++; }
+        if (take_b) { pb += nbp; j++; }
+    }
+}
+
+// Appends one term's positions to positions.bin: a uint32 directory with
+// the byte offset of every 128-posting block (relative to the end of the
+// directory), then per posting VByte(tf) followed by tf VByte position
+// deltas, so a reader can jump to any posting's block and skip the rest.
+struct PositionsWriter {
+    FILE* fp = nullptr;
+    uint64_t cursor = 0;
+    ByteBuf enc;
+    ByteBuf offsets;
+
+    void open(const char* path) {
+        fp = std::fopen(path, "wb");
+        if (!fp) { std::fprintf(stderr, "open %s failed: %s\n", path, std::strerror(errno)); std::exit(1); }
+        PosHeader h{};
+        std::fwrite(&h, sizeof(h), 1, fp);
+        cursor = sizeof(PosHeader);
+    }
+
+    void add(const uint32_t* tfs, const uint32_t* pos, uint32_t n) {
+        offsets.put(&cursor, sizeof(cursor));
+        uint32_t nblocks = (n + POSTINGS_BLOCK - 1) / POSTINGS_BLOCK;
+        size_t dir_bytes = (size_t)nblocks * sizeof(uint32_t);
+        enc.n = 0;
+        enc.reserve(dir_bytes);
+        enc.n = dir_bytes;
+        for (uint32_t i=0;i<n;i++) {
+            if (i % POSTINGS_BLOCK == 0) {
+                uint32_t off = (uint32_t)(enc.n - dir_bytes);
+                std::memcpy(enc.a + (size_t)(i / POSTINGS_BLOCK) * sizeof(uint32_t), &off, sizeof(off));
+            }
+            enc.put_vbyte(tfs[i]);
+            uint32_t prev = 0;
+            for (uint32_t k=0;k<tfs[i];k++) {
+                enc.put_vbyte(pos[k] - prev);
+                prev = pos[k];
+            }
+            pos += tfs[i];
+        }
+        std::fwrite(enc.a, 1, enc.n, fp);
+        cursor += (uint64_t)enc.n;
+    }
+
+    void finish(uint32_t term_count, uint32_t doc_count, uint64_t postings_bytes) {
+        offsets.put(&cursor, sizeof(cursor));
+        std::fwrite(offsets.a, 1, offsets.n, fp);
+        PosHeader h{};
+        h.magic[0]='P'; h.magic[1]='O'; h.magic[2]='S'; h.magic[3]='N';
+        h.version = 2;
+        h.term_count = term_count;
+        h.table_off = cursor;
+        h.doc_count = doc_count;
+        h.postings_bytes = postings_bytes;
+        std::fseek(fp, 0, SEEK_SET);
+        std::fwrite(&h, sizeof(h), 1, fp);
+        std::fclose(fp);
+        fp = nullptr;
+        enc.free_mem();
+        offsets.free_mem();
+    }
+};
+
+// Appends one term's merged postings to postings.bin in the chosen format
+// and registers it in the lexicon.
+struct PostingsWriter {
+    FILE* fp = nullptr;
+    uint64_t cursor = 0;
+    MergeOpts mo;
+    ByteBuf enc;
+    uint32_t bitmaps = 0;
+    uint32_t roar_chunks[3] = {0, 0, 0};
+
+    // v1 tf array (uint16, padded to 4 bytes) and block-max floats into enc.
+    float encode_tfs(const uint32_t* ids, const uint32_t* tfs, uint32_t n, int with_bmax) {
+        enc.n = 0;
+        enc.reserve((size_t)n * 2 + 2);
+        for (uint32_t i=0;i<n;i++) {
+            uint16_t t = tfs[i] > 0xFFFF ? 0xFFFF : (uint16_t)tfs[i];
+            enc.put(&t, sizeof(t));
+        }
+        if (n & 1) { uint16_t pad = 0; enc.put(&pad, sizeof(pad)); }
+        return with_bmax ? block_max_tf_scores(mo, ids, tfs, n, &enc) : 0.0f;
+    }
+
+    void add_bitmap(LexBuilder* lex, const char* term, uint16_t tlen,
+                    const uint32_t* ids, const uint32_t* tfs, uint32_t n, uint16_t flags, int with_bmax) {
+        pad_to(8);
+        uint64_t off = cursor;
+        size_t words = ((size_t)mo.doc_count + 63) / 64;
+        uint64_t* bits = (uint64_t*)std::calloc(words ? words : 1, sizeof(uint64_t));
+        if (!bits) { std::fprintf(stderr, "calloc bitmap failed\n"); std::exit(1); }
+        for (uint32_t i=0;i<n;i++) bits[ids[i] >> 6] |= 1ULL << (ids[i] & 63);
+        std::fwrite(bits, sizeof(uint64_t), words, fp);
+        std::free(bits);
+        uint64_t len = (uint64_t)words * 8;
+        float term_max = 0.0f;
+        if (tfs) {
+            term_max = encode_tfs(ids, tfs, n, with_bmax);
+            std::fwrite(enc.a, 1, enc.n, fp);
+            len += enc.n;
+        }
+        cursor += len;
+        lex->add_term(term, tlen, off, n, (uint32_t)len, flags | LEX_F_BITMAP, term_max);
+        bitmaps++;
+    }
+
+    void pad_to(uint32_t align) {
+        static const uint8_t zero[8] = {0};
+        uint32_t pad = (uint32_t)((align - (cursor & (align - 1))) & (align - 1));
+        if (pad) { std::fwrite(zero, 1, pad, fp); cursor += pad; }
+    }
+
+    // v3: one container per 65536-id chunk, whichever of array (2 bytes per
+    // value), bitmap (8 KB) or runs (4 bytes per run) is smallest.
+    void add_roaring(LexBuilder* lex, const char* term, uint16_t tlen,
+                     const uint32_t* ids, const uint32_t* tfs, uint32_t n, uint16_t flags, int with_bmax) {
+        pad_to(8);
+        uint64_t off = cursor;
+        uint32_t nchunks = 0;
+        for (uint32_t i=0;i<n;i++) if (i == 0 || (ids[i] >> 16) != (ids[i-1] >> 16)) nchunks++;
+        size_t dir_bytes = sizeof(RoarHead) + (size_t)nchunks * sizeof(RoarChunk);
+        enc.n = 0;
+        enc.reserve(dir_bytes);
+        enc.n = dir_bytes;
+        std::memset(enc.a, 0, dir_bytes);
+        RoarChunk* dir = (RoarChunk*)(enc.a + sizeof(RoarHead));
+        uint32_t k = 0;
+        for (uint32_t lo=0; lo<n; k++) {
+            uint32_t key = ids[lo] >> 16, hi = lo + 1, runs = 1;
+            for (; hi<n && (ids[hi] >> 16) == key; hi++) if (ids[hi] != ids[hi-1] + 1) runs++;
+            uint32_t card = hi - lo;
+            uint64_t arr_b = (uint64_t)card * 2, run_b = (uint64_t)runs * 4;
+            uint16_t type = ROAR_ARRAY;
+            if (run_b < arr_b && run_b < ROAR_BITMAP_BYTES) type = ROAR_RUN;
+            else if (arr_b > ROAR_BITMAP_BYTES) type = ROAR_BITMAP;
+            if (type == ROAR_BITMAP) {
+                while (enc.n & 7) { uint8_t z = 0; enc.put(&z, 1); }
+            }
+            RoarChunk ch{};
+            ch.key = (uint16_t)key;
+            ch.type = type;
+            ch.rank = lo;
+            ch.off = (uint32_t)enc.n;
+            if (type == ROAR_ARRAY) {
+                ch.n = card;
+                for (uint32_t i=lo;i<hi;i++) { uint16_t v = (uint16_t)ids[i]; enc.put(&v, 2); }
+            } else if (type == ROAR_BITMAP) {
+                ch.n = card;
+                size_t at = enc.n;
+                enc.reserve(at + ROAR_BITMAP_BYTES);
+                std::memset(enc.a + at, 0, ROAR_BITMAP_BYTES);
+                uint64_t* w = (uint64_t*)(enc.a + at);
+                for (uint32_t i=lo;i<hi;i++) { uint32_t v = ids[i] & 0xFFFF; w[v >> 6] |= 1ULL << (v & 63); }
+                enc.n = at + ROAR_BITMAP_BYTES;
+            } else {
+                ch.n = runs;
+                for (uint32_t i=lo;i<hi;) {
+                    uint32_t j = i + 1;
+                    while (j < hi && ids[j] == ids[j-1] + 1) j++;
+                    uint16_t se[2] = {(uint16_t)ids[i], (uint16_t)ids[j-1]};
+                    enc.put(se, sizeof(se));
+                    i = j;
+                }
+            }
+            // enc may have grown: re-derive the directory pointer
+            dir = (RoarChunk*)(enc.a + sizeof(RoarHead));
+            dir[k] = ch;
+            roar_chunks[type]++;
+            lo = hi;
+        }
+        while (enc.n & 3) { uint8_t z = 0; enc.put(&z, 1); }
+        RoarHead h{nchunks, (uint32_t)enc.n};
+        std::memcpy(enc.a, &h, sizeof(h));
+        std::fwrite(enc.a, 1, enc.n, fp);
+        uint64_t len = enc.n;
+        float term_max = 0.0f;
+        if (tfs) {
+            term_max = encode_tfs(ids, tfs, n, with_bmax);
+            std::fwrite(enc.a, 1, enc.n, fp);
+            len += enc.n;
+        }
+        cursor += len;
+        lex->add_term(term, tlen, off, n, (uint32_t)len, flags | LEX_F_ROARING, term_max);
+    }
+
+    void add(LexBuilder* lex, const char* term, uint16_t tlen,
+             const uint32_t* ids, const uint32_t* tfs, uint32_t n) {
+        uint64_t off = cursor;
+        uint16_t flags = tfs ? LEX_F_TF : 0;
+        int with_bmax = tfs && mo.doc_lens;
+        float term_max = 0.0f;
+        if (with_bmax) flags |= LEX_F_BLOCKMAX;
+        if (mo.postings_version == 3) {
+            add_roaring(lex, term, tlen, ids, tfs, n, flags, with_bmax);
+            return;
+        }
+        if (mo.bitmap_frac > 0.0 && mo.doc_count > 0 && n > 0 && ids[n-1] < mo.doc_count &&
+            (double)n > mo.bitmap_frac * (double)mo.doc_count) {
+            add_bitmap(lex, term, tlen, ids, tfs, n, flags, with_bmax);
+            return;
+        }
+        if (mo.postings_version >= 2) {
+            encode_vbyte_blocks(ids, tfs, n, &enc);
+            if (with_bmax) term_max = block_max_tf_scores(mo, ids, tfs, n, &enc);
+            std::fwrite(enc.a, 1, enc.n, fp);
+            cursor += (uint64_t)enc.n;
+            lex->add_term(term, tlen, off, n, (uint32_t)enc.n, flags | LEX_F_VBYTE, term_max);
+            return;
+        }
+        if (n > 0) {
+            std::fwrite(ids, sizeof(uint32_t), n, fp);
+            cursor += (uint64_t)n * sizeof(uint32_t);
+            if (tfs) {
+                term_max = encode_tfs(ids, tfs, n, with_bmax);
+                std::fwrite(enc.a, 1, enc.n, fp);
+                cursor += (uint64_t)enc.n;
+            }
+        }
+        lex->add_term(term, tlen, off, n, n, flags, term_max);
+    }
+};
+
+static void merge_blocks_to_index(const char* blocks_dir, const char* out_lex, const char* out_mph, const char* out_fst,
+                                  const char* out_kgram, const char* out_post,
+                                  const char* out_pos, const MergeOpts& mo) {
     DIR* d = opendir(blocks_dir);
     if (!d) { std::fprintf(stderr, "opendir %s failed: %s\n", blocks_dir, std::strerror(errno)); std::exit(1); }
 
@@ -623,9 +1880,12 @@ static void merge_blocks_to_index(const char* blocks_dir, const char* out_lex, c
 
     if (n == 0) { std::fprintf(stderr, "No .blk found in %s\n", blocks_dir); std::exit(1); }
 
+    // block_NNNN order == doc-id order, so postings of one term can be concatenated.
+    std::qsort(names, n, sizeof(char*), block_name_cmp);
+
     BlockReader* br = (BlockReader*)std::malloc(n * sizeof(BlockReader));
     if (!br) { std::fprintf(stderr, "malloc br failed\n"); std::exit(1); }
-    std::memset(br, 0, n * sizeof(BlockReader));
+    for (size_t i=0;i<n;i++) br[i] = BlockReader{};
 
     for (size_t i=0;i<n;i++) {
         size_t dl = std::strlen(blocks_dir);
@@ -634,7 +1894,7 @@ static void merge_blocks_to_index(const char* blocks_dir, const char* out_lex, c
         std::memcpy(full, blocks_dir, dl);
         full[dl] = '/';
         std::memcpy(full + dl + 1, names[i], nl + 1);
-        br[i].open(full);
+        br[i].open(full, mo.readahead_bytes);
         std::free(full);
     }
 
@@ -642,7 +1902,9 @@ static void merge_blocks_to_index(const char* blocks_dir, const char* out_lex, c
     if (!fp) { std::fprintf(stderr, "open %s failed: %s\n", out_post, std::strerror(errno)); std::exit(1); }
     PostHeader ph{};
     ph.magic[0]='P'; ph.magic[1]='O'; ph.magic[2]='S'; ph.magic[3]='T';
-    ph.version = 1;
+    ph.version = mo.postings_version;
+    ph.bm25_k1 = mo.bm25_k1;
+    ph.bm25_b = mo.bm25_b;
     std::memset(ph.reserved, 0, sizeof(ph.reserved));
     std::fwrite(&ph, sizeof(ph), 1, fp);
     uint64_t postings_cursor = (uint64_t)sizeof(PostHeader);
@@ -650,53 +1912,105 @@ static void merge_blocks_to_index(const char* blocks_dir, const char* out_lex, c
     LexBuilder lex;
     lex.init(1024*1024, (size_t)128<<20);
 
-    while (1) {
-        ssize_t min_i = -1;
-        for (size_t i=0;i<n;i++) {
-            if (!br[i].has()) continue;
-            if (min_i < 0) min_i = (ssize_t)i;
-            else {
-                int c = lex_cmp_str(br[i].term, br[i].term_len, br[min_i].term, br[min_i].term_len);
-                if (c < 0) min_i = (ssize_t)i;
-            }
-        }
-        if (min_i < 0) break;
-
-        const char* cur_term = br[min_i].term;
-        uint16_t cur_len = br[min_i].term_len;
-
-        uint32_t* merged = (uint32_t*)std::malloc((size_t)br[min_i].df * sizeof(uint32_t));
-        if (!merged) { std::fprintf(stderr, "malloc merged failed\n"); std::exit(1); }
-        std::memcpy(merged, br[min_i].docs, (size_t)br[min_i].df * sizeof(uint32_t));
-        uint32_t merged_n = br[min_i].df;
-
-        br[min_i].next();
-
-        for (size_t i=0;i<n;i++) {
-            if (!br[i].has()) continue;
-            if (br[i].term_len == cur_len && std::memcmp(br[i].term, cur_term, cur_len) == 0) {
-                uint32_t out_n = 0;
-                uint32_t* out = merge_union_u32(merged, merged_n, br[i].docs, br[i].df, &out_n);
-                std::free(merged);
-                merged = out;
-                merged_n = out_n;
-                br[i].next();
+    BlockHeap heap;
+    heap.init(br, n);
+
+    int with_tf = 0, with_pos = 1;
+    for (size_t i=0;i<n;i++) if (br[i].has_tf) with_tf = 1;
+    for (size_t i=0;i<n;i++) if (!br[i].has_pos) with_pos = 0;
+
+    PositionsWriter posw;
+    if (with_pos) posw.open(out_pos);
+
+    PostingsWriter pw;
+    pw.fp = fp;
+    pw.cursor = postings_cursor;
+    pw.mo = mo;
+
+    char cur_term[1 << 16];
+    U32List merged, merged_tf, merged_pos;
+    U32List tmp, tmp_tf, tmp_pos;
+
+    while (heap.n > 0) {
+        uint32_t bi = heap.top();
+        uint16_t cur_len = br[bi].term_len;
+        std::memcpy(cur_term, br[bi].term, cur_len);
+        merged.n = 0;
+        merged_tf.n = 0;
+        merged_pos.n = 0;
+
+        do {
+            const uint32_t* docs = br[bi].docs;
+            const uint32_t* tfs = br[bi].tfs;
+            uint32_t df = br[bi].df;
+            if (merged.n == 0 || df == 0 || docs[0] > merged.a[merged.n-1]) {
+                merged.reserve(merged.n + df);
+                std::memcpy(merged.a + merged.n, docs, (size_t)df * sizeof(uint32_t));
+                if (with_tf) {
+                    merged_tf.reserve(merged.n + df);
+                    for (uint32_t k=0;k<df;k++) merged_tf.a[merged.n + k] = tfs ? tfs[k] : 1;
+                    merged_tf.n = merged.n + df;
+                }
+                if (with_pos) {
+                    uint32_t np = br[bi].npos;
+                    merged_pos.reserve(merged_pos.n + np);
+                    std::memcpy(merged_pos.a + merged_pos.n, br[bi].positions, (size_t)np * sizeof(uint32_t));
+                    merged_pos.n += np;
+                }
+                merged.n += df;
+            } else if (with_pos) {
+                merge_union_pos(merged, merged_tf, merged_pos, docs, tfs, br[bi].positions, df,
+                                &tmp, &tmp_tf, &tmp_pos);
+                U32List sw = merged; merged = tmp; tmp = sw;
+                sw = merged_tf; merged_tf = tmp_tf; tmp_tf = sw;
+                sw = merged_pos; merged_pos = tmp_pos; tmp_pos = sw;
+            } else {
+                tmp.reserve(merged.n + df);
+                if (with_tf) tmp_tf.reserve(merged.n + df);
+                tmp.n = merge_union_u32(merged.a, with_tf ? merged_tf.a : nullptr, merged.n,
+                                        docs, with_tf ? tfs : nullptr, df,
+                                        tmp.a, with_tf ? tmp_tf.a : nullptr);
+                tmp_tf.n = with_tf ? tmp.n : 0;
+                U32List sw = merged; merged = tmp; tmp = sw;
+                if (with_tf) { sw = merged_tf; merged_tf = tmp_tf; tmp_tf = sw; }
             }
-        }
-
-        uint64_t off = postings_cursor;
-        if (merged_n > 0) {
-            std::fwrite(merged, sizeof(uint32_t), merged_n, fp);
-            postings_cursor += (uint64_t)merged_n * sizeof(uint32_t);
-        }
-
-        lex.add_term(cur_term, cur_len, off, merged_n);
-
-        std::free(merged);
+            br[bi].next();
+            heap.fix_top();
+            if (heap.n == 0) break;
+            bi = heap.top();
+        } while (br[bi].term_len == cur_len && std::memcmp(br[bi].term, cur_term, cur_len) == 0);
+
+        pw.add(&lex, cur_term, cur_len, merged.a, with_tf ? merged_tf.a : nullptr, merged.n);
+        // terms leave the heap in lexicon order, so the offset table lines up
+        if (with_pos) posw.add(merged_tf.a, merged_pos.a, merged.n);
+    }
+    postings_cursor = pw.cursor;
+    if (mo.bitmap_frac > 0.0 && mo.postings_version < 3)
+        std::printf("[INDEX STATS] bitmap_terms=%u (df > %.4f * %u docs)\n", pw.bitmaps, mo.bitmap_frac, mo.doc_count);
+    if (mo.postings_version == 3)
+        std::printf("[INDEX STATS] roaring_containers array=%u bitmap=%u run=%u\n",
+                    pw.roar_chunks[ROAR_ARRAY], pw.roar_chunks[ROAR_BITMAP], pw.roar_chunks[ROAR_RUN]);
+    if (with_pos) {
+        std::printf("[INDEX STATS] positions_bytes=%llu\n", (unsigned long long)posw.cursor);
+        posw.finish(lex.n, mo.doc_count, postings_cursor);
+    } else {
+        // phrase/NEAR would read a stale positions.bin with the old doc ids
+        ::unlink(out_pos);
     }
 
+    heap.destroy();
+    merged.free_mem(); merged_tf.free_mem(); merged_pos.free_mem();
+    tmp.free_mem(); tmp_tf.free_mem(); tmp_pos.free_mem();
+    pw.enc.free_mem();
+
     std::fclose(fp);
-    lex.write_to(out_lex);
+    lex.write_to(out_lex, mo.lexicon_version, mo.lex_block);
+    // a stale lexicon.mph would map terms to the wrong ordinals
+    if (mo.mph_gamma <= 0.0 || !lex.write_mph(out_mph, mo.mph_gamma)) ::unlink(out_mph);
+    if (mo.write_fst || mo.lexicon_version == 3) lex.write_fst(out_fst);
+    else ::unlink(out_fst);
+    if (mo.write_kgram) lex.write_kgram(out_kgram);
+    else ::unlink(out_kgram);
 
     std::printf("[INDEX STATS] term_count=%u avg_term_len=%.3f postings_bytes=%llu\n",
         lex.n, lex.avg_term_len(), (unsigned long long)postings_cursor);
@@ -710,6 +2024,23 @@ static void merge_blocks_to_index(const char* blocks_dir, const char* out_lex, c
     lex.destroy();
 }
 
+// Without tf the posting is added on the first occurrence; with tf the
+// per-document counts (and, with positions, each token's term) are
+// collected in dset and flushed at document end.
+static inline void add_doc_token(const char* tok, int tok_len, uint32_t doc_id, TermTable* tt, DocTermSet* dset) {
+    if (tt->with_tf) {
+        int added = 0;
+        DocSetEntry* de = dset->find_or_add(tok, tok_len, &added);
+        de->count++;
+        if (tt->with_pos) dset->tok_ords.push(de->ord);
+        return;
+    }
+    if (!dset->contains_or_add(tok, tok_len)) {
+        TermEntry* e = tt->get_or_create(tok, tok_len);
+        if (e) tt->add_posting(e, doc_id);
+    }
+}
+
 static int process_one_doc(
     const char* txt_path,
     uint32_t doc_id,
@@ -717,7 +2048,8 @@ static int process_one_doc(
     DocTermSet* dset,
     uint64_t* total_bytes,
     uint64_t* total_tokens,
-    uint64_t* unique_terms_in_docs_sum
+    uint64_t* unique_terms_in_docs_sum,
+    uint32_t* out_doc_len
 ) {
     FILE* f = std::fopen(txt_path, "rb");
     if (!f) {
@@ -736,6 +2068,7 @@ static int process_one_doc(
     char tok[TOK_MAX];
     int tok_len = 0;
 
+    uint32_t doc_len = 0;
     size_t nread = 0;
     while ((nread = std::fread(buf, 1, BUF_SZ, f)) > 0) {
         *total_bytes += (uint64_t)nread;
@@ -748,13 +2081,8 @@ static int process_one_doc(
                 if (tok_len > 0) {
                     tok[tok_len] = '\0';
                     (*total_tokens)++;
-
-                    int already = dset->contains_or_add(tok, tok_len);
-                    if (!already) {
-                        TermEntry* e = tt->get_or_create(tok, tok_len);
-                        if (e) e->post.push_unique_sorted(doc_id);
-                        unique_in_doc++;
-                    }
+                    doc_len++;
+                    add_doc_token(tok, tok_len, doc_id, tt, dset);
                     tok_len = 0;
                 }
             }
@@ -763,15 +2091,40 @@ static int process_one_doc(
     if (tok_len > 0) {
         tok[tok_len] = '\0';
         (*total_tokens)++;
-
-        int already = dset->contains_or_add(tok, tok_len);
-        if (!already) {
-            TermEntry* e = tt->get_or_create(tok, tok_len);
-            if (e) e->post.push_unique_sorted(doc_id);
-            unique_in_doc++;
-        }
+        doc_len++;
+        add_doc_token(tok, tok_len, doc_id, tt, dset);
         tok_len = 0;
     }
+    unique_in_doc = dset->used;
+
+    if (tt->with_pos) {
+        // regroup token positions by term: counting sort on touched order
+        uint32_t start = 0;
+        for (size_t i=0;i<dset->used;i++) {
+            DocSetEntry& de = dset->tab[dset->touched[i]];
+            de.fill = start;
+            start += de.count;
+        }
+        dset->tok_pos.reserve(start);
+        for (uint32_t t=0; t<dset->tok_ords.n; t++) {
+            DocSetEntry& de = dset->tab[dset->touched[dset->tok_ords.a[t]]];
+            dset->tok_pos.a[de.fill++] = t;
+        }
+        for (size_t i=0;i<dset->used;i++) {
+            const DocSetEntry& de = dset->tab[dset->touched[i]];
+            TermEntry* e = tt->get_or_create(de.term, de.len);
+            if (!e) continue;
+            tt->add_posting_tf(e, doc_id, de.count);
+            tt->add_positions(e, dset->tok_pos.a + (de.fill - de.count), de.count);
+        }
+    } else if (tt->with_tf) {
+        for (size_t i=0;i<dset->used;i++) {
+            const DocSetEntry& de = dset->tab[dset->touched[i]];
+            TermEntry* e = tt->get_or_create(de.term, de.len);
+            if (e) tt->add_posting_tf(e, doc_id, de.count);
+        }
+    }
+    if (out_doc_len) *out_doc_len = doc_len;
 
     std::free(buf);
     std::fclose(f);
@@ -780,12 +2133,107 @@ static int process_one_doc(
     return 0;
 }
 
+// --threads N: documents are cut into contiguous batches of batch_docs ids.
+// Smallest per-thread share of --mem-mb: below it the worker's term table
+// and postings would flush a block every few documents.
+static const uint64_t MIN_THREAD_MEM = (uint64_t)32 << 20;
+
+// Each worker parses whole batches into its own TermTable and flushes at
+// least one block per batch, so every block covers a disjoint doc-id range
+// and block_<batch>_<sub> name order is doc-id order for the merge.
+struct ParallelParse {
+    char** paths = nullptr;
+    uint32_t n_docs = 0;
+    uint32_t batch_docs = 0;
+    uint32_t n_batches = 0;
+    const char* blocks_dir = nullptr;
+    uint32_t* doc_lens = nullptr;
+    int with_tf = 0;
+    int with_pos = 0;
+    uint64_t mem_limit_per_thread = 0;
+    uint64_t report_bytes = 0;
+    double t0 = 0.0;
+
+    std::atomic<uint32_t> next_batch{0};
+    std::atomic<uint32_t> docs_done{0};
+    std::atomic<uint32_t> blocks_written{0};
+    std::atomic<uint64_t> total_bytes{0};
+    std::atomic<uint64_t> total_tokens{0};
+    std::atomic<uint64_t> unique_terms_in_docs_sum{0};
+    std::atomic<uint64_t> next_report_bytes{0};
+    std::mutex log_mu;
+};
+
+static void parallel_flush(ParallelParse* pp, TermTable* tt, uint32_t batch, uint32_t* sub) {
+    char blk_path[1024];
+    std::snprintf(blk_path, sizeof(blk_path), "%s/block_%06u_%04u.blk", pp->blocks_dir, batch, (*sub)++);
+    {
+        std::lock_guard<std::mutex> lk(pp->log_mu);
+        std::printf("[FLUSH] writing %s terms=%llu\n", blk_path, (unsigned long long)tt->used);
+    }
+    write_block(blk_path, tt);
+    tt->clear();
+    pp->blocks_written++;
+}
+
+static void parallel_parse_worker(ParallelParse* pp) {
+    TermTable tt;
+    tt.init(term_table_cap(pp->mem_limit_per_thread, (size_t)1<<18), (size_t)16<<20);
+    tt.with_tf = pp->with_tf;
+    tt.with_pos = pp->with_pos;
+    DocTermSet dset;
+    dset.init((size_t)1<<17, (size_t)2<<20);
+
+    while (1) {
+        uint32_t b = pp->next_batch.fetch_add(1);
+        if (b >= pp->n_batches) break;
+        uint32_t lo = b * pp->batch_docs;
+        uint32_t hi = lo + pp->batch_docs;
+        if (hi > pp->n_docs) hi = pp->n_docs;
+        uint32_t sub = 0;
+
+        for (uint32_t d=lo; d<hi; d++) {
+            uint64_t bytes = 0, tokens = 0, uniq = 0;
+            process_one_doc(pp->paths[d], d, &tt, &dset, &bytes, &tokens, &uniq, &pp->doc_lens[d]);
+            uint32_t done = ++pp->docs_done;
+            uint64_t tb = (pp->total_bytes += bytes);
+            pp->total_tokens += tokens;
+            pp->unique_terms_in_docs_sum += uniq;
+
+            uint64_t nr = pp->next_report_bytes.load();
+            if (pp->report_bytes > 0 && tb >= nr &&
+                pp->next_report_bytes.compare_exchange_strong(nr, nr + pp->report_bytes)) {
+                double elapsed = now_sec_monotonic() - pp->t0;
+                double kb = (double)tb / 1024.0;
+                double kbps = (elapsed>0)? (kb/elapsed) : 0.0;
+                std::lock_guard<std::mutex> lk(pp->log_mu);
+                std::printf("[PROGRESS] docs=%u bytes=%llu (%.1f KB) tokens=%llu blocks=%u time=%.2f sec speed=%.1f KB/s\n",
+                    done, (unsigned long long)tb, kb,
+                    (unsigned long long)pp->total_tokens.load(),
+                    pp->blocks_written.load(), elapsed, kbps);
+            }
+
+            if (tt.approx_mem_bytes() >= pp->mem_limit_per_thread) parallel_flush(pp, &tt, b, &sub);
+        }
+        if (tt.used > 0) parallel_flush(pp, &tt, b, &sub);
+    }
+
+    tt.destroy();
+    dset.destroy();
+}
+
 int main(int argc, char** argv) {
     const char* manifest = nullptr;
     const char* corpus_dir = nullptr;
     const char* out_dir = "out";
     uint64_t mem_mb = 512;
     uint64_t report_mb = 200;
+    MergeOpts mo;
+    uint64_t readahead_kb = 4096;
+    uint32_t threads = 1;
+    uint32_t batch_docs = 1024;
+    int with_tf = 0;
+    int with_pos = 0;
 
     for (int i=1;i<argc;i++) {
         if (std::strcmp(argv[i], "--manifest") == 0 && i+1<argc) manifest = argv[++i];
@@ -793,8 +2241,48 @@ int main(int argc, char** argv) {
         else if (std::strcmp(argv[i], "--out") == 0 && i+1<argc) out_dir = argv[++i];
         else if (std::strcmp(argv[i], "--mem-mb") == 0 && i+1<argc) mem_mb = (uint64_t)std::strtoull(argv[++i], nullptr, 10);
         else if (std::strcmp(argv[i], "--report-mb") == 0 && i+1<argc) report_mb = (uint64_t)std::strtoull(argv[++i], nullptr, 10);
+        else if (std::strcmp(argv[i], "--merge-readahead-kb") == 0 && i+1<argc) readahead_kb = (uint64_t)std::strtoull(argv[++i], nullptr, 10);
+        else if (std::strcmp(argv[i], "--postings") == 0 && i+1<argc) {
+            const char* v = argv[++i];
+            if (std::strcmp(v, "v1") == 0 || std::strcmp(v, "raw") == 0) mo.postings_version = 1;
+            else if (std::strcmp(v, "v2") == 0 || std::strcmp(v, "vbyte") == 0) mo.postings_version = 2;
+            else if (std::strcmp(v, "v3") == 0 || std::strcmp(v, "roaring") == 0) mo.postings_version = 3;
+            else { std::fprintf(stderr, "Unknown postings format: %s (v1|v2|v3)\n", v); return 2; }
+        }
+        else if (std::strcmp(argv[i], "--threads") == 0 && i+1<argc) threads = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        else if (std::strcmp(argv[i], "--batch-docs") == 0 && i+1<argc) batch_docs = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        else if (std::strcmp(argv[i], "--with-tf") == 0) with_tf = 1;
+        else if (std::strcmp(argv[i], "--positions") == 0) with_pos = with_tf = 1;
+        else if (std::strcmp(argv[i], "--k1") == 0 && i+1<argc) mo.bm25_k1 = (float)std::strtod(argv[++i], nullptr);
+        else if (std::strcmp(argv[i], "--b") == 0 && i+1<argc) mo.bm25_b = (float)std::strtod(argv[++i], nullptr);
+        else if (std::strcmp(argv[i], "--bitmap-frac") == 0 && i+1<argc) mo.bitmap_frac = std::strtod(argv[++i], nullptr);
+        else if (std::strcmp(argv[i], "--lexicon") == 0 && i+1<argc) {
+            const char* v = argv[++i];
+            if (std::strcmp(v, "v1") == 0) mo.lexicon_version = 1;
+            else if (std::strcmp(v, "v2") == 0 || std::strcmp(v, "front") == 0) mo.lexicon_version = 2;
+            else if (std::strcmp(v, "v3") == 0 || std::strcmp(v, "fst") == 0) mo.lexicon_version = 3;
+            else { std::fprintf(stderr, "Unknown lexicon format: %s (v1|v2|v3)\n", v); return 2; }
+        }
+        else if (std::strcmp(argv[i], "--lex-block") == 0 && i+1<argc) {
+            mo.lex_block = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+            if (mo.lex_block < 16 || mo.lex_block > 64) { std::fprintf(stderr, "--lex-block must be 16..64\n"); return 2; }
+        }
+        else if (std::strcmp(argv[i], "--mph") == 0) mo.mph_gamma = 2.0;
+        else if (std::strcmp(argv[i], "--fst") == 0) mo.write_fst = 1;
+        else if (std::strcmp(argv[i], "--kgram") == 0) mo.write_kgram = 1;
+        else if (std::strcmp(argv[i], "--mph-gamma") == 0 && i+1<argc) {
+            mo.mph_gamma = std::strtod(argv[++i], nullptr);
+            if (mo.mph_gamma < 1.0 || mo.mph_gamma > 8.0) { std::fprintf(stderr, "--mph-gamma must be 1..8\n"); return 2; }
+        }
         else if (std::strcmp(argv[i], "--help") == 0) {
-            std::printf("Usage: %s --manifest manifest.jsonl --corpus ./corpus --out ./out [--mem-mb 512] [--report-mb 200]\n", argv[0]);
+            std::printf("Usage: %s --manifest manifest.jsonl --corpus ./corpus --out ./out [--mem-mb 512] [--report-mb 200] [--merge-readahead-kb 4096]\n"
+                        "       [--threads 1] [--batch-docs 1024] [--postings v1|v2|v3] [--with-tf [--k1 1.2] [--b 0.75]] [--positions]\n"
+                        "       [--bitmap-frac 0]   (terms with df > frac*docs as bitmaps, e.g. 0.125; not with v3)\n"
+                        "       [--lexicon v1|v2|v3 [--lex-block 32]]   (v2: front-coded blocks of 16..64 terms,\n"
+                        "                                                v3: no strings, terms only in lexicon.fst)\n"
+                        "       [--mph [--mph-gamma 2]]   (also write lexicon.mph for O(1) term lookup)\n"
+                        "       [--fst]   (also write lexicon.fst: term automaton for lookup and prefix ranges)\n"
+                        "       [--kgram]   (also write lexicon.kgram: 3-gram index of the terms for *infix* / *suffix wildcards)\n", argv[0]);
             return 0;
         } else {
             std::fprintf(stderr, "Unknown arg: %s\n", argv[i]);
@@ -805,6 +2293,8 @@ int main(int argc, char** argv) {
         std::fprintf(stderr, "Missing --manifest or --corpus\n");
         return 2;
     }
+    if (threads == 0) threads = 1;
+    if (batch_docs == 0) batch_docs = 1;
 
     ensure_dir(out_dir);
 
@@ -815,15 +2305,24 @@ int main(int argc, char** argv) {
     std::memcpy(blocks_dir + out_len + 1, "blocks", 6);
     blocks_dir[out_len + 1 + 6] = '\0';
     ensure_dir(blocks_dir);
+    clear_blocks_dir(blocks_dir);
 
     DocsBuilder docs;
     docs.init(40000, (size_t)64<<20);
 
-    TermTable tt;
-    tt.init((size_t)1<<21, (size_t)128<<20);
+    uint64_t mem_limit = mem_mb * 1024ULL * 1024ULL;
 
+    TermTable tt;
     DocTermSet dset;
-    dset.init((size_t)1<<17, (size_t)2<<20);
+    if (threads == 1) {
+        tt.init(term_table_cap(mem_limit, (size_t)1<<21), (size_t)128<<20);
+        dset.init((size_t)1<<17, (size_t)2<<20);
+    }
+    tt.with_tf = with_tf;
+    tt.with_pos = with_pos;
+
+    char** paths = nullptr;
+    uint32_t paths_cap = 0;
 
     FILE* fm = std::fopen(manifest, "rb");
     if (!fm) {
@@ -843,8 +2342,6 @@ int main(int argc, char** argv) {
     char line[1<<20];
     char docid_str[64], title[4096], url[8192];
 
-    uint64_t mem_limit = mem_mb * 1024ULL * 1024ULL;
-
     while (std::fgets(line, sizeof(line), fm)) {
         docid_str[0]=title[0]=url[0]='\0';
 
@@ -867,7 +2364,18 @@ int main(int argc, char** argv) {
         std::memcpy(txt + cd + 1 + di, ".txt", 4);
         txt[cd + 1 + di + 4] = '\0';
 
-        process_one_doc(txt, doc_id, &tt, &dset, &total_bytes, &total_tokens, &unique_terms_in_docs_sum);
+        if (threads > 1) {
+            if (doc_id == paths_cap) {
+                paths_cap = paths_cap ? paths_cap * 2 : 4096;
+                char** nb = (char**)std::realloc(paths, (size_t)paths_cap * sizeof(char*));
+                if (!nb) { std::fprintf(stderr, "realloc paths failed\n"); std::exit(1); }
+                paths = nb;
+            }
+            paths[doc_id++] = txt;
+            continue;
+        }
+
+        process_one_doc(txt, doc_id, &tt, &dset, &total_bytes, &total_tokens, &unique_terms_in_docs_sum, &docs.lens[doc_id]);
         std::free(txt);
 
         doc_id++;
@@ -901,6 +2409,41 @@ int main(int argc, char** argv) {
     }
     std::fclose(fm);
 
+    if (threads > 1) {
+        ParallelParse pp;
+        pp.paths = paths;
+        pp.n_docs = doc_id;
+        pp.batch_docs = batch_docs;
+        pp.n_batches = (doc_id + batch_docs - 1) / batch_docs;
+        pp.blocks_dir = blocks_dir;
+        pp.doc_lens = docs.lens;
+        pp.with_tf = with_tf;
+        pp.with_pos = with_pos;
+        pp.mem_limit_per_thread = mem_limit / threads;
+        if (pp.mem_limit_per_thread < MIN_THREAD_MEM) {
+            std::fprintf(stderr, "WARN: --mem-mb %llu is below %llu MB per thread, using %llu MB per thread\n",
+                (unsigned long long)mem_mb, (unsigned long long)(MIN_THREAD_MEM >> 20),
+                (unsigned long long)(MIN_THREAD_MEM >> 20));
+            pp.mem_limit_per_thread = MIN_THREAD_MEM;
+        }
+        pp.report_bytes = report_mb * 1024ULL * 1024ULL;
+        pp.next_report_bytes = pp.report_bytes;
+        pp.t0 = t0;
+
+        std::printf("[THREADS] workers=%u batches=%u batch_docs=%u\n", threads, pp.n_batches, batch_docs);
+        std::thread* workers = new std::thread[threads];
+        for (uint32_t w=0; w<threads; w++) workers[w] = std::thread(parallel_parse_worker, &pp);
+        for (uint32_t w=0; w<threads; w++) workers[w].join();
+        delete[] workers;
+
+        total_bytes = pp.total_bytes.load();
+        total_tokens = pp.total_tokens.load();
+        unique_terms_in_docs_sum = pp.unique_terms_in_docs_sum.load();
+
+        for (uint32_t i=0; i<doc_id; i++) std::free(paths[i]);
+        std::free(paths);
+    }
+
     if (tt.used > 0) {
         char blk_path[1024];
         std::snprintf(blk_path, sizeof(blk_path), "%s/block_%04u.blk", blocks_dir, block_id++);
@@ -913,12 +2456,26 @@ int main(int argc, char** argv) {
     std::snprintf(docs_path, sizeof(docs_path), "%s/docs.bin", out_dir);
     docs.write_to(docs_path);
 
-    char lex_path[1024], post_path[1024];
+    char doclen_path[1024];
+    std::snprintf(doclen_path, sizeof(doclen_path), "%s/doclen.bin", out_dir);
+    docs.write_lens_to(doclen_path);
+
+    char lex_path[1024], mph_path[1024], fst_path[1024], kgram_path[1024], post_path[1024], pos_path[1024];
     std::snprintf(lex_path, sizeof(lex_path), "%s/lexicon.bin", out_dir);
+    std::snprintf(mph_path, sizeof(mph_path), "%s/lexicon.mph", out_dir);
+    std::snprintf(fst_path, sizeof(fst_path), "%s/lexicon.fst", out_dir);
+    std::snprintf(kgram_path, sizeof(kgram_path), "%s/lexicon.kgram", out_dir);
     std::snprintf(post_path, sizeof(post_path), "%s/postings.bin", out_dir);
+    std::snprintf(pos_path, sizeof(pos_path), "%s/positions.bin", out_dir);
 
     std::printf("[MERGE] blocks -> %s and %s\n", lex_path, post_path);
-    merge_blocks_to_index(blocks_dir, lex_path, post_path);
+    mo.readahead_bytes = (size_t)readahead_kb * 1024;
+    mo.doc_lens = docs.lens;
+    mo.doc_count = docs.n;
+    uint64_t total_len = 0;
+    for (uint32_t i=0;i<docs.n;i++) total_len += docs.lens[i];
+    mo.avg_doc_len = docs.n ? (double)total_len / (double)docs.n : 0.0;
+    merge_blocks_to_index(blocks_dir, lex_path, mph_path, fst_path, kgram_path, post_path, pos_path, mo);
 
     double t1 = now_sec_monotonic();
     double elapsed = t1 - t0;
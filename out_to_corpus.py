@@ -0,0 +1,81 @@
+import os
+import json
+import array
+import random
+import struct
+import argparse
+
+# Разворачивает индекс v1 (out/) обратно в корпус для indexer: документ —
+# это его термы через пробел, заголовок и url берутся из docs.bin.
+# Нужен, чтобы собрать тот же набор документов в другом формате
+# (--postings v2/v3, --bitmap-frac) без исходных текстов.
+
+HDR = 52          # LexHeader / DocsHeader (#pragma pack(1))
+LEX_REC = 32      # LexRec v1
+DOC_REC = 24      # DocRec
+
+def read_lexicon(path):
+    lex = open(os.path.join(path, "lexicon.bin"), "rb").read()
+    magic, ver, tc, pool = struct.unpack_from("<4sIIQ", lex, 0)
+    if magic != b"LEXI" or ver != 1:
+        raise SystemExit("нужен lexicon.bin v1")
+    pb = HDR + tc * LEX_REC
+    recs = []
+    for i in range(tc):
+        toff, tlen, flags, df, poff, plen, _ = struct.unpack_from("<QHHIQIf", lex, HDR + i * LEX_REC)
+        if flags:
+            raise SystemExit("нужны сырые списки v1 без tf")
+        recs.append((lex[pb + toff:pb + toff + tlen], df, poff))
+    return recs
+
+def read_docs(path):
+    docs = open(os.path.join(path, "docs.bin"), "rb").read()
+    magic, ver, dc, pool = struct.unpack_from("<4sIIQ", docs, 0)
+    pb = HDR + dc * DOC_REC
+    out = []
+    for d in range(dc):
+        to, tl, uo, ul = struct.unpack_from("<QIQI", docs, HDR + d * DOC_REC)
+        out.append((docs[pb + to:pb + to + tl].decode("utf-8", "replace"),
+                    docs[pb + uo:pb + uo + ul].decode("utf-8", "replace")))
+    return out
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("--index", default="out")
+    ap.add_argument("--dst", required=True)
+    ap.add_argument("--queries", type=int, default=400, help="запросов 'a op b' в dst/queries.txt")
+    ap.add_argument("--seed", type=int, default=1)
+    args = ap.parse_args()
+
+    recs = read_lexicon(args.index)
+    docs = read_docs(args.index)
+    post = open(os.path.join(args.index, "postings.bin"), "rb").read()
+
+    words = [[] for _ in docs]
+    for term, df, poff in recs:
+        ids = array.array("I")
+        ids.frombytes(post[poff:poff + 4 * df])
+        for d in ids:
+            words[d].append(term)
+
+    os.makedirs(os.path.join(args.dst, "corpus"), exist_ok=True)
+    with open(os.path.join(args.dst, "manifest.jsonl"), "w", encoding="utf-8") as m:
+        for d, (title, url) in enumerate(docs):
+            doc_id = "d%06d" % d
+            with open(os.path.join(args.dst, "corpus", doc_id + ".txt"), "wb") as f:
+                f.write(b" ".join(words[d]) + b"\n")
+            m.write(json.dumps({"doc_id": doc_id, "title": title, "url": url}, ensure_ascii=False) + "\n")
+
+    # операнды — термы из 2000 самых частых, которые indexer оставит как есть
+    top = sorted((r for r in recs if r[0].isalnum() and r[0].isascii() and r[0] == r[0].lower()),
+                 key=lambda r: -r[1])[:2000]
+    rnd = random.Random(args.seed)
+    with open(os.path.join(args.dst, "queries.txt"), "w") as q:
+        for _ in range(args.queries):
+            a, b = rnd.sample(top, 2)
+            q.write("%s %s %s\n" % (a[0].decode(), rnd.choice(["&&", "||"]), b[0].decode()))
+
+    print("docs=%d terms=%d -> %s" % (len(docs), len(recs), args.dst))
+
+if __name__ == "__main__":
+    main()
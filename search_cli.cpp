@@ -3,7 +3,25 @@
 #include <cstdint>
 #include <cstring>
 #include <cerrno>
+#include <cmath>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 #include "stemmer_api.h"
 
@@ -52,16 +70,480 @@ struct LexRec {
     uint32_t df;
     uint64_t postings_off;
     uint32_t postings_len;
-    uint32_t reserved;
+    float    max_tf_score;   // LEX_F_BLOCKMAX: max BM25 tf-part over the list
+};
+
+// lexicon.bin v3: LexHeader, then term_count LexRec3 (terms only in
+// lexicon.fst).
+struct LexRec3 {
+    uint64_t postings_off;
+    uint32_t postings_len;
+    uint32_t df;
+    uint16_t flags;
+    uint16_t reserved;
+    float    max_tf_score;
+};
+
+// lexicon.bin v2: front-coded blocks of block_terms terms, then nblocks+1
+// uint64 block offsets at table_off (see indexer LexHeader2).
+struct LexHeader2 {
+    char magic[4];
+    uint32_t version;
+    uint32_t term_count;
+    uint32_t block_terms;
+    uint32_t nblocks;
+    uint64_t table_off;
+    uint8_t reserved[24];
+};
+
+// lexicon.mph (optional): BBHash-style minimal perfect hash of the terms,
+// level start bits, bit words, per-word ranks, then per slot the lexicon
+// ordinal and a 16-bit fingerprint (see indexer MphHeader).
+struct MphHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t term_count;
+    uint32_t nlevels;
+    uint64_t total_bits;
+    uint8_t reserved[24];
+};
+
+// lexicon.fst (optional, required by lexicon v3): acyclic automaton of
+// the terms whose arc outputs sum to the lexicon ordinal. Node: VByte
+// (narcs << 2 | dense << 1 | final). Sparse: per arc label byte, VByte
+// output (not for the first arc: final) and VByte backwards delta to the
+// target node. Dense (FST_DENSE_ARCS or more arcs): output and delta byte
+// widths, then all labels, all outputs and all deltas at those widths
+// (see indexer FstHeader).
+struct FstHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t term_count;
+    uint32_t max_term_len;
+    uint64_t root_off;
+    uint64_t node_bytes;
+    uint8_t reserved[16];
+};
+
+// lexicon.kgram (optional): terms padded with '$' on both sides, per k-gram
+// the ascending ordinals of the terms containing it: gram_count+1 uint64 list
+// offsets, gram_count uint32 keys (k bytes big-endian), VByte first ordinal
+// and gaps (see indexer KgramHeader).
+struct KgramHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t term_count;
+    uint32_t k;
+    uint32_t gram_count;
+    uint32_t reserved0;
+    uint64_t list_bytes;
+    uint8_t reserved[16];
 };
 
 struct PostHeader {
     char magic[4]; 
     uint32_t version;
-    uint8_t reserved[32];
+    float bm25_k1;           // parameters of the stored block-max bounds
+    float bm25_b;
+    uint8_t reserved[24];
+};
+struct PostBlockDir {
+    uint32_t last_doc;
+    uint32_t byte_off;
+};
+// v3 (roaring) lists: RoarHead, RoarChunk directory, containers, then the
+// v1 tf/block-max data at tf_off. Offsets are relative to the list.
+struct RoarHead {
+    uint32_t nchunks;
+    uint32_t tf_off;
+};
+struct RoarChunk {
+    uint16_t key;            // doc id >> 16
+    uint16_t type;
+    uint32_t n;              // array: values, bitmap: set bits, run: runs
+    uint32_t rank;           // postings in the chunks before this one
+    uint32_t off;
+};
+
+struct PosHeader {
+    char     magic[4];
+    uint32_t version;
+    uint32_t term_count;
+    uint64_t table_off;
+    uint32_t doc_count;
+    uint32_t reserved0;
+    uint64_t postings_bytes;  // size of the postings.bin it was built with
+    uint8_t  reserved[8];
+};
+struct DocLenHeader {
+    char     magic[4];
+    uint32_t version;
+    uint32_t doc_count;
+    uint64_t total_len;
+    uint8_t  reserved[32];
 };
 #pragma pack(pop)
 
+static const uint16_t LEX_F_VBYTE = 0x0001;
+static const uint16_t LEX_F_TF    = 0x0002;
+static const uint16_t LEX_F_BLOCKMAX = 0x0004;
+// Dense term stored as a bitset of ceil(doc_count/64) words (indexer
+// --bitmap-frac); postings_len is the byte size, tf/block-max as for v1.
+static const uint16_t LEX_F_BITMAP = 0x0008;
+static const uint16_t LEX_F_ROARING = 0x0010;
+static const uint16_t ROAR_ARRAY = 0, ROAR_BITMAP = 1, ROAR_RUN = 2;
+static const uint32_t ROAR_WORDS = 1024;
+static const uint32_t POSTINGS_BLOCK = 128;
+
+static int vbyte_read(const uint8_t** p, const uint8_t* end, uint64_t* out) {
+    uint64_t v = 0;
+    int shift = 0;
+    while (1) {
+        if (*p >= end || shift > 63) return 0;
+        uint8_t b = *(*p)++;
+        v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) break;
+        shift += 7;
+    }
+    *out = v;
+    return 1;
+}
+
+// One lexicon v2 entry: the term as the first `shared` bytes of the
+// previous one plus suffix, and its record (term_off unused).
+struct Lex2Entry {
+    uint32_t shared = 0;
+    const char* suffix = nullptr;
+    uint32_t suffix_len = 0;
+    LexRec r{};
+};
+
+// Reads the entry at *p; prev_off is the previous entry's postings_off
+// (ignored for a block's first entry). Returns 0 if the data is corrupt.
+static int lex2_read(const uint8_t** p, const uint8_t* end, int first, uint64_t prev_off, Lex2Entry* e) {
+    uint64_t shared = 0, len, flags, df, plen, off;
+    if (!first && !vbyte_read(p, end, &shared)) return 0;
+    if (!vbyte_read(p, end, &len) || len > (uint64_t)(end - *p) || shared + len > 0xFFFF) return 0;
+    e->shared = (uint32_t)shared;
+    e->suffix = (const char*)*p;
+    e->suffix_len = (uint32_t)len;
+    *p += len;
+    if (!vbyte_read(p, end, &flags) || !vbyte_read(p, end, &df) || !vbyte_read(p, end, &plen) ||
+        !vbyte_read(p, end, &off)) return 0;
+    if (flags > 0xFFFF || df > 0xFFFFFFFFULL || plen > 0xFFFFFFFFULL) return 0;
+    e->r.term_off = 0;
+    e->r.term_len = (uint16_t)(shared + len);
+    e->r.flags = (uint16_t)flags;
+    e->r.df = (uint32_t)df;
+    e->r.postings_len = (uint32_t)plen;
+    e->r.postings_off = first ? off : prev_off + off;
+    e->r.max_tf_score = 0.0f;
+    if (flags & LEX_F_BLOCKMAX) {
+        if (end - *p < 4) return 0;
+        std::memcpy(&e->r.max_tf_score, *p, 4);
+        *p += 4;
+    }
+    return 1;
+}
+
+// Decodes `count` d-gaps starting at p; returns the byte past the last one,
+// or nullptr if the stream runs past end.
+static const uint8_t* vbyte_decode_gaps(const uint8_t* p, const uint8_t* end, uint32_t base,
+                                        uint32_t count, uint32_t* out) {
+    uint32_t prev = base;
+    for (uint32_t i=0; i<count; i++) {
+        uint32_t v = 0;
+        int shift = 0;
+        while (1) {
+            if (p >= end || shift > 28) return nullptr;
+            uint8_t b = *p++;
+            v |= (uint32_t)(b & 0x7F) << shift;
+            if (!(b & 0x80)) break;
+            shift += 7;
+        }
+        prev += v;
+        out[i] = prev;
+    }
+    return p;
+}
+
+static const uint8_t* vbyte_skip(const uint8_t* p, const uint8_t* end, uint32_t count) {
+    while (count > 0) {
+        if (p >= end) return nullptr;
+        if (!(*p++ & 0x80)) count--;
+    }
+    return p;
+}
+
+// Plain VByte values (term frequencies), same framing as the gaps.
+static const uint8_t* vbyte_decode_u32(const uint8_t* p, const uint8_t* end, uint32_t count, uint32_t* out) {
+    for (uint32_t i=0; i<count; i++) {
+        uint32_t v = 0;
+        int shift = 0;
+        while (1) {
+            if (p >= end || shift > 28) return nullptr;
+            uint8_t b = *p++;
+            v |= (uint32_t)(b & 0x7F) << shift;
+            if (!(b & 0x80)) break;
+            shift += 7;
+        }
+        out[i] = v;
+    }
+    return p;
+}
+
+// ---- bitmap kernels ----
+// Word-parallel ops over bitsets of equal length, plus the mixed forms
+// that probe a sorted id array against a bitset.
+
+// Without -mpopcnt __builtin_popcountll is a libgcc call; set_isa turns on
+// the sse4.2 clones (which emit the popcnt instruction) when the CPU has it.
+static int g_hw_popcnt = 0;
+
+static inline __attribute__((always_inline)) uint64_t bm_popcount_body(const uint64_t* w, size_t n) {
+    uint64_t c = 0;
+    for (size_t i=0;i<n;i++) c += (uint64_t)__builtin_popcountll(w[i]);
+    return c;
+}
+static inline __attribute__((always_inline)) uint64_t bm_and_count_body(const uint64_t* a, const uint64_t* b, size_t n) {
+    uint64_t c = 0;
+    for (size_t i=0;i<n;i++) c += (uint64_t)__builtin_popcountll(a[i] & b[i]);
+    return c;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse4.2")))
+static uint64_t bm_popcount_hw(const uint64_t* w, size_t n) { return bm_popcount_body(w, n); }
+__attribute__((target("sse4.2")))
+static uint64_t bm_and_count_hw(const uint64_t* a, const uint64_t* b, size_t n) { return bm_and_count_body(a, b, n); }
+#endif
+
+static uint64_t bm_popcount(const uint64_t* w, size_t n) {
+#ifdef HAVE_X86_SIMD
+    if (g_hw_popcnt) return bm_popcount_hw(w, n);
+#endif
+    return bm_popcount_body(w, n);
+}
+
+static uint64_t bm_and_count(const uint64_t* a, const uint64_t* b, size_t n) {
+#ifdef HAVE_X86_SIMD
+    if (g_hw_popcnt) return bm_and_count_hw(a, b, n);
+#endif
+    return bm_and_count_body(a, b, n);
+}
+
+static void bm_and(uint64_t* dst, const uint64_t* src, size_t n)    { for (size_t i=0;i<n;i++) dst[i] &= src[i]; }
+static void bm_or(uint64_t* dst, const uint64_t* src, size_t n)     { for (size_t i=0;i<n;i++) dst[i] |= src[i]; }
+static void bm_andnot(uint64_t* dst, const uint64_t* src, size_t n) { for (size_t i=0;i<n;i++) dst[i] &= ~src[i]; }
+
+// Complement within [0, doc_count).
+static void bm_not(uint64_t* w, size_t n, uint32_t doc_count) {
+    for (size_t i=0;i<n;i++) w[i] = ~w[i];
+    if ((doc_count & 63) && n > 0) w[n-1] &= (1ULL << (doc_count & 63)) - 1;
+}
+
+static inline int bm_test(const uint64_t* w, uint32_t d) { return (int)((w[d >> 6] >> (d & 63)) & 1); }
+
+static uint32_t bm_count_ids(const uint64_t* w, const uint32_t* ids, uint32_t n) {
+    uint32_t c = 0;
+    for (uint32_t i=0;i<n;i++) c += (uint32_t)bm_test(w, ids[i]);
+    return c;
+}
+
+// Keeps the ids whose bit equals keep; out may alias ids.
+static uint32_t bm_filter(const uint32_t* ids, uint32_t n, const uint64_t* w, int keep, uint32_t* out) {
+    uint32_t k = 0;
+    for (uint32_t i=0;i<n;i++) {
+        uint32_t d = ids[i];
+        out[k] = d;
+        k += (uint32_t)(bm_test(w, d) == keep);
+    }
+    return k;
+}
+
+static void bm_set_ids(uint64_t* w, const uint32_t* ids, uint32_t n)   { for (uint32_t i=0;i<n;i++) w[ids[i] >> 6] |= 1ULL << (ids[i] & 63); }
+static void bm_clear_ids(uint64_t* w, const uint32_t* ids, uint32_t n) { for (uint32_t i=0;i<n;i++) w[ids[i] >> 6] &= ~(1ULL << (ids[i] & 63)); }
+
+// Set bits as ascending ids; returns the count.
+static uint32_t bm_extract(const uint64_t* w, size_t n, uint32_t* out) {
+    uint32_t k = 0;
+    for (size_t i=0;i<n;i++) {
+        uint64_t x = w[i];
+        while (x) {
+            out[k++] = (uint32_t)(i * 64 + (size_t)__builtin_ctzll(x));
+            x &= x - 1;
+        }
+    }
+    return k;
+}
+
+// Sets bits lo..hi (inclusive).
+static void bm_set_range(uint64_t* w, uint32_t lo, uint32_t hi) {
+    uint32_t a = lo >> 6, b = hi >> 6;
+    uint64_t ma = ~0ULL << (lo & 63), mb = ~0ULL >> (63 - (hi & 63));
+    if (a == b) { w[a] |= ma & mb; return; }
+    w[a] |= ma;
+    for (uint32_t k=a+1;k<b;k++) w[k] = ~0ULL;
+    w[b] |= mb;
+}
+
+// Block boundaries for top-k: for every rank e >= rank with e % 128 == 127
+// that falls in w, last[e / 128] = id_base + that bit. Returns rank plus the
+// bits in w.
+static uint32_t bm_block_lasts(const uint64_t* w, size_t nw, uint32_t rank, uint32_t id_base, uint32_t* last) {
+    uint32_t e = rank | (POSTINGS_BLOCK - 1);
+    for (size_t i=0;i<nw;i++) {
+        uint32_t pc = (uint32_t)__builtin_popcountll(w[i]);
+        while (e < rank + pc) {
+            uint64_t x = w[i];
+            for (uint32_t t = e - rank; t; t--) x &= x - 1;
+            last[e / POSTINGS_BLOCK] = id_base + (uint32_t)(i * 64) + (uint32_t)__builtin_ctzll(x);
+            e += POSTINGS_BLOCK;
+        }
+        rank += pc;
+    }
+    return rank;
+}
+
+// ---- roaring containers (postings v3) ----
+// A list is split into chunks by the high 16 bits of the id; each chunk
+// holds the low bits as a sorted uint16 array, a 1024-word bitset or
+// (start, last) runs. Set operations meet chunks by key and combine the
+// two containers directly.
+
+struct RoarList {
+    const uint8_t* base = nullptr;
+    const RoarChunk* dir = nullptr;
+    uint32_t n = 0;
+};
+
+static inline const uint16_t* roar_u16(const RoarList& l, const RoarChunk& c) { return (const uint16_t*)(l.base + c.off); }
+static inline const uint64_t* roar_words(const RoarList& l, const RoarChunk& c) { return (const uint64_t*)(l.base + c.off); }
+
+// The container as a bitset: bitmaps in place, others expanded into buf.
+static const uint64_t* roar_as_words(const RoarList& l, const RoarChunk& c, uint64_t* buf) {
+    if (c.type == ROAR_BITMAP) return roar_words(l, c);
+    std::memset(buf, 0, ROAR_WORDS * sizeof(uint64_t));
+    const uint16_t* v = roar_u16(l, c);
+    if (c.type == ROAR_ARRAY) for (uint32_t i=0;i<c.n;i++) buf[v[i] >> 6] |= 1ULL << (v[i] & 63);
+    else for (uint32_t r=0;r<c.n;r++) bm_set_range(buf, v[2*r], v[2*r+1]);
+    return buf;
+}
+
+// Ids of chunk k, ascending; returns the count.
+static uint32_t roar_extract_chunk(const RoarList& l, uint32_t k, uint32_t* out) {
+    const RoarChunk& c = l.dir[k];
+    uint32_t hi = (uint32_t)c.key << 16, m = 0;
+    if (c.type == ROAR_BITMAP) {
+        m = bm_extract(roar_words(l, c), ROAR_WORDS, out);
+        for (uint32_t i=0;i<m;i++) out[i] |= hi;
+        return m;
+    }
+    const uint16_t* v = roar_u16(l, c);
+    if (c.type == ROAR_ARRAY) {
+        for (uint32_t i=0;i<c.n;i++) out[i] = hi | v[i];
+        return c.n;
+    }
+    for (uint32_t r=0;r<c.n;r++)
+        for (uint32_t x=v[2*r]; x<=v[2*r+1]; x++) out[m++] = hi | x;
+    return m;
+}
+
+// The whole list as a bitset of nw words (ids beyond nw*64 are dropped).
+static void roar_to_bitset(const RoarList& l, uint64_t* w, size_t nw) {
+    uint64_t buf[ROAR_WORDS];
+    std::memset(w, 0, nw * sizeof(uint64_t));
+    for (uint32_t k=0;k<l.n;k++) {
+        size_t at = (size_t)l.dir[k].key * ROAR_WORDS;
+        if (at >= nw) break;
+        size_t m = nw - at < ROAR_WORDS ? nw - at : ROAR_WORDS;
+        std::memcpy(w + at, roar_as_words(l, l.dir[k], buf), m * sizeof(uint64_t));
+    }
+}
+
+// As roar_to_bitset, but ORs the list into w.
+static void roar_or_bitset(const RoarList& l, uint64_t* w, size_t nw) {
+    uint64_t buf[ROAR_WORDS];
+    for (uint32_t k=0;k<l.n;k++) {
+        size_t at = (size_t)l.dir[k].key * ROAR_WORDS;
+        if (at >= nw) break;
+        size_t m = nw - at < ROAR_WORDS ? nw - at : ROAR_WORDS;
+        bm_or(w + at, roar_as_words(l, l.dir[k], buf), m);
+    }
+}
+
+// Last id of every 128-posting block of a df-long list, straight from the
+// containers.
+static void roar_block_lasts(const RoarList& l, uint32_t df, uint32_t* last) {
+    for (uint32_t k=0;k<l.n;k++) {
+        const RoarChunk& c = l.dir[k];
+        uint32_t hi = (uint32_t)c.key << 16, r0 = c.rank;
+        uint32_t e = r0 | (POSTINGS_BLOCK - 1);
+        if (c.type == ROAR_BITMAP) {
+            bm_block_lasts(roar_words(l, c), ROAR_WORDS, r0, hi, last);
+            continue;
+        }
+        const uint16_t* v = roar_u16(l, c);
+        if (c.type == ROAR_ARRAY) {
+            for (; e < r0 + c.n; e += POSTINGS_BLOCK) last[e / POSTINGS_BLOCK] = hi | v[e - r0];
+            continue;
+        }
+        for (uint32_t r=0;r<c.n;r++) {
+            uint32_t len = (uint32_t)(v[2*r+1] - v[2*r]) + 1;
+            for (; e < r0 + len; e += POSTINGS_BLOCK) last[e / POSTINGS_BLOCK] = hi | (v[2*r] + (e - r0));
+            r0 += len;
+        }
+    }
+    if (df == 0 || l.n == 0) return;
+    const RoarChunk& c = l.dir[l.n - 1];
+    uint32_t low;
+    if (c.type == ROAR_BITMAP) {
+        const uint64_t* w = roar_words(l, c);
+        uint32_t i = ROAR_WORDS - 1;
+        while (!w[i]) i--;
+        low = i * 64 + 63 - (uint32_t)__builtin_clzll(w[i]);
+    } else {
+        low = roar_u16(l, c)[c.type == ROAR_RUN ? 2 * c.n - 1 : c.n - 1];
+    }
+    last[(df - 1) / POSTINGS_BLOCK] = ((uint32_t)c.key << 16) | low;
+}
+
+// |x AND y| chunk by chunk: two arrays merge, an array probes a bitset,
+// everything else is a word-parallel popcount.
+static uint64_t roar_and_count(const RoarList& x, const RoarList& y) {
+    uint64_t bx[ROAR_WORDS], by[ROAR_WORDS];
+    uint64_t cnt = 0;
+    uint32_t i = 0, j = 0;
+    while (i < x.n && j < y.n) {
+        const RoarChunk& a = x.dir[i];
+        const RoarChunk& b = y.dir[j];
+        if (a.key < b.key) { i++; continue; }
+        if (b.key < a.key) { j++; continue; }
+        if (a.type == ROAR_ARRAY && b.type == ROAR_ARRAY) {
+            const uint16_t* u = roar_u16(x, a);
+            const uint16_t* v = roar_u16(y, b);
+            uint32_t p = 0, q = 0;
+            while (p < a.n && q < b.n) {
+                if (u[p] == v[q]) { cnt++; p++; q++; }
+                else if (u[p] < v[q]) p++;
+                else q++;
+            }
+        } else if (a.type == ROAR_ARRAY || b.type == ROAR_ARRAY) {
+            const RoarList& la = (a.type == ROAR_ARRAY) ? x : y;
+            const RoarList& lw = (a.type == ROAR_ARRAY) ? y : x;
+            const RoarChunk& ca = (a.type == ROAR_ARRAY) ? a : b;
+            const RoarChunk& cw = (a.type == ROAR_ARRAY) ? b : a;
+            const uint64_t* w = roar_as_words(lw, cw, bx);
+            const uint16_t* u = roar_u16(la, ca);
+            for (uint32_t p=0;p<ca.n;p++) cnt += (w[u[p] >> 6] >> (u[p] & 63)) & 1;
+        } else {
+            cnt += bm_and_count(roar_as_words(x, a, bx), roar_as_words(y, b, by), ROAR_WORDS);
+        }
+        i++; j++;
+    }
+    return cnt;
+}
+
 static void* read_whole_file(const char* path, size_t* out_size) {
     FILE* f = std::fopen(path, "rb");
     if (!f) {
@@ -87,22 +569,246 @@ static void* read_whole_file(const char* path, size_t* out_size) {
     return buf;
 }
 
+static int parse_madvise(const char* s, int* out_advice) {
+    if (std::strcmp(s, "normal") == 0)     { *out_advice = MADV_NORMAL; return 1; }
+    if (std::strcmp(s, "random") == 0)     { *out_advice = MADV_RANDOM; return 1; }
+    if (std::strcmp(s, "sequential") == 0) { *out_advice = MADV_SEQUENTIAL; return 1; }
+    if (std::strcmp(s, "willneed") == 0)   { *out_advice = MADV_WILLNEED; return 1; }
+    if (std::strcmp(s, "dontneed") == 0)   { *out_advice = MADV_DONTNEED; return 1; }
+    return 0;
+}
+
+struct LoadOpts {
+    int use_mmap = 0;
+    int populate = 0;
+    int advise_docs = MADV_RANDOM;
+    int advise_lex  = MADV_RANDOM;
+    int advise_post = MADV_NORMAL;
+    int no_mph = 0;          // ignore lexicon.mph
+    int no_fst = 0;          // ignore lexicon.fst (unless lexicon v3)
+    int no_kgram = 0;        // ignore lexicon.kgram
+};
+
+struct FileBuf {
+    void*  p = nullptr;
+    size_t size = 0;
+    int    mapped = 0;
+
+    int open_read(const char* path) {
+        p = read_whole_file(path, &size);
+        mapped = 0;
+        return p != nullptr;
+    }
+
+    int open_mmap(const char* path, int populate, int advice) {
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            std::fprintf(stderr, "Cannot open %s: %s\n", path, std::strerror(errno));
+            return 0;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            std::fprintf(stderr, "fstat %s failed: %s\n", path, std::strerror(errno));
+            ::close(fd);
+            return 0;
+        }
+        if (st.st_size <= 0) {
+            std::fprintf(stderr, "Empty file %s\n", path);
+            ::close(fd);
+            return 0;
+        }
+        int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+        if (populate) flags |= MAP_POPULATE;
+#endif
+        void* m = mmap(nullptr, (size_t)st.st_size, PROT_READ, flags, fd, 0);
+        ::close(fd);
+        if (m == MAP_FAILED) {
+            std::fprintf(stderr, "mmap %s failed: %s\n", path, std::strerror(errno));
+            return 0;
+        }
+        if (madvise(m, (size_t)st.st_size, advice) != 0) {
+            std::fprintf(stderr, "WARN: madvise %s failed: %s\n", path, std::strerror(errno));
+        }
+        p = m;
+        size = (size_t)st.st_size;
+        mapped = 1;
+        return 1;
+    }
+
+    int open(const char* path, const LoadOpts& o, int advice) {
+        if (o.use_mmap) return open_mmap(path, o.populate, advice);
+        return open_read(path);
+    }
+
+    void close() {
+        if (p) {
+            if (mapped) munmap(p, size);
+            else std::free(p);
+        }
+        p = nullptr; size = 0; mapped = 0;
+    }
+};
+
+// Unchecked VByte for lexicon.fst, which is validated at load.
+static inline uint64_t fst_vbyte(const uint8_t** p) {
+    uint64_t v = 0;
+    int shift = 0;
+    uint8_t b;
+    do {
+        b = *(*p)++;
+        v |= (uint64_t)(b & 0x7F) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return v;
+}
+
+static inline uint64_t fst_fixed(const uint8_t* p, uint32_t w) {
+    uint64_t v = 0;
+    for (uint32_t k=0; k<w; k++) v |= (uint64_t)p[k] << (8 * k);
+    return v;
+}
+
+// Arc cursor over one lexicon.fst node.
+struct FstNode {
+    uint64_t off = 0;
+    const uint8_t* p = nullptr;    // sparse: next arc; dense: the labels
+    uint32_t n = 0, idx = 0;       // arcs, index of the next one
+    int final = 0;
+    uint32_t wo = 0, wd = 0;       // dense: output and delta widths (0 = sparse)
+    // the last arc read
+    uint8_t label = 0;
+    uint32_t out = 0;
+    uint64_t target = 0;
+
+    void open(const uint8_t* base, uint64_t at) {
+        off = at;
+        p = base + at;
+        uint64_t h = fst_vbyte(&p);
+        final = (int)(h & 1);
+        n = (uint32_t)(h >> 2);
+        idx = 0;
+        wo = wd = 0;
+        if (h & 2) { wo = p[0]; wd = p[1]; p += 2; }
+    }
+    uint32_t left() const { return n - idx; }
+    void read_dense(uint32_t j) {
+        label = p[j];
+        out = (uint32_t)fst_fixed(p + n + (size_t)j * wo, wo);
+        target = off - fst_fixed(p + (size_t)n * (1 + wo) + (size_t)j * wd, wd);
+    }
+    int next_arc() {
+        if (idx == n) return 0;
+        if (wo) {
+            read_dense(idx++);
+            return 1;
+        }
+        label = *p++;
+        out = idx ? (uint32_t)fst_vbyte(&p) : (uint32_t)final;
+        target = off - fst_vbyte(&p);
+        idx++;
+        return 1;
+    }
+    void last_arc() {
+        if (wo) { read_dense(n - 1); idx = n; }
+        else while (next_arc()) {}
+    }
+    // Reads the first unread arc with label >= c; 0 if there is none.
+    int seek_ge(uint8_t c) {
+        if (wo) {
+            uint32_t j = idx;
+            while (j < n && p[j] < c) j++;
+            if (j == n) { idx = n; return 0; }
+            read_dense(j);
+            idx = j + 1;
+            return 1;
+        }
+        while (next_arc()) if (label >= c) return 1;
+        return 0;
+    }
+};
+
+static uint64_t fnv1a_64(const char* s, int len) {
+    uint64_t h = 1469598103934665603ULL;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+// lexicon.mph hashing, as in the indexer.
+static inline uint64_t mph_mix(uint64_t x) {
+    x ^= x >> 33; x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33; x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+static inline uint64_t mph_pos(uint64_t h, uint32_t level, uint64_t bits) {
+    uint64_t x = mph_mix(h + (uint64_t)(level + 1) * 0x9E3779B97F4A7C15ULL);
+    return (uint64_t)(((unsigned __int128)x * bits) >> 64);
+}
+static inline uint16_t mph_fingerprint(uint64_t h) {
+    return (uint16_t)(mph_mix(h ^ 0x5851F42D4C957F2DULL) >> 48);
+}
+
 struct Index {
     DocsHeader* dh = nullptr;
     DocRec*     docs = nullptr;
     char*       doc_pool = nullptr;
 
     LexHeader* lh = nullptr;
-    LexRec*    lex = nullptr;
+    LexRec*    lex = nullptr;          // v1 only: use rec()
     char*      term_pool = nullptr;
+    const LexRec3* lex3 = nullptr;     // v3
+
+    // lexicon.bin v2: block offset table (nblocks+1 unaligned uint64) and
+    // the first term of every block, copied to sample_pool at load
+    uint32_t lex_version = 1;
+    uint32_t lex_block_terms = 0, lex_nblocks = 0;
+    const uint8_t* lex_file_p = nullptr;
+    size_t lex_file_size = 0;
+    const uint8_t* lex_table = nullptr;
+    char* sample_pool = nullptr;
+    uint32_t* sample_off = nullptr;
+
+    // lexicon.mph (optional): find_term hashes straight to the ordinal
+    uint32_t mph_nlevels = 0;
+    const uint64_t* mph_level = nullptr;   // nlevels+1 level start bits
+    const uint64_t* mph_words = nullptr;
+    const uint32_t* mph_rank = nullptr;
+    const uint32_t* mph_ord = nullptr;
+    const uint16_t* mph_fp = nullptr;
+
+    // lexicon.fst (optional; v3 needs it): term -> ordinal, prefix ranges
+    const uint8_t* fst_nodes = nullptr;
+    uint64_t fst_root = 0;
+    uint32_t fst_max_len = 0;
+
+    // lexicon.kgram (optional): k-gram -> term ordinals, for wildcards
+    uint32_t kg_k = 0, kg_count = 0;
+    const uint64_t* kg_off = nullptr;      // gram_count+1, relative to kg_lists
+    const uint32_t* kg_keys = nullptr;
+    const uint8_t* kg_lists = nullptr;
 
     char* postings_file = nullptr;
     size_t postings_size = 0;
 
-    void* docs_file = nullptr;
-    size_t docs_size = 0;
-    void* lex_file = nullptr;
-    size_t lex_size = 0;
+    // doclen.bin (optional): tokens per doc, for BM25 length normalisation
+    const uint32_t* doc_lens = nullptr;
+    double avg_doc_len = 0.0;
+
+    // positions.bin (optional): term_count+1 offsets, unaligned uint64
+    const uint8_t* pos_table = nullptr;
+
+    FileBuf docs_buf;
+    FileBuf lex_buf;
+    FileBuf post_buf;
+    FileBuf doclen_buf;
+    FileBuf pos_buf;
+    FileBuf mph_buf;
+    FileBuf fst_buf;
+    FileBuf kg_buf;
 
     uint32_t doc_count() const { return dh ? dh->doc_count : 0; }
     uint32_t term_count() const { return lh ? lh->term_count : 0; }
@@ -118,7 +824,198 @@ struct Index {
         return doc_pool + r.url_off;
     }
 
-    int find_term(const char* t, uint16_t tlen, uint32_t* out_idx) const {
+    uint64_t lex_block_off(uint32_t b) const {
+        uint64_t v;
+        std::memcpy(&v, lex_table + (size_t)b * 8, 8);
+        return v;
+    }
+
+    // Record of term i (lexicon order).
+    LexRec rec(uint32_t i) const {
+        if (lex_version == 1) return lex[i];
+        if (lex_version == 3) {
+            const LexRec3& q = lex3[i];
+            LexRec r{};
+            r.flags = q.flags;
+            r.df = q.df;
+            r.postings_off = q.postings_off;
+            r.postings_len = q.postings_len;
+            r.max_tf_score = q.max_tf_score;
+            return r;
+        }
+        LexRec none{};
+        uint32_t b = i / lex_block_terms, j = i % lex_block_terms;
+        const uint8_t* p = lex_file_p + lex_block_off(b);
+        const uint8_t* end = lex_file_p + lex_block_off(b + 1);
+        Lex2Entry e;
+        uint64_t off = 0;
+        for (uint32_t k=0; k<=j; k++) {
+            if (!lex2_read(&p, end, k == 0, off, &e)) return none;
+            off = e.r.postings_off;
+        }
+        return e.r;
+    }
+
+    // v2: binary search over the block samples, then one pass over the
+    // block. m tracks how many leading bytes of t the previous term matched;
+    // sorted order decides most entries from their shared-prefix length.
+    int find_term_v2(const char* t, uint16_t tlen, uint32_t* out_idx, LexRec* out_rec) const {
+        uint32_t lo = 0, hi = lex_nblocks;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            const char* s = sample_pool + sample_off[mid];
+            uint32_t slen = sample_off[mid + 1] - sample_off[mid];
+            uint32_t m = tlen < slen ? tlen : slen;
+            int c = std::memcmp(s, t, m);
+            if (c == 0) c = (slen < tlen) ? -1 : (slen > tlen) ? 1 : 0;
+            if (c <= 0) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo == 0) return 0;
+        return find_in_block_v2(lo - 1, t, tlen, out_idx, out_rec);
+    }
+
+    int find_in_block_v2(uint32_t b, const char* t, uint16_t tlen, uint32_t* out_idx, LexRec* out_rec) const {
+        const uint8_t* p = lex_file_p + lex_block_off(b);
+        const uint8_t* end = lex_file_p + lex_block_off(b + 1);
+        uint32_t cnt = (b + 1 == lex_nblocks) ? term_count() - b * lex_block_terms : lex_block_terms;
+        uint32_t m = 0;
+        Lex2Entry e;
+        uint64_t off = 0;
+        for (uint32_t k=0; k<cnt; k++) {
+            if (!lex2_read(&p, end, k == 0, off, &e)) return 0;
+            off = e.r.postings_off;
+            if (e.shared > m) continue;          // same relation to t as the previous term: smaller
+            if (e.shared < m) return 0;          // diverges where the previous term matched t: larger
+            uint32_t x = 0, tl = tlen - m;
+            while (x < e.suffix_len && x < tl && e.suffix[x] == t[m + x]) x++;
+            m += x;
+            if (x == e.suffix_len && x == tl) {
+                *out_idx = b * lex_block_terms + k;
+                if (out_rec) *out_rec = e.r;
+                return 1;
+            }
+            if (x == tl) return 0;               // t is a proper prefix of the term
+            if (x < e.suffix_len && (uint8_t)e.suffix[x] > (uint8_t)t[m]) return 0;
+        }
+        return 0;
+    }
+
+    // First level whose bit is set gives the slot (its rank); the fingerprint
+    // rejects most absent terms, the rest are checked against the lexicon
+    // (for v2 by scanning the ordinal's block).
+    int find_term_mph(const char* t, uint16_t tlen, uint32_t* out_idx, LexRec* out_rec) const {
+        uint64_t h = fnv1a_64(t, tlen);
+        for (uint32_t l=0; l<mph_nlevels; l++) {
+            uint64_t p = mph_level[l] + mph_pos(h, l, mph_level[l + 1] - mph_level[l]);
+            size_t w = (size_t)(p >> 6);
+            uint64_t x = mph_words[w];
+            if (!((x >> (p & 63)) & 1)) continue;
+            x &= (1ULL << (p & 63)) - 1;
+            uint32_t slot = mph_rank[w] + (uint32_t)bm_popcount(&x, 1);
+            if (mph_fp[slot] != mph_fingerprint(h)) return 0;
+            uint32_t i = mph_ord[slot];
+            if (lex_version == 3) {
+                uint32_t k;
+                if (!fst_find(t, tlen, &k) || k != i) return 0;
+                if (out_rec) *out_rec = rec(i);
+            } else if (lex_version == 2) {
+                uint32_t k;
+                if (!find_in_block_v2(i / lex_block_terms, t, tlen, &k, out_rec) || k != i) return 0;
+            } else {
+                const LexRec& r = lex[i];
+                if (r.term_len != tlen || std::memcmp(term_pool + r.term_off, t, tlen) != 0) return 0;
+                if (out_rec) *out_rec = r;
+            }
+            *out_idx = i;
+            return 1;
+        }
+        return 0;
+    }
+
+    // ---- lexicon.fst ----
+    // Ordinal of t: the sum of the outputs along its path.
+    int fst_find(const char* t, uint16_t tlen, uint32_t* out_idx) const {
+        FstNode n;
+        n.open(fst_nodes, fst_root);
+        uint32_t ord = 0;
+        for (uint32_t k=0; k<tlen; k++) {
+            uint8_t c = (uint8_t)t[k];
+            if (!n.seek_ge(c) || n.label != c) return 0;
+            ord += n.out;
+            n.open(fst_nodes, n.target);
+        }
+        if (!n.final) return 0;
+        *out_idx = ord;
+        return 1;
+    }
+
+    // Terms below node at (following the last arcs down to the leaf).
+    uint32_t fst_count(uint64_t at) const {
+        uint32_t c = 0;
+        FstNode n;
+        n.open(fst_nodes, at);
+        while (n.n) {
+            n.last_arc();
+            c += n.out;
+            n.open(fst_nodes, n.target);
+        }
+        return c + (uint32_t)n.final;
+    }
+
+    // Number of terms < t (byte order).
+    uint32_t fst_lower_bound(const char* t, uint16_t tlen) const {
+        FstNode n;
+        n.open(fst_nodes, fst_root);
+        uint32_t rank = 0;
+        for (uint32_t k=0; k<tlen; k++) {
+            uint8_t c = (uint8_t)t[k];
+            if (!n.seek_ge(c)) return rank + fst_count(n.off);  // every arc is < c
+            if (n.label > c) return rank + n.out;   // output: the terms of the node before this arc
+            rank += n.out;
+            n.open(fst_nodes, n.target);
+        }
+        return rank;
+    }
+
+    // Ordinals [*lo, *hi) of the terms starting with p.
+    void fst_prefix_range(const char* p, uint16_t plen, uint32_t* lo, uint32_t* hi) const {
+        FstNode n;
+        n.open(fst_nodes, fst_root);
+        uint32_t ord = 0;
+        for (uint32_t k=0; k<plen; k++) {
+            uint8_t c = (uint8_t)p[k];
+            if (!n.seek_ge(c) || n.label != c) {
+                *lo = *hi = fst_lower_bound(p, plen);
+                return;
+            }
+            ord += n.out;
+            n.open(fst_nodes, n.target);
+        }
+        *lo = ord;
+        *hi = ord + fst_count(n.off);
+    }
+
+    // out_rec (optional) gets rec(*out_idx), saving v2 a second block scan.
+    int find_term(const char* t, uint16_t tlen, uint32_t* out_idx, LexRec* out_rec = nullptr) const {
+        if (mph_words) return find_term_mph(t, tlen, out_idx, out_rec);
+        if (fst_nodes) {
+            if (!fst_find(t, tlen, out_idx)) return 0;
+            if (out_rec) *out_rec = rec(*out_idx);
+            return 1;
+        }
+        return find_term_sorted(t, tlen, out_idx, out_rec);
+    }
+
+    // Lookup in the sorted lexicon only (binary search / block samples;
+    // v3 has only the automaton).
+    int find_term_sorted(const char* t, uint16_t tlen, uint32_t* out_idx, LexRec* out_rec = nullptr) const {
+        if (lex_version == 3) {
+            if (!fst_find(t, tlen, out_idx)) return 0;
+            if (out_rec) *out_rec = rec(*out_idx);
+            return 1;
+        }
+        if (lex_version == 2) return find_term_v2(t, tlen, out_idx, out_rec);
         uint32_t lo = 0, hi = term_count();
         while (lo < hi) {
             uint32_t mid = lo + (hi - lo) / 2;
@@ -132,60 +1029,646 @@ struct Index {
                 if (tlen < slen) c = -1;
                 else if (tlen > slen) c = 1;
             }
-            if (c == 0) { *out_idx = mid; return 1; }
+            if (c == 0) {
+                *out_idx = mid;
+                if (out_rec) *out_rec = r;
+                return 1;
+            }
             if (c < 0) hi = mid;
             else lo = mid + 1;
         }
         return 0;
     }
 
-    const uint32_t* postings_ptr(const LexRec& r) const {
-        uint64_t need = r.postings_off + (uint64_t)r.postings_len * 4ULL;
-        if (need > (uint64_t)postings_size) return nullptr;
-        return (const uint32_t*)(postings_file + r.postings_off);
+    // Number of terms < t (byte order), from whichever sorted structure is
+    // loaded: the automaton, the v1 records or the v2 samples plus one block.
+    uint32_t lower_bound(const char* t, uint16_t tlen) const {
+        if (fst_nodes) return fst_lower_bound(t, tlen);
+        if (lex_version == 2) {
+            uint32_t lo = 0, hi = lex_nblocks;
+            while (lo < hi) {
+                uint32_t mid = lo + (hi - lo) / 2;
+                const char* s = sample_pool + sample_off[mid];
+                uint32_t slen = sample_off[mid + 1] - sample_off[mid];
+                uint32_t m = tlen < slen ? tlen : slen;
+                int c = std::memcmp(s, t, m);
+                if (c == 0) c = (slen < tlen) ? -1 : (slen > tlen) ? 1 : 0;
+                if (c < 0) lo = mid + 1;
+                else hi = mid;
+            }
+            if (lo == 0) return 0;
+            uint32_t b = lo - 1;
+            const uint8_t* p = lex_file_p + lex_block_off(b);
+            const uint8_t* end = lex_file_p + lex_block_off(b + 1);
+            uint32_t cnt = (b + 1 == lex_nblocks) ? term_count() - b * lex_block_terms : lex_block_terms;
+            char term[0x10000];
+            Lex2Entry e;
+            uint64_t off = 0;
+            uint32_t k = 0;
+            for (; k<cnt; k++) {
+                if (!lex2_read(&p, end, k == 0, off, &e)) break;
+                off = e.r.postings_off;
+                std::memcpy(term + e.shared, e.suffix, e.suffix_len);
+                uint32_t len = e.shared + e.suffix_len;
+                uint32_t m = tlen < len ? tlen : len;
+                int c = std::memcmp(term, t, m);
+                if (c > 0 || (c == 0 && len >= tlen)) break;
+            }
+            return b * lex_block_terms + k;
+        }
+        uint32_t lo = 0, hi = term_count();
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            const LexRec& r = lex[mid];
+            uint32_t m = tlen < r.term_len ? tlen : r.term_len;
+            int c = std::memcmp(term_pool + r.term_off, t, m);
+            if (c < 0 || (c == 0 && r.term_len < tlen)) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
     }
 
-    int load(const char* index_dir) {
-        char p_docs[1024], p_lex[1024], p_post[1024];
-        std::snprintf(p_docs, sizeof(p_docs), "%s/docs.bin", index_dir);
-        std::snprintf(p_lex,  sizeof(p_lex),  "%s/lexicon.bin", index_dir);
-        std::snprintf(p_post, sizeof(p_post), "%s/postings.bin", index_dir);
-
-        docs_file = read_whole_file(p_docs, &docs_size);
-        if (!docs_file) return 0;
-        lex_file = read_whole_file(p_lex, &lex_size);
-        if (!lex_file) return 0;
-        postings_file = (char*)read_whole_file(p_post, &postings_size);
-        if (!postings_file) return 0;
+    // Ordinals [*lo, *hi) of the terms starting with p.
+    void prefix_range(const char* p, uint16_t plen, uint32_t* lo, uint32_t* hi) const {
+        if (fst_nodes) { fst_prefix_range(p, plen, lo, hi); return; }
+        *lo = lower_bound(p, plen);
+        // first string past the prefix: drop trailing 0xFF bytes, bump the last
+        char up[256];
+        uint16_t ul = plen < sizeof(up) ? plen : (uint16_t)sizeof(up);
+        std::memcpy(up, p, ul);
+        while (ul > 0 && (uint8_t)up[ul - 1] == 0xFF) ul--;
+        if (ul == 0) { *hi = term_count(); return; }
+        up[ul - 1] = (char)((uint8_t)up[ul - 1] + 1);
+        *hi = lower_bound(up, ul);
+        if (*hi < *lo) *hi = *lo;
+    }
 
-        dh = (DocsHeader*)docs_file;
-        if (docs_size < sizeof(DocsHeader) || std::memcmp(dh->magic, "DOCS", 4) != 0 || dh->version != 1) {
-            std::fprintf(stderr, "Bad docs.bin\n"); return 0;
+    // rec(lo .. lo+n-1) into out; v2 decodes each block once instead of
+    // rescanning it per term.
+    void recs(uint32_t lo, uint32_t n, LexRec* out) const {
+        if (lex_version != 2) {
+            for (uint32_t i=0;i<n;i++) out[i] = rec(lo + i);
+            return;
         }
-        docs = (DocRec*)((char*)docs_file + sizeof(DocsHeader));
-        doc_pool = (char*)docs + (size_t)dh->doc_count * sizeof(DocRec);
-
-        lh = (LexHeader*)lex_file;
-        if (lex_size < sizeof(LexHeader) || std::memcmp(lh->magic, "LEXI", 4) != 0 || lh->version != 1) {
-            std::fprintf(stderr, "Bad lexicon.bin\n"); return 0;
+        uint32_t i = 0;
+        while (i < n) {
+            uint32_t b = (lo + i) / lex_block_terms, j = (lo + i) % lex_block_terms;
+            uint32_t cnt = (b + 1 == lex_nblocks) ? term_count() - b * lex_block_terms : lex_block_terms;
+            const uint8_t* p = lex_file_p + lex_block_off(b);
+            const uint8_t* end = lex_file_p + lex_block_off(b + 1);
+            Lex2Entry e;
+            uint64_t off = 0;
+            for (uint32_t k=0; k<cnt && i<n; k++) {
+                if (!lex2_read(&p, end, k == 0, off, &e)) e.r = LexRec{};
+                off = e.r.postings_off;
+                if (k >= j) out[i++] = e.r;
+            }
         }
-        lex = (LexRec*)((char*)lex_file + sizeof(LexHeader));
-        term_pool = (char*)lex + (size_t)lh->term_count * sizeof(LexRec);
+    }
 
-        PostHeader* ph = (PostHeader*)postings_file;
-        if (postings_size < sizeof(PostHeader) || std::memcmp(ph->magic, "POST", 4) != 0 || ph->version != 1) {
-            std::fprintf(stderr, "Bad postings.bin\n"); return 0;
-        }
+    size_t bitmap_words() const { return ((size_t)doc_count() + 63) / 64; }
 
-        return 1;
+    // LEX_F_BITMAP terms: the bitset, nullptr otherwise.
+    const uint64_t* bitmap_ptr(const LexRec& r) const {
+        if (!(r.flags & LEX_F_BITMAP) || (r.postings_off & 7)) return nullptr;
+        if (r.postings_off + (uint64_t)bitmap_words() * 8 > (uint64_t)postings_size) return nullptr;
+        return (const uint64_t*)(postings_file + r.postings_off);
     }
 
-    void destroy() {
-        std::free(docs_file); docs_file=nullptr; docs_size=0;
-        std::free(lex_file);  lex_file=nullptr;  lex_size=0;
-        std::free(postings_file); postings_file=nullptr; postings_size=0;
+    // LEX_F_ROARING terms: checks that the directory and every container lie
+    // within the list and that the chunk sizes add up to df.
+    int roaring_list(const LexRec& r, RoarList* out) const {
+        if (!(r.flags & LEX_F_ROARING) || (r.postings_off & 7)) return 0;
+        if (r.postings_off + (uint64_t)r.postings_len > (uint64_t)postings_size || r.postings_len < sizeof(RoarHead)) return 0;
+        const uint8_t* base = (const uint8_t*)postings_file + r.postings_off;
+        const RoarHead* h = (const RoarHead*)base;
+        uint64_t dir_end = sizeof(RoarHead) + (uint64_t)h->nchunks * sizeof(RoarChunk);
+        if (dir_end > h->tf_off || h->tf_off > r.postings_len || (h->tf_off & 3)) return 0;
+        const RoarChunk* dir = (const RoarChunk*)(base + sizeof(RoarHead));
+        uint64_t rank = 0;
+        for (uint32_t k=0;k<h->nchunks;k++) {
+            const RoarChunk& c = dir[k];
+            if (c.rank != rank || (k && c.key <= dir[k-1].key) || c.n == 0) return 0;
+            uint64_t bytes = c.type == ROAR_BITMAP ? ROAR_WORDS * 8ULL : c.type == ROAR_RUN ? c.n * 4ULL : c.n * 2ULL;
+            if (c.type > ROAR_RUN || c.off < dir_end || c.off + bytes > h->tf_off) return 0;
+            if (c.type == ROAR_BITMAP) {
+                if ((c.off & 7) || bm_popcount((const uint64_t*)(base + c.off), ROAR_WORDS) != c.n) return 0;
+                rank += c.n;
+            } else if (c.type == ROAR_RUN) {
+                const uint16_t* v = (const uint16_t*)(base + c.off);
+                for (uint32_t i=0;i<c.n;i++) {
+                    if (v[2*i+1] < v[2*i] || (i && v[2*i] <= v[2*i-1])) return 0;
+                    rank += (uint32_t)(v[2*i+1] - v[2*i]) + 1;
+                }
+            } else {
+                rank += c.n;
+            }
+        }
+        if (rank != r.df) return 0;
+        out->base = base;
+        out->dir = dir;
+        out->n = h->nchunks;
+        return 1;
     }
-};
+
+    // Raw uint32 list; nullptr for compressed, bitmap and roaring terms (see decode_postings).
+    const uint32_t* postings_ptr(const LexRec& r) const {
+        if (r.flags & (LEX_F_VBYTE | LEX_F_BITMAP | LEX_F_ROARING)) return nullptr;
+        uint64_t need = r.postings_off + (uint64_t)r.postings_len * 4ULL;
+        if (need > (uint64_t)postings_size) return nullptr;
+        return (const uint32_t*)(postings_file + r.postings_off);
+    }
+
+    uint32_t postings_count(const LexRec& r) const {
+        return (r.flags & (LEX_F_VBYTE | LEX_F_BITMAP | LEX_F_ROARING)) ? r.df : r.postings_len;
+    }
+
+    // Writes postings_count(r) doc ids to out; returns the number written
+    // (0 if the list is out of bounds or corrupt).
+    uint32_t decode_postings(const LexRec& r, uint32_t* out) const {
+        if (r.flags & LEX_F_BITMAP) {
+            const uint64_t* w = bitmap_ptr(r);
+            if (!w || bm_popcount(w, bitmap_words()) != r.df) return 0;
+            return bm_extract(w, bitmap_words(), out);
+        }
+        if (r.flags & LEX_F_ROARING) {
+            RoarList l;
+            if (!roaring_list(r, &l)) return 0;
+            uint32_t m = 0;
+            for (uint32_t k=0;k<l.n;k++) m += roar_extract_chunk(l, k, out + m);
+            return m;
+        }
+        if (!(r.flags & LEX_F_VBYTE)) {
+            const uint32_t* p = postings_ptr(r);
+            if (!p) return 0;
+            std::memcpy(out, p, (size_t)r.postings_len * sizeof(uint32_t));
+            return r.postings_len;
+        }
+        if (r.postings_off + (uint64_t)r.postings_len > (uint64_t)postings_size) return 0;
+        uint32_t nblocks = (r.df + POSTINGS_BLOCK - 1) / POSTINGS_BLOCK;
+        size_t dir_bytes = (size_t)nblocks * sizeof(PostBlockDir);
+        if (dir_bytes > r.postings_len) return 0;
+        const uint8_t* base = (const uint8_t*)postings_file + r.postings_off;
+        const PostBlockDir* dir = (const PostBlockDir*)base;
+        const uint8_t* data = base + dir_bytes;
+        const uint8_t* end = base + r.postings_len;
+        if (!(r.flags & LEX_F_TF)) {
+            return vbyte_decode_gaps(data, end, 0, r.df, out) ? r.df : 0;
+        }
+        // tf bytes sit between the blocks: walk the directory
+        for (uint32_t b=0; b<nblocks; b++) {
+            uint32_t lo = b * POSTINGS_BLOCK;
+            uint32_t cnt = r.df - lo < POSTINGS_BLOCK ? r.df - lo : POSTINGS_BLOCK;
+            if (dir[b].byte_off > (size_t)(end - data)) return 0;
+            if (!vbyte_decode_gaps(data + dir[b].byte_off, end, b ? dir[b-1].last_doc : 0, cnt, out + lo)) return 0;
+        }
+        return r.df;
+    }
+
+    // Bytes before the v1 tf array: the ids, the bitset or the containers.
+    uint64_t raw_ids_bytes(const LexRec& r) const {
+        if (r.flags & LEX_F_ROARING) {
+            if (r.postings_off + sizeof(RoarHead) > (uint64_t)postings_size) return (uint64_t)postings_size;
+            return ((const RoarHead*)(postings_file + r.postings_off))->tf_off;
+        }
+        return (r.flags & LEX_F_BITMAP) ? (uint64_t)bitmap_words() * 8 : (uint64_t)r.df * 4;
+    }
+
+    // Raw, bitmap and roaring lists with LEX_F_TF: uint16 tf per doc right after the
+    // ids (in doc order).
+    const uint16_t* raw_tf_ptr(const LexRec& r) const {
+        if ((r.flags & (LEX_F_VBYTE | LEX_F_TF)) != LEX_F_TF) return nullptr;
+        uint64_t need = r.postings_off + raw_ids_bytes(r) + (uint64_t)r.df * 2ULL;
+        if (need > (uint64_t)postings_size) return nullptr;
+        return (const uint16_t*)(postings_file + r.postings_off + raw_ids_bytes(r));
+    }
+
+    // LEX_F_BLOCKMAX: unaligned float per 128-posting block, nullptr otherwise.
+    const uint8_t* block_max_ptr(const LexRec& r) const {
+        if (!(r.flags & LEX_F_BLOCKMAX)) return nullptr;
+        uint64_t nblocks = (r.df + POSTINGS_BLOCK - 1) / POSTINGS_BLOCK;
+        uint64_t off;
+        if (r.flags & LEX_F_VBYTE) {
+            if (nblocks * 4 > r.postings_len) return nullptr;
+            off = r.postings_off + r.postings_len - nblocks * 4;
+        } else {
+            off = r.postings_off + raw_ids_bytes(r) + (((uint64_t)r.df * 2 + 3) & ~3ULL);
+        }
+        if (off + nblocks * 4 > (uint64_t)postings_size) return nullptr;
+        return (const uint8_t*)postings_file + off;
+    }
+
+    const PostHeader* post_header() const { return (const PostHeader*)postings_file; }
+
+    // Position data of a term: uint32 block directory, then the records
+    // (see indexer PositionsWriter). 0 without positions.bin.
+    int positions_range(uint32_t lex_i, const uint8_t** out_begin, const uint8_t** out_end) const {
+        if (!pos_table) return 0;
+        uint64_t b, e;
+        std::memcpy(&b, pos_table + (size_t)lex_i * 8, 8);
+        std::memcpy(&e, pos_table + (size_t)lex_i * 8 + 8, 8);
+        if (b > e || e > (uint64_t)pos_buf.size) return 0;
+        *out_begin = (const uint8_t*)pos_buf.p + b;
+        *out_end = (const uint8_t*)pos_buf.p + e;
+        return 1;
+    }
+
+    void load_positions(const char* index_dir, const LoadOpts& o) {
+        char p_pos[1024];
+        std::snprintf(p_pos, sizeof(p_pos), "%s/positions.bin", index_dir);
+        struct stat st;
+        if (::stat(p_pos, &st) != 0) return;
+        if (!pos_buf.open(p_pos, o, o.advise_post)) return;
+        const PosHeader* h = (const PosHeader*)pos_buf.p;
+        if (pos_buf.size < sizeof(PosHeader) || std::memcmp(h->magic, "POSN", 4) != 0 || h->version != 2 ||
+            h->term_count != term_count() || h->doc_count != doc_count() ||
+            h->postings_bytes != (uint64_t)postings_size ||
+            h->table_off + ((uint64_t)h->term_count + 1) * 8 > (uint64_t)pos_buf.size) {
+            std::fprintf(stderr, "WARN: bad or stale positions.bin, ignored\n");
+            pos_buf.close();
+            return;
+        }
+        pos_table = (const uint8_t*)pos_buf.p + h->table_off;
+    }
+
+    void load_mph(const char* index_dir, const LoadOpts& o) {
+        char p_mph[1024];
+        std::snprintf(p_mph, sizeof(p_mph), "%s/lexicon.mph", index_dir);
+        struct stat st;
+        if (o.no_mph || ::stat(p_mph, &st) != 0) return;
+        if (!mph_buf.open(p_mph, o, o.advise_lex)) return;
+        if (!check_mph()) {
+            std::fprintf(stderr, "WARN: bad lexicon.mph, ignored\n");
+            mph_buf.close();
+            mph_nlevels = 0;
+            mph_level = mph_words = nullptr; mph_rank = mph_ord = nullptr; mph_fp = nullptr;
+        }
+    }
+
+    int check_mph() {
+        const MphHeader* h = (const MphHeader*)mph_buf.p;
+        uint64_t size = mph_buf.size;
+        if (size < sizeof(MphHeader) || std::memcmp(h->magic, "MPHF", 4) != 0 || h->version != 1 ||
+            h->term_count != term_count() || h->nlevels > 64 || (h->total_bits & 63) ||
+            h->total_bits > (size << 3)) return 0;
+        uint64_t nw = h->total_bits / 64, n = h->term_count;
+        uint64_t need = sizeof(MphHeader) + ((uint64_t)h->nlevels + 1) * 8 + nw * 8 + (nw + 1) * 4 + n * 6;
+        if (need != size) return 0;
+        const uint8_t* q = (const uint8_t*)mph_buf.p + sizeof(MphHeader);
+        mph_level = (const uint64_t*)q;
+        mph_words = (const uint64_t*)(q + ((size_t)h->nlevels + 1) * 8);
+        mph_rank = (const uint32_t*)(mph_words + nw);
+        mph_ord = mph_rank + nw + 1;
+        mph_fp = (const uint16_t*)(mph_ord + n);
+        if (mph_level[0] != 0 || mph_level[h->nlevels] != h->total_bits) return 0;
+        for (uint32_t l=0; l<h->nlevels; l++)
+            if (mph_level[l + 1] <= mph_level[l] || (mph_level[l + 1] & 63)) return 0;
+        uint64_t c = 0;
+        for (uint64_t w=0; w<nw; w++) {
+            if (mph_rank[w] != c) return 0;
+            c += bm_popcount(mph_words + w, 1);
+        }
+        if (mph_rank[nw] != c || c != n) return 0;
+        for (uint64_t i=0; i<n; i++) if (mph_ord[i] >= n) return 0;
+        mph_nlevels = h->nlevels;
+        return 1;
+    }
+
+    void load_fst(const char* index_dir, const LoadOpts& o) {
+        char p_fst[1024];
+        std::snprintf(p_fst, sizeof(p_fst), "%s/lexicon.fst", index_dir);
+        struct stat st;
+        if ((o.no_fst && lex_version != 3) || ::stat(p_fst, &st) != 0) return;
+        if (!fst_buf.open(p_fst, o, o.advise_lex)) return;
+        if (!check_fst()) {
+            std::fprintf(stderr, "WARN: bad lexicon.fst, ignored\n");
+            fst_buf.close();
+            fst_nodes = nullptr; fst_root = 0; fst_max_len = 0;
+        }
+    }
+
+    void load_kgram(const char* index_dir, const LoadOpts& o) {
+        char p_kg[1024];
+        std::snprintf(p_kg, sizeof(p_kg), "%s/lexicon.kgram", index_dir);
+        struct stat st;
+        if (o.no_kgram || ::stat(p_kg, &st) != 0) return;
+        if (!kg_buf.open(p_kg, o, o.advise_lex)) return;
+        if (!check_kgram()) {
+            std::fprintf(stderr, "WARN: bad lexicon.kgram, ignored\n");
+            kg_buf.close();
+            kg_k = kg_count = 0; kg_off = nullptr; kg_keys = nullptr; kg_lists = nullptr;
+        }
+    }
+
+    // Sizes, ascending keys and offsets; the lists themselves are bounds-
+    // checked as they are decoded (kgram_terms).
+    int check_kgram() {
+        const KgramHeader* h = (const KgramHeader*)kg_buf.p;
+        uint64_t size = kg_buf.size;
+        if (size < sizeof(KgramHeader) || std::memcmp(h->magic, "KGRM", 4) != 0 || h->version != 1 ||
+            h->term_count != term_count() || h->k < 2 || h->k > 4) return 0;
+        uint64_t need = sizeof(KgramHeader) + ((uint64_t)h->gram_count + 1) * 8 + (uint64_t)h->gram_count * 4 + h->list_bytes;
+        if (need != size) return 0;
+        const uint8_t* q = (const uint8_t*)kg_buf.p + sizeof(KgramHeader);
+        kg_off = (const uint64_t*)q;
+        kg_keys = (const uint32_t*)(q + ((size_t)h->gram_count + 1) * 8);
+        kg_lists = (const uint8_t*)(kg_keys + h->gram_count);
+        if (kg_off[0] != 0 || kg_off[h->gram_count] != h->list_bytes) return 0;
+        for (uint32_t g=0; g<h->gram_count; g++) {
+            if (kg_off[g + 1] <= kg_off[g]) return 0;
+            if (g && kg_keys[g] <= kg_keys[g - 1]) return 0;
+        }
+        kg_k = h->k;
+        kg_count = h->gram_count;
+        return 1;
+    }
+
+    // The VByte list of k-gram key in [*p, *end); 0 if no term has it.
+    int kgram_list(uint32_t key, const uint8_t** p, const uint8_t** end) const {
+        uint32_t lo = 0, hi = kg_count;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (kg_keys[mid] < key) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo == kg_count || kg_keys[lo] != key) return 0;
+        *p = kg_lists + kg_off[lo];
+        *end = kg_lists + kg_off[lo + 1];
+        return 1;
+    }
+
+    // One pass over the nodes (children come first): arcs must point back to
+    // node starts, labels ascend, outputs match the counts below, and the
+    // root holds every term at depth <= max_term_len.
+    int check_fst() {
+        const FstHeader* h = (const FstHeader*)fst_buf.p;
+        if (fst_buf.size < sizeof(FstHeader) || std::memcmp(h->magic, "FSTD", 4) != 0 || h->version != 1 ||
+            h->term_count != term_count() || h->max_term_len > 0xFFFF ||
+            h->node_bytes != fst_buf.size - sizeof(FstHeader) || h->root_off >= h->node_bytes) return 0;
+        const uint8_t* b = (const uint8_t*)fst_buf.p + sizeof(FstHeader);
+        const uint8_t* end = b + h->node_bytes;
+        size_t cap = 1024, nn = 0;
+        uint64_t* offs = (uint64_t*)std::malloc(cap * sizeof(uint64_t));
+        uint32_t* cnt = (uint32_t*)std::malloc(cap * sizeof(uint32_t));
+        uint32_t* dep = (uint32_t*)std::malloc(cap * sizeof(uint32_t));
+        if (!offs || !cnt || !dep) { std::fprintf(stderr, "malloc fst check failed\n"); std::exit(1); }
+        int ok = 1;
+        const uint8_t* p = b;
+        while (ok && p < end) {
+            uint64_t at = (uint64_t)(p - b), hv, v;
+            if (!vbyte_read(&p, end, &hv) || (hv >> 2) > 256 || ((hv >> 2) == 0 && hv != 1)) { ok = 0; break; }
+            uint32_t narcs = (uint32_t)(hv >> 2), wo = 0, wd = 0;
+            const uint8_t* labels = nullptr;
+            if (hv & 2) {
+                if (end - p < 2) { ok = 0; break; }
+                wo = p[0]; wd = p[1];
+                if (wo < 1 || wo > 4 || wd < 1 || wd > 8 || (uint64_t)(end - p - 2) < (uint64_t)narcs * (1 + wo + wd)) {
+                    ok = 0; break;
+                }
+                labels = p + 2;
+                p = labels + (size_t)narcs * (1 + wo + wd);
+            }
+            uint64_t count = hv & 1;
+            uint32_t depth = 0;
+            int prev_label = -1;
+            for (uint32_t i=0; ok && i<narcs; i++) {
+                int label;
+                if (labels) {
+                    label = labels[i];
+                    v = fst_fixed(labels + narcs + (size_t)i * wo, wo);
+                    if (v != count) { ok = 0; break; }
+                    v = fst_fixed(labels + (size_t)narcs * (1 + wo) + (size_t)i * wd, wd);
+                } else {
+                    if (p >= end) { ok = 0; break; }
+                    label = *p++;
+                    if (i > 0 && (!vbyte_read(&p, end, &v) || v != count)) { ok = 0; break; }
+                    if (!vbyte_read(&p, end, &v)) { ok = 0; break; }
+                }
+                if (label <= prev_label || v == 0 || v > at) { ok = 0; break; }
+                prev_label = label;
+                uint64_t target = at - v;
+                size_t lo = 0, hi = nn;
+                while (lo < hi) { size_t mid = (lo + hi) / 2; if (offs[mid] < target) lo = mid + 1; else hi = mid; }
+                if (lo == nn || offs[lo] != target) { ok = 0; break; }
+                count += cnt[lo];
+                if (count > h->term_count) { ok = 0; break; }
+                if (dep[lo] + 1 > depth) depth = dep[lo] + 1;
+            }
+            if (!ok) break;
+            if (nn == cap) {
+                cap *= 2;
+                uint64_t* no = (uint64_t*)std::realloc(offs, cap * sizeof(uint64_t));
+                uint32_t* nc = (uint32_t*)std::realloc(cnt, cap * sizeof(uint32_t));
+                uint32_t* nd = (uint32_t*)std::realloc(dep, cap * sizeof(uint32_t));
+                if (!no || !nc || !nd) { std::fprintf(stderr, "realloc fst check failed\n"); std::exit(1); }
+                offs = no; cnt = nc; dep = nd;
+            }
+            offs[nn] = at; cnt[nn] = (uint32_t)count; dep[nn] = depth; nn++;
+        }
+        if (ok) {
+            size_t lo = 0, hi = nn;
+            while (lo < hi) { size_t mid = (lo + hi) / 2; if (offs[mid] < h->root_off) lo = mid + 1; else hi = mid; }
+            ok = lo < nn && offs[lo] == h->root_off && cnt[lo] == h->term_count && dep[lo] <= h->max_term_len;
+        }
+        std::free(offs); std::free(cnt); std::free(dep);
+        if (!ok) return 0;
+        fst_nodes = b;
+        fst_root = h->root_off;
+        fst_max_len = h->max_term_len;
+        return 1;
+    }
+
+    void load_doc_lens(const char* index_dir, const LoadOpts& o) {
+        char p_len[1024];
+        std::snprintf(p_len, sizeof(p_len), "%s/doclen.bin", index_dir);
+        struct stat st;
+        if (::stat(p_len, &st) != 0) return;
+        if (!doclen_buf.open(p_len, o, o.advise_docs)) return;
+        const DocLenHeader* h = (const DocLenHeader*)doclen_buf.p;
+        if (doclen_buf.size < sizeof(DocLenHeader) || std::memcmp(h->magic, "DLEN", 4) != 0 || h->version != 1 ||
+            h->doc_count != doc_count() ||
+            doclen_buf.size < sizeof(DocLenHeader) + (size_t)h->doc_count * sizeof(uint32_t)) {
+            std::fprintf(stderr, "WARN: bad doclen.bin, ignored\n");
+            doclen_buf.close();
+            return;
+        }
+        doc_lens = (const uint32_t*)((const char*)doclen_buf.p + sizeof(DocLenHeader));
+        avg_doc_len = h->doc_count ? (double)h->total_len / (double)h->doc_count : 0.0;
+    }
+
+    // Checks the block table and copies each block's first term into the
+    // sample pool.
+    int load_lexicon_v2(const uint8_t* f, size_t size) {
+        const LexHeader2* h = (const LexHeader2*)f;
+        if (size < sizeof(LexHeader2) || h->block_terms == 0) return 0;
+        if (h->nblocks != (uint32_t)(((uint64_t)h->term_count + h->block_terms - 1) / h->block_terms)) return 0;
+        if (h->table_off < sizeof(LexHeader2) || h->table_off > size ||
+            ((uint64_t)h->nblocks + 1) * 8 > size - h->table_off) return 0;
+        lex_file_p = f;
+        lex_file_size = size;
+        lex_table = f + h->table_off;
+        lex_block_terms = h->block_terms;
+        lex_nblocks = h->nblocks;
+        uint64_t pool_bytes = 0;
+        for (uint32_t b=0; b<lex_nblocks; b++) {
+            uint64_t lo = lex_block_off(b), hi = lex_block_off(b + 1);
+            if (lo < sizeof(LexHeader2) || lo > hi || hi > h->table_off) return 0;
+            const uint8_t* p = f + lo;
+            Lex2Entry e;
+            if (!lex2_read(&p, f + hi, 1, 0, &e)) return 0;
+            pool_bytes += e.suffix_len;
+        }
+        if (pool_bytes > 0xFFFFFFFFULL) return 0;
+        sample_pool = (char*)std::malloc(pool_bytes ? (size_t)pool_bytes : 1);
+        sample_off = (uint32_t*)std::malloc(((size_t)lex_nblocks + 1) * sizeof(uint32_t));
+        if (!sample_pool || !sample_off) { std::fprintf(stderr, "malloc lexicon samples failed\n"); std::exit(1); }
+        uint32_t at = 0;
+        for (uint32_t b=0; b<lex_nblocks; b++) {
+            const uint8_t* p = f + lex_block_off(b);
+            Lex2Entry e;
+            lex2_read(&p, f + lex_block_off(b + 1), 1, 0, &e);
+            sample_off[b] = at;
+            std::memcpy(sample_pool + at, e.suffix, e.suffix_len);
+            at += e.suffix_len;
+        }
+        sample_off[lex_nblocks] = at;
+        return 1;
+    }
+
+    int load(const char* index_dir, const LoadOpts& o) {
+        char p_docs[1024], p_lex[1024], p_post[1024];
+        std::snprintf(p_docs, sizeof(p_docs), "%s/docs.bin", index_dir);
+        std::snprintf(p_lex,  sizeof(p_lex),  "%s/lexicon.bin", index_dir);
+        std::snprintf(p_post, sizeof(p_post), "%s/postings.bin", index_dir);
+
+        if (!docs_buf.open(p_docs, o, o.advise_docs)) return 0;
+        if (!lex_buf.open(p_lex, o, o.advise_lex)) return 0;
+        if (!post_buf.open(p_post, o, o.advise_post)) return 0;
+
+        void* docs_file = docs_buf.p;
+        size_t docs_size = docs_buf.size;
+        void* lex_file = lex_buf.p;
+        size_t lex_size = lex_buf.size;
+        postings_file = (char*)post_buf.p;
+        postings_size = post_buf.size;
+
+        dh = (DocsHeader*)docs_file;
+        if (docs_size < sizeof(DocsHeader) || std::memcmp(dh->magic, "DOCS", 4) != 0 || dh->version != 1) {
+            std::fprintf(stderr, "Bad docs.bin\n"); return 0;
+        }
+        docs = (DocRec*)((char*)docs_file + sizeof(DocsHeader));
+        doc_pool = (char*)docs + (size_t)dh->doc_count * sizeof(DocRec);
+
+        lh = (LexHeader*)lex_file;
+        if (lex_size < sizeof(LexHeader) || std::memcmp(lh->magic, "LEXI", 4) != 0 ||
+            lh->version < 1 || lh->version > 3) {
+            std::fprintf(stderr, "Bad lexicon.bin\n"); return 0;
+        }
+        lex_version = lh->version;
+        if (lex_version == 2) {
+            if (!load_lexicon_v2((const uint8_t*)lex_file, lex_size)) {
+                std::fprintf(stderr, "Bad lexicon.bin\n"); return 0;
+            }
+        } else if (lex_version == 3) {
+            if (lex_size < sizeof(LexHeader) + (uint64_t)lh->term_count * sizeof(LexRec3)) {
+                std::fprintf(stderr, "Bad lexicon.bin\n"); return 0;
+            }
+            lex3 = (const LexRec3*)((char*)lex_file + sizeof(LexHeader));
+        } else {
+            lex = (LexRec*)((char*)lex_file + sizeof(LexHeader));
+            term_pool = (char*)lex + (size_t)lh->term_count * sizeof(LexRec);
+        }
+
+        PostHeader* ph = (PostHeader*)postings_file;
+        if (postings_size < sizeof(PostHeader) || std::memcmp(ph->magic, "POST", 4) != 0 ||
+            ph->version < 1 || ph->version > 3) {
+            std::fprintf(stderr, "Bad postings.bin\n"); return 0;
+        }
+
+        load_doc_lens(index_dir, o);
+        load_positions(index_dir, o);
+        load_fst(index_dir, o);
+        if (lex_version == 3 && !fst_nodes) {
+            std::fprintf(stderr, "lexicon.bin v3 needs lexicon.fst\n"); return 0;
+        }
+        load_mph(index_dir, o);
+        load_kgram(index_dir, o);
+        return 1;
+    }
+
+    void destroy() {
+        docs_buf.close();
+        lex_buf.close();
+        post_buf.close();
+        doclen_buf.close();
+        pos_buf.close();
+        mph_buf.close();
+        fst_buf.close();
+        kg_buf.close();
+        kg_k=kg_count=0; kg_off=nullptr; kg_keys=nullptr; kg_lists=nullptr;
+        fst_nodes=nullptr; fst_root=0; fst_max_len=0; lex3=nullptr;
+        mph_nlevels=0; mph_level=nullptr; mph_words=nullptr; mph_rank=nullptr; mph_ord=nullptr; mph_fp=nullptr;
+        doc_lens=nullptr; avg_doc_len=0.0; pos_table=nullptr;
+        postings_file=nullptr; postings_size=0;
+        dh=nullptr; docs=nullptr; doc_pool=nullptr;
+        lh=nullptr; lex=nullptr; term_pool=nullptr;
+        std::free(sample_pool); std::free(sample_off);
+        sample_pool=nullptr; sample_off=nullptr;
+        lex_version=1; lex_block_terms=lex_nblocks=0;
+        lex_file_p=nullptr; lex_file_size=0; lex_table=nullptr;
+    }
+};
+
+// Walks the terms of lexicon.fst in order, starting at any ordinal.
+struct FstIter {
+    const Index* idx = nullptr;
+    FstNode* st = nullptr;        // st[d]: node at depth d, after the arc taken
+    char* term = nullptr;         // current term: term[0..len), ordinal ord
+    uint32_t len = 0, ord = 0;
+    int valid = 0;
+
+    void init(const Index& x) {
+        idx = &x;
+        st = (FstNode*)std::malloc(((size_t)x.fst_max_len + 1) * sizeof(FstNode));
+        term = (char*)std::malloc((size_t)x.fst_max_len + 1);
+        if (!st || !term) { std::fprintf(stderr, "malloc fst iterator failed\n"); std::exit(1); }
+    }
+    void destroy() { std::free(st); std::free(term); st = nullptr; term = nullptr; }
+
+    void seek(uint32_t o) {
+        valid = o < idx->term_count();
+        if (!valid) return;
+        ord = o;
+        len = 0;
+        st[0].open(idx->fst_nodes, idx->fst_root);
+        uint32_t r = o;
+        while (!(st[len].final && r == 0)) {
+            // last arc whose output is <= r
+            FstNode& n = st[len];
+            FstNode probe = n;
+            while (probe.next_arc() && probe.out <= r) n = probe;
+            r -= n.out;
+            term[len++] = (char)n.label;
+            st[len].open(idx->fst_nodes, n.target);
+        }
+    }
+
+    int next() {
+        if (!valid) return 0;
+        while (!st[len].next_arc()) {
+            if (len == 0) { valid = 0; return 0; }
+            len--;
+        }
+        ord++;
+        for (;;) {
+            term[len] = (char)st[len].label;
+            len++;
+            st[len].open(idx->fst_nodes, st[len - 1].target);
+            if (st[len].final) return 1;
+            st[len].next_arc();
+        }
+    }
+};
 
 struct U32Vec {
     uint32_t* a = nullptr;
@@ -209,16 +1692,241 @@ struct U32Vec {
     }
 };
 
-static void op_and(const uint32_t* a, uint32_t na, const uint32_t* b, uint32_t nb, U32Vec* out) {
-    out->clear();
-    out->reserve((na < nb) ? na : nb);
-    uint32_t i=0,j=0;
+// ---- intersection kernels ----
+// All kernels write the intersection of two sorted unique lists to out
+// (capacity >= min(na,nb)) and return its length.
+
+static uint32_t isect_scalar(const uint32_t* a, uint32_t na, const uint32_t* b, uint32_t nb, uint32_t* out) {
+    uint32_t i=0,j=0,k=0;
     while (i<na && j<nb) {
         uint32_t x=a[i], y=b[j];
-        if (x==y) { out->push(x); i++; j++; }
+        if (x==y) { out[k++]=x; i++; j++; }
         else if (x<y) i++;
         else j++;
     }
+    return k;
+}
+
+// First index in [lo,n) with a[idx] >= x, probing lo+1, lo+2, lo+4, ...
+static inline uint32_t gallop_lower_bound(const uint32_t* a, uint32_t lo, uint32_t n, uint32_t x) {
+    if (lo >= n || a[lo] >= x) return lo;
+    uint32_t step = 1;
+    uint32_t hi = lo + 1;
+    while (hi < n && a[hi] < x) {
+        lo = hi;
+        step <<= 1;
+        hi = (n - lo > step) ? lo + step : n;
+    }
+    lo++;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (a[mid] < x) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// small must be the shorter list.
+static uint32_t isect_gallop(const uint32_t* small, uint32_t ns, const uint32_t* large, uint32_t nl, uint32_t* out) {
+    uint32_t j=0,k=0;
+    for (uint32_t i=0; i<ns && j<nl; i++) {
+        uint32_t x = small[i];
+        j = gallop_lower_bound(large, j, nl, x);
+        if (j < nl && large[j] == x) { out[k++] = x; j++; }
+    }
+    return k;
+}
+
+#ifdef HAVE_X86_SIMD
+// Block-compare: every element of a 4-wide block of a is tested against all
+// four rotations of the current block of b (AVX2: against 8 broadcasts of
+// b's block); the block with the smaller maximum advances.
+__attribute__((target("sse4.2")))
+static uint32_t isect_sse(const uint32_t* a, uint32_t na, const uint32_t* b, uint32_t nb, uint32_t* out) {
+    uint32_t i=0,j=0,k=0;
+    if (na >= 4 && nb >= 4) {
+        while (i+4<=na && j+4<=nb) {
+            __m128i va = _mm_loadu_si128((const __m128i*)(a+i));
+            __m128i vb = _mm_loadu_si128((const __m128i*)(b+j));
+            __m128i m = _mm_cmpeq_epi32(va, vb);
+            m = _mm_or_si128(m, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0,3,2,1))));
+            m = _mm_or_si128(m, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1,0,3,2))));
+            m = _mm_or_si128(m, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2,1,0,3))));
+            uint32_t mask = (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(m));
+            while (mask) {
+                out[k++] = a[i + (uint32_t)__builtin_ctz(mask)];
+                mask &= mask - 1;
+            }
+            uint32_t amax = a[i+3], bmax = b[j+3];
+            if (amax <= bmax) i += 4;
+            if (bmax <= amax) j += 4;
+        }
+    }
+    return k + isect_scalar(a+i, na-i, b+j, nb-j, out+k);
+}
+
+__attribute__((target("avx2")))
+static uint32_t isect_avx2(const uint32_t* a, uint32_t na, const uint32_t* b, uint32_t nb, uint32_t* out) {
+    uint32_t i=0,j=0,k=0;
+    if (na >= 8 && nb >= 8) {
+        while (i+8<=na && j+8<=nb) {
+            __m256i va = _mm256_loadu_si256((const __m256i*)(a+i));
+            const int* pb = (const int*)(b+j);
+            __m256i m0 = _mm256_or_si256(_mm256_cmpeq_epi32(va, _mm256_set1_epi32(pb[0])),
+                                         _mm256_cmpeq_epi32(va, _mm256_set1_epi32(pb[1])));
+            __m256i m1 = _mm256_or_si256(_mm256_cmpeq_epi32(va, _mm256_set1_epi32(pb[2])),
+                                         _mm256_cmpeq_epi32(va, _mm256_set1_epi32(pb[3])));
+            __m256i m2 = _mm256_or_si256(_mm256_cmpeq_epi32(va, _mm256_set1_epi32(pb[4])),
+                                         _mm256_cmpeq_epi32(va, _mm256_set1_epi32(pb[5])));
+            __m256i m3 = _mm256_or_si256(_mm256_cmpeq_epi32(va, _mm256_set1_epi32(pb[6])),
+                                         _mm256_cmpeq_epi32(va, _mm256_set1_epi32(pb[7])));
+            __m256i m = _mm256_or_si256(_mm256_or_si256(m0, m1), _mm256_or_si256(m2, m3));
+            uint32_t mask = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(m));
+            while (mask) {
+                out[k++] = a[i + (uint32_t)__builtin_ctz(mask)];
+                mask &= mask - 1;
+            }
+            uint32_t amax = a[i+7], bmax = b[j+7];
+            if (amax <= bmax) i += 8;
+            if (bmax <= amax) j += 8;
+        }
+    }
+    return k + isect_sse(a+i, na-i, b+j, nb-j, out+k);
+}
+#endif
+
+// ---- counting kernels (--stats-only) ----
+// Same walks as above, but only |a & b| is returned and nothing is written.
+
+static uint32_t count_scalar(const uint32_t* a, uint32_t na, const uint32_t* b, uint32_t nb) {
+    uint32_t i=0,j=0,k=0;
+    while (i<na && j<nb) {
+        uint32_t x=a[i], y=b[j];
+        k += (x==y);
+        i += (x<=y);
+        j += (y<=x);
+    }
+    return k;
+}
+
+static uint32_t count_gallop(const uint32_t* small, uint32_t ns, const uint32_t* large, uint32_t nl) {
+    uint32_t j=0,k=0;
+    for (uint32_t i=0; i<ns && j<nl; i++) {
+        j = gallop_lower_bound(large, j, nl, small[i]);
+        if (j < nl && large[j] == small[i]) { k++; j++; }
+    }
+    return k;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse4.2")))
+static uint32_t count_sse(const uint32_t* a, uint32_t na, const uint32_t* b, uint32_t nb) {
+    uint32_t i=0,j=0,k=0;
+    while (i+4<=na && j+4<=nb) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a+i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b+j));
+        __m128i m = _mm_cmpeq_epi32(va, vb);
+        m = _mm_or_si128(m, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0,3,2,1))));
+        m = _mm_or_si128(m, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1,0,3,2))));
+        m = _mm_or_si128(m, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2,1,0,3))));
+        k += (uint32_t)__builtin_popcount((uint32_t)_mm_movemask_ps(_mm_castsi128_ps(m)));
+        uint32_t amax = a[i+3], bmax = b[j+3];
+        if (amax <= bmax) i += 4;
+        if (bmax <= amax) j += 4;
+    }
+    return k + count_scalar(a+i, na-i, b+j, nb-j);
+}
+
+__attribute__((target("avx2")))
+static uint32_t count_avx2(const uint32_t* a, uint32_t na, const uint32_t* b, uint32_t nb) {
+    uint32_t i=0,j=0,k=0;
+    while (i+8<=na && j+8<=nb) {
+        __m256i va = _mm256_loadu_si256((const __m256i*)(a+i));
+        const int* pb = (const int*)(b+j);
+        __m256i m0 = _mm256_or_si256(_mm256_cmpeq_epi32(va, _mm256_set1_epi32(pb[0])),
+                                     _mm256_cmpeq_epi32(va, _mm256_set1_epi32(pb[1])));
+        __m256i m1 = _mm256_or_si256(_mm256_cmpeq_epi32(va, _mm256_set1_epi32(pb[2])),
+                                     _mm256_cmpeq_epi32(va, _mm256_set1_epi32(pb[3])));
+        __m256i m2 = _mm256_or_si256(_mm256_cmpeq_epi32(va, _mm256_set1_epi32(pb[4])),
+                                     _mm256_cmpeq_epi32(va, _mm256_set1_epi32(pb[5])));
+        __m256i m3 = _mm256_or_si256(_mm256_cmpeq_epi32(va, _mm256_set1_epi32(pb[6])),
+                                     _mm256_cmpeq_epi32(va, _mm256_set1_epi32(pb[7])));
+        __m256i m = _mm256_or_si256(_mm256_or_si256(m0, m1), _mm256_or_si256(m2, m3));
+        k += (uint32_t)__builtin_popcount((uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(m)));
+        uint32_t amax = a[i+7], bmax = b[j+7];
+        if (amax <= bmax) i += 8;
+        if (bmax <= amax) j += 8;
+    }
+    return k + count_sse(a+i, na-i, b+j, nb-j);
+}
+#endif
+
+typedef uint32_t (*IsectFn)(const uint32_t*, uint32_t, const uint32_t*, uint32_t, uint32_t*);
+typedef uint32_t (*CountFn)(const uint32_t*, uint32_t, const uint32_t*, uint32_t);
+
+enum IsaLevel { ISA_SCALAR = 0, ISA_SSE42 = 1, ISA_AVX2 = 2 };
+
+static const char* isa_name(int isa) {
+    if (isa == ISA_AVX2) return "avx2";
+    if (isa == ISA_SSE42) return "sse4.2";
+    return "scalar";
+}
+
+static int detect_isa() {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return ISA_AVX2;
+    if (__builtin_cpu_supports("sse4.2")) return ISA_SSE42;
+#endif
+    return ISA_SCALAR;
+}
+
+static IsectFn isect_kernel_for(int isa) {
+#ifdef HAVE_X86_SIMD
+    if (isa == ISA_AVX2) return isect_avx2;
+    if (isa == ISA_SSE42) return isect_sse;
+#endif
+    (void)isa;
+    return isect_scalar;
+}
+
+static CountFn count_kernel_for(int isa) {
+#ifdef HAVE_X86_SIMD
+    if (isa == ISA_AVX2) return count_avx2;
+    if (isa == ISA_SSE42) return count_sse;
+#endif
+    (void)isa;
+    return count_scalar;
+}
+
+static IsectFn g_isect_block = isect_scalar;
+static CountFn g_count_block = count_scalar;
+static const uint32_t GALLOP_RATIO = 32;
+
+static void set_isa(int isa) {
+    g_isect_block = isect_kernel_for(isa);
+    g_count_block = count_kernel_for(isa);
+    g_hw_popcnt = (isa >= ISA_SSE42);
+}
+
+static uint32_t isect_auto(const uint32_t* a, uint32_t na, const uint32_t* b, uint32_t nb, uint32_t* out) {
+    if (na > nb) { const uint32_t* t=a; a=b; b=t; uint32_t tn=na; na=nb; nb=tn; }
+    if (na == 0) return 0;
+    if (nb / na > GALLOP_RATIO) return isect_gallop(a, na, b, nb, out);
+    return g_isect_block(a, na, b, nb, out);
+}
+
+static uint32_t count_and_auto(const uint32_t* a, uint32_t na, const uint32_t* b, uint32_t nb) {
+    if (na > nb) { const uint32_t* t=a; a=b; b=t; uint32_t tn=na; na=nb; nb=tn; }
+    if (na == 0) return 0;
+    if (nb / na > GALLOP_RATIO) return count_gallop(a, na, b, nb);
+    return g_count_block(a, na, b, nb);
+}
+
+static void op_and(const uint32_t* a, uint32_t na, const uint32_t* b, uint32_t nb, U32Vec* out) {
+    out->clear();
+    out->reserve((na < nb) ? na : nb);
+    out->n = isect_auto(a, na, b, nb, out->a);
 }
 static void op_or(const uint32_t* a, uint32_t na, const uint32_t* b, uint32_t nb, U32Vec* out) {
     out->clear();
@@ -244,14 +1952,46 @@ static void op_not(uint32_t doc_count, const uint32_t* a, uint32_t na, U32Vec* o
     }
 }
 
-enum TokType { T_TERM, T_AND, T_OR, T_NOT, T_LP, T_RP, T_END, T_BAD };
+// a \ b. Gallops through b when it is much longer than a.
+static uint32_t andnot_u32(const uint32_t* a, uint32_t na, const uint32_t* b, uint32_t nb, uint32_t* out) {
+    uint32_t i=0,j=0,k=0;
+    if (na && nb / na > GALLOP_RATIO) {
+        for (; i<na; i++) {
+            uint32_t x = a[i];
+            j = gallop_lower_bound(b, j, nb, x);
+            if (j < nb && b[j] == x) { j++; continue; }
+            out[k++] = x;
+        }
+        return k;
+    }
+    while (i<na && j<nb) {
+        uint32_t x=a[i], y=b[j];
+        if (x==y) { i++; j++; }
+        else if (x<y) { out[k++]=x; i++; }
+        else j++;
+    }
+    while (i<na) out[k++]=a[i++];
+    return k;
+}
+
+static void op_andnot(const uint32_t* a, uint32_t na, const uint32_t* b, uint32_t nb, U32Vec* out) {
+    out->clear();
+    out->reserve(na);
+    out->n = andnot_u32(a, na, b, nb, out->a);
+}
+
+enum TokType { T_TERM, T_AND, T_OR, T_NOT, T_ANDNOT, T_LP, T_RP, T_END, T_BAD, T_PHRASE, T_NEAR, T_PREFIX, T_WILD };
 
+// T_NEAR carries its window k in len. T_PREFIX (term*) and T_WILD (any other
+// pattern with '*') keep the '*' in text.
 struct Tok {
     TokType type;
     char text[256];
     uint16_t len;
 };
 
+static const uint32_t NEAR_MAX_K = 65535;
+
 struct TokStream {
     const char* s;
     size_t i;
@@ -263,6 +2003,15 @@ struct TokStream {
         while (i<n && (s[i]==' '||s[i]=='\t'||s[i]=='\r'||s[i]=='\n')) i++;
     }
 
+    uint16_t read_near_k() {
+        uint32_t k=0;
+        while (i<n && s[i]>='0' && s[i]<='9') {
+            k = k*10 + (uint32_t)(s[i++]-'0');
+            if (k > NEAR_MAX_K) k = NEAR_MAX_K;
+        }
+        return (uint16_t)k;
+    }
+
     Tok next() {
         skip_spaces();
         Tok t{}; t.type=T_END; t.len=0; t.text[0]='\0';
@@ -285,16 +2034,56 @@ struct TokStream {
             return t;
         }
 
-        if (is_ascii_alnum((unsigned char)c)) {
+        if (c=='/' && i+1<n && s[i+1]>='0' && s[i+1]<='9') {
+            i++;
+            t.type=T_NEAR;
+            t.len=read_near_k();
+            return t;
+        }
+        // NEAR/k, any case
+        if (i+5<=n && (s[i]=='N'||s[i]=='n') && (s[i+1]=='E'||s[i+1]=='e') && (s[i+2]=='A'||s[i+2]=='a') &&
+            (s[i+3]=='R'||s[i+3]=='r') && s[i+4]=='/' && i+5<n && s[i+5]>='0' && s[i+5]<='9') {
+            i+=5;
+            t.type=T_NEAR;
+            t.len=read_near_k();
+            return t;
+        }
+
+        if (c=='"') {
+            // "w1 w2 ...": words joined by single spaces; unterminated runs to end of line
+            i++;
             int k=0;
-            while (i<n && is_ascii_alnum((unsigned char)s[i])) {
+            while (i<n && s[i]!='"') {
+                if (is_ascii_alnum((unsigned char)s[i])) {
+                    if (k>0 && k<255) t.text[k++]=' ';
+                    while (i<n && is_ascii_alnum((unsigned char)s[i])) {
+                        unsigned char cc=to_lower_ascii((unsigned char)s[i++]);
+                        if (k<255) t.text[k++]=(char)cc;
+                    }
+                } else i++;
+            }
+            if (i<n) i++;
+            t.text[k]='\0';
+            t.len=(uint16_t)k;
+            t.type=T_PHRASE;
+            return t;
+        }
+
+        if (is_ascii_alnum((unsigned char)c) || c=='*') {
+            // letters, digits and '*' (runs of '*' collapse into one)
+            int k=0, stars=0;
+            while (i<n && (is_ascii_alnum((unsigned char)s[i]) || s[i]=='*')) {
                 unsigned char cc=(unsigned char)s[i++];
+                if (cc=='*' && k>0 && t.text[k-1]=='*') continue;
                 cc = to_lower_ascii(cc);
-                if (k<255) t.text[k++] = (char)cc;
+                if (k<255) { t.text[k++] = (char)cc; stars += (cc=='*'); }
             }
             t.text[k]='\0';
             t.len=(uint16_t)k;
-            t.type=T_TERM;
+            if (stars==0) t.type=T_TERM;
+            else if (k==1) t.type=T_BAD;                            // a bare '*'
+            else if (stars==1 && t.text[k-1]=='*') t.type=T_PREFIX;
+            else t.type=T_WILD;
             return t;
         }
         i++;
@@ -304,6 +2093,7 @@ struct TokStream {
 };
 
 static int precedence(TokType t) {
+    if (t==T_NEAR) return 4;
     if (t==T_NOT) return 3;
     if (t==T_AND) return 2;
     if (t==T_OR)  return 1;
@@ -314,7 +2104,7 @@ static int is_right_assoc(TokType t) { return (t==T_NOT); }
 struct RpnItem {
     TokType type;
     char text[256];
-    uint16_t len;
+    uint16_t len;     // T_NEAR: window k
 };
 
 struct RpnVec {
@@ -333,26 +2123,43 @@ struct RpnVec {
     }
 };
 
+// Starts in inline storage, so typical queries parse without malloc.
 struct TokStack {
-    TokType* a=nullptr;
-    uint32_t n=0, cap=0;
-    void free_mem(){ std::free(a); a=nullptr; n=cap=0; }
-    void push(TokType t){
+    TokType inl[32];
+    uint16_t inl_k[32];
+    TokType* a=inl;
+    uint16_t* k=inl_k;     // NEAR window per entry
+    uint32_t n=0, cap=32;
+    void free_mem(){
+        if(a!=inl){ std::free(a); std::free(k); }
+        a=inl; k=inl_k; n=0; cap=32;
+    }
+    void push(TokType t, uint16_t kv=0){
         if(n==cap){
-            uint32_t nc=cap?cap*2:32;
-            TokType* nb=(TokType*)std::realloc(a,(size_t)nc*sizeof(TokType));
-            if(!nb){ std::fprintf(stderr,"realloc TokStack failed\n"); std::exit(1); }
-            a=nb; cap=nc;
+            uint32_t nc=cap*2;
+            TokType* nb=(TokType*)std::malloc((size_t)nc*sizeof(TokType));
+            uint16_t* nk=(uint16_t*)std::malloc((size_t)nc*sizeof(uint16_t));
+            if(!nb || !nk){ std::fprintf(stderr,"malloc TokStack failed\n"); std::exit(1); }
+            std::memcpy(nb,a,(size_t)n*sizeof(TokType));
+            std::memcpy(nk,k,(size_t)n*sizeof(uint16_t));
+            if(a!=inl){ std::free(a); std::free(k); }
+            a=nb; k=nk; cap=nc;
         }
-        a[n++]=t;
+        a[n]=t; k[n]=kv; n++;
     }
     TokType pop(){ return a[--n]; }
     TokType top() const { return a[n-1]; }
     int empty() const { return n==0; }
+    // pops the top operator into the output
+    void emit(RpnVec* out){
+        RpnItem it{}; it.type=a[n-1]; it.len=k[n-1];
+        out->push(it);
+        n--;
+    }
 };
 
-static int is_value_token(TokType t){ return t==T_TERM || t==T_RP; }
-static int can_start_value(TokType t){ return t==T_TERM || t==T_LP || t==T_NOT; }
+static int is_value_token(TokType t){ return t==T_TERM || t==T_PHRASE || t==T_PREFIX || t==T_WILD || t==T_RP; }
+static int can_start_value(TokType t){ return t==T_TERM || t==T_PHRASE || t==T_PREFIX || t==T_WILD || t==T_LP || t==T_NOT; }
 
 static void normalize_term(char* s, uint16_t* len) {
     int n = stem_word_en(s, (int)*len);
@@ -362,6 +2169,31 @@ static void normalize_term(char* s, uint16_t* len) {
     *len = (uint16_t)n;
 }
 
+// Normalizes every word of a phrase in place; returns the word count.
+static int normalize_phrase(char* s, uint16_t* len) {
+    char out[256];
+    int k = 0, words = 0;
+    uint16_t i = 0;
+    while (i < *len) {
+        while (i < *len && s[i] == ' ') i++;
+        if (i >= *len) break;
+        char w[256];
+        uint16_t wl = 0;
+        while (i < *len && s[i] != ' ') w[wl++] = s[i++];
+        w[wl] = '\0';
+        normalize_term(w, &wl);
+        if (wl == 0 || k + (k ? 1 : 0) + wl > 255) continue;
+        if (k) out[k++] = ' ';
+        std::memcpy(out + k, w, wl);
+        k += wl;
+        words++;
+    }
+    std::memcpy(s, out, (size_t)k);
+    s[k] = '\0';
+    *len = (uint16_t)k;
+    return words;
+}
+
 static void to_rpn(const char* line, RpnVec* out) {
     out->clear();
     TokStream ts; ts.init(line);
@@ -380,10 +2212,8 @@ static void to_rpn(const char* line, RpnVec* out) {
                 TokType top=ops.top();
                 if(top==T_LP) break;
                 int p1=precedence(top), p2=precedence(op);
-                if(p1>p2 || (p1==p2 && !is_right_assoc(op))){
-                    RpnItem it{}; it.type=top; out->push(it);
-                    ops.pop();
-                } else break;
+                if(p1>p2 || (p1==p2 && !is_right_assoc(op))) ops.emit(out);
+                else break;
             }
             ops.push(op);
         }
@@ -396,137 +2226,2733 @@ static void to_rpn(const char* line, RpnVec* out) {
                 out->push(it);
             } else {
             }
+        } else if(tok.type==T_PREFIX || tok.type==T_WILD){
+            // matched against the stemmed lexicon as typed
+            RpnItem it{}; it.type=tok.type; it.len=tok.len;
+            std::memcpy(it.text, tok.text, tok.len+1);
+            out->push(it);
+        } else if(tok.type==T_PHRASE){
+            int words = normalize_phrase(tok.text, &tok.len);
+            if (words > 0) {
+                RpnItem it{}; it.type = (words == 1) ? T_TERM : T_PHRASE; it.len=tok.len;
+                std::memcpy(it.text, tok.text, tok.len+1);
+                out->push(it);
+            }
         } else if(tok.type==T_LP){
             ops.push(T_LP);
         } else if(tok.type==T_RP){
-            while(!ops.empty() && ops.top()!=T_LP){
-                RpnItem it{}; it.type=ops.pop();
-                out->push(it);
-            }
+            while(!ops.empty() && ops.top()!=T_LP) ops.emit(out);
             if(!ops.empty() && ops.top()==T_LP) ops.pop(); 
-        } else if(tok.type==T_AND || tok.type==T_OR || tok.type==T_NOT){
+        } else if(tok.type==T_NOT){
+            // prefix operator: its operand is still to come, so nothing pending
+            // (a NEAR in a /3 !b) may be popped yet
+            ops.push(T_NOT);
+        } else if(tok.type==T_AND || tok.type==T_OR || tok.type==T_NEAR){
             TokType op=tok.type;
             while(!ops.empty()){
                 TokType top=ops.top();
                 if(top==T_LP) break;
                 int p1=precedence(top), p2=precedence(op);
-                if(p1>p2 || (p1==p2 && !is_right_assoc(op))){
-                    RpnItem it{}; it.type=top; out->push(it);
-                    ops.pop();
-                } else break;
+                if(p1>p2 || (p1==p2 && !is_right_assoc(op))) ops.emit(out);
+                else break;
             }
-            ops.push(op);
+            ops.push(op, op==T_NEAR ? tok.len : 0);
         }
 
         prev=tok;
     }
 
     while(!ops.empty()){
-        TokType top=ops.pop();
-        if(top==T_LP) continue;
-        RpnItem it{}; it.type=top;
-        out->push(it);
+        if(ops.top()==T_LP){ ops.pop(); continue; }
+        ops.emit(out);
     }
 
     ops.free_mem();
 }
 
-struct Res { uint32_t* a=nullptr; uint32_t n=0; };
+// ---- wildcards ----
+// term* matches the lexicon terms that start with term, other patterns
+// (*ization, *matrix*, ab*ing) use '*' for any run of characters. Patterns
+// are compared with the stemmed terms and are not stemmed themselves.
+// term* is one ordinal range of the sorted lexicon. Other patterns take
+// the range of their literal head (all terms without one), narrowed by
+// intersecting the lexicon.kgram lists of their k-grams; every candidate
+// is then matched against the pattern. At most g_max_expansions terms are
+// used: the first ones in term order, or the most frequent with
+// --expansions-by-df. The chosen lists are merged in one pass, by a heap
+// over all of them when the union is sparse, into a bitset otherwise.
 
-struct ResStack {
-    Res* a=nullptr; uint32_t n=0, cap=0;
-    void free_all(){
-        for(uint32_t i=0;i<n;i++) std::free(a[i].a);
-        std::free(a); a=nullptr; n=cap=0;
-    }
-    void push(uint32_t* arr, uint32_t n_){
-        if(n==cap){
-            uint32_t nc=cap?cap*2:32;
-            Res* nb=(Res*)std::realloc(a,(size_t)nc*sizeof(Res));
-            if(!nb){ std::fprintf(stderr,"realloc ResStack failed\n"); std::exit(1); }
-            a=nb; cap=nc;
-        }
-        a[n++]=Res{arr,n_};
-    }
-    int empty() const { return n==0; }
-    Res pop_safe(){
-        if (n==0) return Res{nullptr,0};
-        return a[--n];
-    }
+static uint32_t g_max_expansions = 1024;
+static int g_expand_by_df = 0;
+static std::atomic<int> g_warned_expansions{0};
+static std::atomic<int> g_warned_no_kgram{0};
+
+struct Expansion {
+    uint32_t* ords = nullptr;   // chosen lexicon ordinals, ascending
+    LexRec* recs = nullptr;     // their records
+    uint32_t n = 0;
+    uint32_t matched = 0;       // terms that match (n, unless capped)
+    uint64_t total = 0;         // sum of the chosen postings counts
 };
 
-static uint32_t* copy_list(const uint32_t* p, uint32_t n){
-    if(n==0) return nullptr;
-    uint32_t* a=(uint32_t*)std::malloc((size_t)n*sizeof(uint32_t));
-    if(!a){ std::fprintf(stderr,"malloc copy_list failed\n"); std::exit(1); }
-    std::memcpy(a,p,(size_t)n*sizeof(uint32_t));
-    return a;
+static void expansion_free(Expansion* e) {
+    std::free(e->ords); std::free(e->recs);
+    e->ords = nullptr; e->recs = nullptr; e->n = e->matched = 0; e->total = 0;
 }
 
-static void eval_rpn(const Index& idx, const RpnVec& rpn, Res* out_res) {
-    ResStack st;
-    U32Vec tmp;
+struct ExpCand { LexRec r; uint32_t ord; };
 
-    for(uint32_t i=0;i<rpn.n;i++){
-        const RpnItem& it=rpn.a[i];
+// Min-heap on df; on equal df the later ordinal is the worse one.
+static inline int exp_worse(const ExpCand& a, const ExpCand& b) {
+    return a.r.df < b.r.df || (a.r.df == b.r.df && a.ord > b.ord);
+}
 
-        if(it.type==T_TERM){
-            uint32_t lex_i=0;
-            if(!idx.find_term(it.text,it.len,&lex_i)){
-                st.push(nullptr,0);
+static void exp_sift_down(ExpCand* h, uint32_t n, uint32_t i) {
+    for (;;) {
+        uint32_t l = 2*i + 1, m = i;
+        if (l < n && exp_worse(h[l], h[m])) m = l;
+        if (l + 1 < n && exp_worse(h[l + 1], h[m])) m = l + 1;
+        if (m == i) return;
+        ExpCand t = h[i]; h[i] = h[m]; h[m] = t;
+        i = m;
+    }
+}
+
+static int exp_cmp_ord(const void* pa, const void* pb) {
+    uint32_t a = ((const ExpCand*)pa)->ord, b = ((const ExpCand*)pb)->ord;
+    return a < b ? -1 : a > b ? 1 : 0;
+}
+
+// Picks the expansion among matching terms offered in ascending ordinal
+// order: the first cap, or with --expansions-by-df the cap largest df.
+struct ExpSelect {
+    ExpCand* h = nullptr;
+    uint32_t cap = 0, n = 0, matched = 0;
+
+    // upper: most terms that can match
+    void init(uint32_t upper) {
+        cap = upper < g_max_expansions ? upper : g_max_expansions;
+        h = (ExpCand*)std::malloc((size_t)(cap ? cap : 1) * sizeof(ExpCand));
+        if (!h) { std::fprintf(stderr, "malloc expansion failed\n"); std::exit(1); }
+    }
+    // In term order the rest only adds to matched.
+    int full() const { return !g_expand_by_df && n == cap; }
+    void offer(uint32_t ord, const LexRec& r) {
+        matched++;
+        ExpCand c{ r, ord };
+        if (n < cap) {
+            h[n++] = c;
+            if (g_expand_by_df && n == cap) for (uint32_t k=n/2; k-- > 0;) exp_sift_down(h, n, k);
+        } else if (g_expand_by_df && cap && exp_worse(h[0], c)) {
+            h[0] = c;
+            exp_sift_down(h, n, 0);
+        }
+    }
+    // Moves the choice to out and frees the heap; label is the query text.
+    void finish(const Index& idx, Expansion* out, const char* label, uint16_t label_len) {
+        *out = Expansion();
+        out->matched = matched;
+        if (n) {
+            if (g_expand_by_df) std::qsort(h, n, sizeof(ExpCand), exp_cmp_ord);
+            out->ords = (uint32_t*)std::malloc((size_t)n * sizeof(uint32_t));
+            out->recs = (LexRec*)std::malloc((size_t)n * sizeof(LexRec));
+            if (!out->ords || !out->recs) { std::fprintf(stderr, "malloc expansion failed\n"); std::exit(1); }
+            for (uint32_t i=0;i<n;i++) {
+                out->ords[i] = h[i].ord;
+                out->recs[i] = h[i].r;
+                out->total += idx.postings_count(h[i].r);
+            }
+            out->n = n;
+        }
+        std::free(h);
+        h = nullptr;
+        if (out->n < out->matched && !g_warned_expansions.exchange(1))
+            std::fprintf(stderr, "WARN: %.*s matches %u terms, using %u %s (--max-expansions)\n",
+                         (int)label_len, label, out->matched, out->n,
+                         g_expand_by_df ? "with the highest df" : "in term order");
+    }
+};
+
+// text = "prefix*".
+static void expand_prefix(const Index& idx, const char* text, uint16_t len, Expansion* out) {
+    uint32_t lo, hi;
+    idx.prefix_range(text, (uint16_t)(len - 1), &lo, &hi);
+    ExpSelect sel;
+    sel.init(hi - lo);
+    // records in chunks; in term order only the first cap are read
+    const uint32_t CHUNK = 4096;
+    LexRec* buf = (LexRec*)std::malloc((size_t)CHUNK * sizeof(LexRec));
+    if (!buf) { std::fprintf(stderr, "malloc expansion failed\n"); std::exit(1); }
+    for (uint32_t at=lo; at<hi && !sel.full(); at+=CHUNK) {
+        uint32_t m = hi - at < CHUNK ? hi - at : CHUNK;
+        idx.recs(at, m, buf);
+        for (uint32_t j=0;j<m;j++) sel.offer(at + j, buf[j]);
+    }
+    std::free(buf);
+    sel.matched = hi - lo;
+    sel.finish(idx, out, text, len);
+}
+
+// '*' matches any run of bytes, anything else itself. Greedy with one
+// backtrack point: a later '*' makes earlier choices final.
+static int glob_match(const char* p, uint32_t pn, const char* s, uint32_t sn) {
+    uint32_t i = 0, j = 0, star = 0xFFFFFFFFu, mark = 0;
+    while (j < sn) {
+        if (i < pn && p[i] == '*') { star = i++; mark = j; }
+        else if (i < pn && p[i] == s[j]) { i++; j++; }
+        else if (star != 0xFFFFFFFFu) { i = star + 1; j = ++mark; }
+        else return 0;
+    }
+    while (i < pn && p[i] == '*') i++;
+    return i == pn;
+}
+
+// Term strings and records by ordinal, cheapest in ascending order: v1
+// from the pool, v2 a whole block decoded at a time, v3 by walking
+// lexicon.fst.
+struct TermReader {
+    const Index* idx = nullptr;
+    FstIter it;
+    // v2: block blk decoded, term j in text[toff[j] .. toff[j+1])
+    uint32_t blk = 0xFFFFFFFFu;
+    char* text = nullptr;
+    size_t text_cap = 0;
+    uint32_t* toff = nullptr;
+    LexRec* brec = nullptr;
+    uint32_t bn = 0;
+
+    void init(const Index& x) {
+        idx = &x;
+        if (x.lex_version == 3) it.init(x);
+        if (x.lex_version == 2) {
+            toff = (uint32_t*)std::malloc(((size_t)x.lex_block_terms + 1) * sizeof(uint32_t));
+            brec = (LexRec*)std::malloc((size_t)x.lex_block_terms * sizeof(LexRec));
+            if (!toff || !brec) { std::fprintf(stderr, "malloc term reader failed\n"); std::exit(1); }
+        }
+    }
+    void destroy() {
+        if (idx && idx->lex_version == 3) it.destroy();
+        std::free(text); std::free(toff); std::free(brec);
+        text = nullptr; toff = nullptr; brec = nullptr;
+    }
+
+    int load_block(uint32_t b) {
+        const Index& x = *idx;
+        const uint8_t* p = x.lex_file_p + x.lex_block_off(b);
+        const uint8_t* end = x.lex_file_p + x.lex_block_off(b + 1);
+        uint32_t cnt = (b + 1 == x.lex_nblocks) ? x.term_count() - b * x.lex_block_terms : x.lex_block_terms;
+        Lex2Entry e;
+        uint64_t off = 0;
+        uint32_t at = 0, prev = 0;
+        bn = 0;
+        blk = 0xFFFFFFFFu;
+        for (uint32_t k=0; k<cnt; k++) {
+            if (!lex2_read(&p, end, k == 0, off, &e) || e.shared > prev) return 0;
+            off = e.r.postings_off;
+            size_t need = (size_t)at + e.shared + e.suffix_len;
+            if (need > text_cap) {
+                size_t nc = text_cap ? text_cap : 4096;
+                while (nc < need) nc *= 2;
+                char* nb = (char*)std::realloc(text, nc);
+                if (!nb) { std::fprintf(stderr, "realloc term reader failed\n"); std::exit(1); }
+                text = nb; text_cap = nc;
+            }
+            if (k) std::memmove(text + at, text + toff[k - 1], e.shared);
+            std::memcpy(text + at + e.shared, e.suffix, e.suffix_len);
+            toff[k] = at;
+            brec[k] = e.r;
+            prev = e.shared + e.suffix_len;
+            at += prev;
+        }
+        toff[cnt] = at;
+        bn = cnt;
+        blk = b;
+        return 1;
+    }
+
+    // 0 if the lexicon data of ord is corrupt.
+    int get(uint32_t ord, const char** t, uint32_t* len, LexRec* r) {
+        const Index& x = *idx;
+        if (x.lex_version == 1) {
+            const LexRec& q = x.lex[ord];
+            *t = x.term_pool + q.term_off;
+            *len = q.term_len;
+            *r = q;
+            return 1;
+        }
+        if (x.lex_version == 3) {
+            if (!(it.valid && it.ord + 1 == ord && it.next())) it.seek(ord);
+            if (!it.valid || it.ord != ord) return 0;
+            *t = it.term;
+            *len = it.len;
+            *r = x.rec(ord);
+            return 1;
+        }
+        uint32_t b = ord / x.lex_block_terms, j = ord % x.lex_block_terms;
+        if (b != blk && !load_block(b)) return 0;
+        *t = text + toff[j];
+        *len = toff[j + 1] - toff[j];
+        *r = brec[j];
+        return 1;
+    }
+};
+
+// Ascending term ordinals of k-gram list [p, end) into out; 0 if corrupt.
+static int kgram_decode(const Index& idx, const uint8_t* p, const uint8_t* end, U32Vec* out) {
+    out->clear();
+    uint64_t v, cur = 0;
+    while (p < end) {
+        if (!vbyte_read(&p, end, &v)) return 0;
+        if (out->n && v == 0) return 0;
+        cur += v;
+        if (cur >= idx.term_count()) return 0;
+        out->push((uint32_t)cur);
+    }
+    return 1;
+}
+
+// Candidates for a pattern from lexicon.kgram: the intersection of the
+// lists of every k-gram in its '$'-padded literal runs, shortest list
+// first. Returns 0 when the pattern has no complete k-gram (nothing to
+// narrow by); *cand is then untouched.
+static int kgram_candidates(const Index& idx, const char* pat, uint16_t plen, U32Vec* cand) {
+    char pad[260];
+    uint32_t n = 0;
+    pad[n++] = '$';
+    for (uint16_t i=0;i<plen;i++) pad[n++] = pat[i];
+    pad[n++] = '$';
+
+    const uint32_t MAXG = 256;
+    const uint8_t* gp[MAXG];
+    const uint8_t* ge[MAXG];
+    uint32_t ng = 0;
+    uint32_t run = 0;
+    for (uint32_t i=0;i<n;i++) {
+        if (pad[i] == '*') { run = 0; continue; }
+        if (++run < idx.kg_k) continue;
+        uint32_t key = 0;
+        for (uint32_t j=i+1-idx.kg_k; j<=i; j++) key = key << 8 | (uint8_t)pad[j];
+        const uint8_t* p;
+        const uint8_t* e;
+        if (!idx.kgram_list(key, &p, &e)) { cand->clear(); return 1; }   // no term has this gram
+        if (ng < MAXG) { gp[ng] = p; ge[ng] = e; ng++; }
+    }
+    if (ng == 0) return 0;
+
+    // shortest (in bytes) first
+    for (uint32_t i=1;i<ng;i++)
+        for (uint32_t j=i; j>0 && ge[j] - gp[j] < ge[j-1] - gp[j-1]; j--) {
+            const uint8_t* t = gp[j]; gp[j] = gp[j-1]; gp[j-1] = t;
+            t = ge[j]; ge[j] = ge[j-1]; ge[j-1] = t;
+        }
+    U32Vec next, tmp;
+    if (!kgram_decode(idx, gp[0], ge[0], cand)) cand->clear();
+    for (uint32_t g=1; g<ng && cand->n; g++) {
+        if (gp[g] == gp[g-1]) continue;   // same gram twice
+        if (!kgram_decode(idx, gp[g], ge[g], &next)) { cand->clear(); break; }
+        op_and(cand->a, cand->n, next.a, next.n, &tmp);
+        U32Vec x = *cand; *cand = tmp; tmp = x;
+    }
+    next.free_mem();
+    tmp.free_mem();
+    return 1;
+}
+
+// Any pattern with a '*' that is not just a trailing one.
+static void expand_wildcard(const Index& idx, const char* pat, uint16_t plen, Expansion* out) {
+    uint16_t head = 0;
+    while (head < plen && pat[head] != '*') head++;
+    uint32_t lo = 0, hi = idx.term_count();
+    if (head) idx.prefix_range(pat, head, &lo, &hi);
+
+    U32Vec cand;
+    int have_cand = 0;
+    if (idx.kg_k) have_cand = kgram_candidates(idx, pat, plen, &cand);
+    else if (!head && !g_warned_no_kgram.exchange(1))
+        std::fprintf(stderr, "WARN: no lexicon.kgram (indexer --kgram), wildcards scan the lexicon\n");
+
+    uint32_t a = 0, b = have_cand ? cand.n : hi - lo;
+    if (have_cand) {
+        // only the candidates inside the head's range
+        while (a < b && cand.a[a] < lo) a++;
+        while (b > a && cand.a[b - 1] >= hi) b--;
+    }
+    ExpSelect sel;
+    sel.init(b - a);
+    TermReader tr;
+    tr.init(idx);
+    for (uint32_t i=a; i<b; i++) {
+        uint32_t ord = have_cand ? cand.a[i] : lo + i;
+        const char* t;
+        uint32_t len;
+        LexRec r;
+        if (!tr.get(ord, &t, &len, &r)) continue;
+        if (glob_match(pat, plen, t, len)) sel.offer(ord, r);
+    }
+    tr.destroy();
+    cand.free_mem();
+    sel.finish(idx, out, pat, plen);
+}
+
+// The expansion of a T_PREFIX / T_WILD item.
+static void expand_item(const Index& idx, const RpnItem& it, Expansion* out) {
+    if (it.type == T_PREFIX) expand_prefix(idx, it.text, it.len, out);
+    else expand_wildcard(idx, it.text, it.len, out);
+}
+
+// heap[] holds list numbers t keyed on all[seg[t]].
+static inline void merge_sift_down(uint32_t* heap, uint32_t n, uint32_t i, const uint32_t* all, const uint32_t* seg) {
+    for (;;) {
+        uint32_t l = 2*i + 1, m = i;
+        if (l < n && all[seg[heap[l]]] < all[seg[heap[m]]]) m = l;
+        if (l + 1 < n && all[seg[heap[l + 1]]] < all[seg[heap[m]]]) m = l + 1;
+        if (m == i) return;
+        uint32_t x = heap[i]; heap[i] = heap[m]; heap[m] = x;
+        i = m;
+    }
+}
+
+// Union of the chosen lists: ascending ids in *out_a, or a bitset of
+// bitmap_words() words in *out_bits when there are more than N/32 postings
+// (as for dense terms in eval_rpn). Returns the doc count; both outputs
+// stay nullptr when it is 0.
+static uint32_t expansion_union(const Index& idx, const Expansion& e, uint32_t** out_a, uint64_t** out_bits) {
+    *out_a = nullptr;
+    *out_bits = nullptr;
+    if (e.total == 0) return 0;
+
+    if (e.total * 32 > (uint64_t)idx.doc_count()) {
+        size_t nw = idx.bitmap_words();
+        uint64_t* bits = (uint64_t*)std::calloc(nw ? nw : 1, sizeof(uint64_t));
+        uint32_t max_df = 0;
+        for (uint32_t t=0;t<e.n;t++) {
+            uint32_t c = idx.postings_count(e.recs[t]);
+            if (!(e.recs[t].flags & (LEX_F_BITMAP | LEX_F_ROARING)) && c > max_df) max_df = c;
+        }
+        uint32_t* ids = (uint32_t*)std::malloc((size_t)(max_df ? max_df : 1) * sizeof(uint32_t));
+        if (!bits || !ids) { std::fprintf(stderr, "malloc prefix union failed\n"); std::exit(1); }
+        for (uint32_t t=0;t<e.n;t++) {
+            const LexRec& r = e.recs[t];
+            const uint64_t* w = idx.bitmap_ptr(r);
+            RoarList rl;
+            if (w) bm_or(bits, w, nw);
+            else if (idx.roaring_list(r, &rl)) roar_or_bitset(rl, bits, nw);
+            else if (!(r.flags & (LEX_F_BITMAP | LEX_F_ROARING))) {
+                const uint32_t* p = idx.postings_ptr(r);
+                uint32_t m = p ? r.postings_len : idx.decode_postings(r, ids);
+                // ids past doc_count (corrupt lists) would land outside the bitset
+                for (uint32_t i=0;i<m;i++) {
+                    uint32_t d = p ? p[i] : ids[i];
+                    if (d < idx.doc_count()) bits[d >> 6] |= 1ULL << (d & 63);
+                }
+            }
+        }
+        std::free(ids);
+        uint32_t cnt = (uint32_t)bm_popcount(bits, nw);
+        if (cnt == 0) { std::free(bits); return 0; }
+        *out_bits = bits;
+        return cnt;
+    }
+
+    // sparse: every list decoded back to back, then one k-way heap merge
+    uint32_t* all = (uint32_t*)std::malloc((size_t)e.total * sizeof(uint32_t));
+    uint32_t* seg = (uint32_t*)std::malloc(((size_t)e.n + 1) * sizeof(uint32_t));
+    uint32_t* end = (uint32_t*)std::malloc((size_t)e.n * sizeof(uint32_t));
+    uint32_t* heap = (uint32_t*)std::malloc((size_t)e.n * sizeof(uint32_t));
+    uint32_t* out = (uint32_t*)std::malloc((size_t)e.total * sizeof(uint32_t));
+    if (!all || !seg || !end || !heap || !out) { std::fprintf(stderr, "malloc prefix union failed\n"); std::exit(1); }
+    uint32_t at = 0, hn = 0;
+    for (uint32_t t=0;t<e.n;t++) {
+        seg[t] = at;
+        at += idx.decode_postings(e.recs[t], all + at);
+        end[t] = at;
+        if (end[t] > seg[t]) heap[hn++] = t;
+    }
+    for (uint32_t k=hn/2; k-- > 0;) merge_sift_down(heap, hn, k, all, seg);
+    uint32_t cnt = 0;
+    while (hn) {
+        uint32_t t = heap[0];
+        uint32_t d = all[seg[t]++];
+        if (cnt == 0 || out[cnt - 1] != d) out[cnt++] = d;
+        if (seg[t] == end[t]) heap[0] = heap[--hn];
+        merge_sift_down(heap, hn, 0, all, seg);
+    }
+    std::free(all); std::free(seg); std::free(end); std::free(heap);
+    if (cnt == 0) { std::free(out); return 0; }
+    *out_a = out;
+    return cnt;
+}
+
+// neg=1 means the value is the complement of a (NOT is applied lazily).
+// bits != nullptr: the value is an owned bitset (n = its popcount), a is unused.
+struct Res { uint32_t* a=nullptr; uint32_t n=0; int neg=0; uint64_t* bits=nullptr; };
+
+static void res_free(Res* r) { std::free(r->a); std::free(r->bits); r->a = nullptr; r->bits = nullptr; }
+
+struct ResStack {
+    Res* a=nullptr; uint32_t n=0, cap=0;
+    void free_all(){
+        for(uint32_t i=0;i<n;i++) res_free(&a[i]);
+        std::free(a); a=nullptr; n=cap=0;
+    }
+    void push_res(const Res& r){
+        if(n==cap){
+            uint32_t nc=cap?cap*2:32;
+            Res* nb=(Res*)std::realloc(a,(size_t)nc*sizeof(Res));
+            if(!nb){ std::fprintf(stderr,"realloc ResStack failed\n"); std::exit(1); }
+            a=nb; cap=nc;
+        }
+        a[n++]=r;
+    }
+    void push(uint32_t* arr, uint32_t n_, int neg=0){ push_res(Res{arr,n_,neg,nullptr}); }
+    void push_bits(uint64_t* bits, uint32_t n_, int neg=0){ push_res(Res{nullptr,n_,neg,bits}); }
+    int empty() const { return n==0; }
+    Res pop_safe(){
+        if (n==0) return Res{nullptr,0,0};
+        return a[--n];
+    }
+};
+
+static uint32_t* copy_list(const uint32_t* p, uint32_t n){
+    if(n==0) return nullptr;
+    uint32_t* a=(uint32_t*)std::malloc((size_t)n*sizeof(uint32_t));
+    if(!a){ std::fprintf(stderr,"malloc copy_list failed\n"); std::exit(1); }
+    std::memcpy(a,p,(size_t)n*sizeof(uint32_t));
+    return a;
+}
+
+// push_binary when an operand is a bitset (nw words). Bitset & bitset stays
+// word-parallel; an array meets a bitset by probing its ids, and the result
+// keeps whichever side is cheaper (AND and a \ bitset stay arrays).
+static void push_binary_bits(ResStack* st, TokType op, Res a, Res b, int neg, size_t nw) {
+    if (a.bits && b.bits) {
+        if (op==T_AND) bm_and(a.bits, b.bits, nw);
+        else if (op==T_OR) bm_or(a.bits, b.bits, nw);
+        else bm_andnot(a.bits, b.bits, nw);
+        res_free(&b);
+        st->push_bits(a.bits, (uint32_t)bm_popcount(a.bits, nw), neg);
+        return;
+    }
+    Res arr = a.bits ? b : a;
+    Res bm = a.bits ? a : b;
+    if (op==T_AND || (op==T_ANDNOT && !a.bits)) {
+        uint32_t k = arr.a ? bm_filter(arr.a, arr.n, bm.bits, op==T_AND, arr.a) : 0;
+        res_free(&bm);
+        st->push(arr.a, k, neg);
+        return;
+    }
+    if (op==T_OR) bm_set_ids(bm.bits, arr.a, arr.n);
+    else bm_clear_ids(bm.bits, arr.a, arr.n);   // bitset \ array
+    res_free(&arr);
+    st->push_bits(bm.bits, (uint32_t)bm_popcount(bm.bits, nw), neg);
+}
+
+// Combines two positive lists with op (T_AND, T_OR or T_ANDNOT = a \ b),
+// frees both inputs and pushes the result.
+static void push_binary(ResStack* st, U32Vec* tmp, TokType op, Res a, Res b, int neg, size_t nw) {
+    if (a.bits || b.bits) { push_binary_bits(st, op, a, b, neg, nw); return; }
+    if (op==T_AND) {
+        if (a.n==0 || b.n==0) { std::free(a.a); std::free(b.a); st->push(nullptr,0,neg); return; }
+        op_and(a.a,a.n,b.a,b.n,tmp);
+    } else if (op==T_OR) {
+        if (a.n==0) { std::free(a.a); st->push(b.a,b.n,neg); return; }
+        if (b.n==0) { std::free(b.a); st->push(a.a,a.n,neg); return; }
+        op_or(a.a,a.n,b.a,b.n,tmp);
+    } else {
+        if (a.n==0 || b.n==0) { std::free(b.a); st->push(a.a,a.n,neg); return; }
+        op_andnot(a.a,a.n,b.a,b.n,tmp);
+    }
+    std::free(a.a); std::free(b.a);
+    st->push(copy_list(tmp->a,tmp->n), tmp->n, neg);
+}
+
+// NOT only flips Res::neg; AND/OR with negated operands are rewritten into
+// AND-NOT (or De Morgan), so a complement list is built only when the whole
+// query is negated:
+//   A & !B = A \ B        !A & !B = !(A | B)
+//   A | !B = !(B \ A)     !A | !B = !(A & B)
+//
+// starts[] mirrors the stack with the rpn index where each value's
+// subexpression begins, so NEAR can re-plan its operands from the terms.
+static uint32_t* positional_docs(const Index& idx, const RpnVec& rpn, uint32_t from, uint32_t to, uint32_t* out_n);
+
+static void eval_rpn(const Index& idx, const RpnVec& rpn, Res* out_res) {
+    ResStack st;
+    U32Vec tmp;
+    U32Vec starts;
+    size_t nw = idx.bitmap_words();
+
+    for(uint32_t i=0;i<rpn.n;i++){
+        const RpnItem& it=rpn.a[i];
+        uint32_t arity = (it.type==T_NOT) ? 1 : (it.type==T_AND || it.type==T_OR || it.type==T_NEAR) ? 2 : 0;
+        if(arity > starts.n) arity = starts.n;
+        uint32_t from = arity ? starts.a[starts.n-arity] : i;
+        starts.n -= arity;
+        starts.push(from);
+
+        if(it.type==T_TERM){
+            uint32_t lex_i=0;
+            LexRec r;
+            if(!idx.find_term(it.text,it.len,&lex_i,&r)){
+                st.push(nullptr,0);
             } else {
-                const LexRec& r=idx.lex[lex_i];
+                uint32_t cnt=idx.postings_count(r);
                 const uint32_t* p=idx.postings_ptr(r);
-                if(!p || r.postings_len==0) st.push(nullptr,0);
-                else st.push(copy_list(p,r.postings_len), r.postings_len);
+                const uint64_t* w=idx.bitmap_ptr(r);
+                RoarList rl;
+                // dense roaring terms join the bitset ops like LEX_F_BITMAP ones
+                int dense_roar = (uint64_t)cnt * 32 > (uint64_t)idx.doc_count() && idx.roaring_list(r,&rl);
+                if(cnt==0) st.push(nullptr,0);
+                else if(w || dense_roar){
+                    uint64_t* bits=(uint64_t*)std::malloc(nw*sizeof(uint64_t));
+                    if(!bits){ std::fprintf(stderr,"malloc bitmap failed\n"); std::exit(1); }
+                    if(w) std::memcpy(bits,w,nw*sizeof(uint64_t));
+                    else roar_to_bitset(rl,bits,nw);
+                    st.push_bits(bits,cnt);
+                }
+                else if(p) st.push(copy_list(p,cnt), cnt);
+                else {
+                    uint32_t* a=(uint32_t*)std::malloc((size_t)cnt*sizeof(uint32_t));
+                    if(!a){ std::fprintf(stderr,"malloc postings failed\n"); std::exit(1); }
+                    uint32_t got=idx.decode_postings(r,a);
+                    if(got==0){ std::free(a); st.push(nullptr,0); }
+                    else st.push(a,got);
+                }
+            }
+        }
+        else if(it.type==T_PREFIX || it.type==T_WILD){
+            Expansion e;
+            expand_item(idx, it, &e);
+            uint32_t* a;
+            uint64_t* bits;
+            uint32_t cnt=expansion_union(idx, e, &a, &bits);
+            expansion_free(&e);
+            if(bits) st.push_bits(bits,cnt);
+            else st.push(a,cnt);
+        }
+        else if(it.type==T_PHRASE || it.type==T_NEAR){
+            if(it.type==T_NEAR){
+                Res b = st.pop_safe(); res_free(&b);
+                Res a = st.pop_safe(); res_free(&a);
+            }
+            uint32_t n=0;
+            uint32_t* a=positional_docs(idx,rpn,from,i,&n);
+            st.push(a,n);
+        }
+        else if(it.type==T_NOT){
+            Res a = st.pop_safe();
+            a.neg = !a.neg; st.push_res(a);
+        }
+        else if(it.type==T_AND || it.type==T_OR){
+            Res b = st.pop_safe();
+            Res a = st.pop_safe();
+            int is_and = (it.type==T_AND);
+
+            if(!a.neg && !b.neg)      push_binary(&st,&tmp, it.type, a, b, 0, nw);
+            else if(a.neg && b.neg)   push_binary(&st,&tmp, is_and ? T_OR : T_AND, a, b, 1, nw);
+            else {
+                Res pos = a.neg ? b : a;
+                Res neg = a.neg ? a : b;
+                if(is_and) push_binary(&st,&tmp, T_ANDNOT, pos, neg, 0, nw);
+                else       push_binary(&st,&tmp, T_ANDNOT, neg, pos, 1, nw);
+            }
+        }
+    }
+    Res res = st.pop_safe();
+    while(!st.empty()){
+        Res x = st.pop_safe();
+        res_free(&x);
+    }
+    std::free(st.a);
+    starts.free_mem();
+
+    if (res.bits) {
+        if (res.neg) { bm_not(res.bits, nw, idx.doc_count()); res.neg = 0; }
+        uint32_t cnt = (uint32_t)bm_popcount(res.bits, nw);
+        uint32_t* a = (uint32_t*)std::malloc((size_t)(cnt ? cnt : 1) * sizeof(uint32_t));
+        if (!a) { std::fprintf(stderr, "malloc result failed\n"); std::exit(1); }
+        bm_extract(res.bits, nw, a);
+        std::free(res.bits);
+        res = Res{a, cnt, 0, nullptr};
+    }
+
+    if (res.neg) {
+        op_not(idx.doc_count(), res.a, res.n, &tmp);
+        std::free(res.a);
+        res = Res{copy_list(tmp.a,tmp.n), tmp.n, 0};
+    }
+    tmp.free_mem();
+
+    *out_res = res;
+}
+
+// ---- --bench-and: intersection kernels on real postings ----
+
+struct BenchPair { uint32_t* a; uint32_t na; uint32_t* b; uint32_t nb; };
+
+static uint64_t xorshift64(uint64_t* st) {
+    uint64_t x = *st;
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    *st = x;
+    return x;
+}
+
+static uint32_t* bench_load_list(const Index& idx, uint32_t lex_i, uint32_t* out_n) {
+    const LexRec r = idx.rec(lex_i);
+    uint32_t cnt = idx.postings_count(r);
+    uint32_t* a = (uint32_t*)std::malloc((size_t)(cnt ? cnt : 1) * sizeof(uint32_t));
+    if (!a) { std::fprintf(stderr, "malloc bench list failed\n"); std::exit(1); }
+    *out_n = idx.decode_postings(r, a);
+    return a;
+}
+
+static void bench_and_set(const char* set_name, const BenchPair* pairs, uint32_t np, uint32_t reps, int best_isa) {
+    uint32_t max_out = 0;
+    uint64_t elems = 0;
+    for (uint32_t p=0; p<np; p++) {
+        uint32_t m = pairs[p].na < pairs[p].nb ? pairs[p].na : pairs[p].nb;
+        if (m > max_out) max_out = m;
+        elems += (uint64_t)pairs[p].na + pairs[p].nb;
+    }
+    uint32_t* out = (uint32_t*)std::malloc((size_t)(max_out ? max_out : 1) * sizeof(uint32_t));
+    uint32_t* ref = (uint32_t*)std::malloc((size_t)(max_out ? max_out : 1) * sizeof(uint32_t));
+    if (!out || !ref) { std::fprintf(stderr, "malloc bench out failed\n"); std::exit(1); }
+
+    const char* names[5] = { "scalar", "sse4.2", "avx2", "gallop", "auto" };
+    for (int kernel=0; kernel<5; kernel++) {
+        if ((kernel == 1 && best_isa < ISA_SSE42) || (kernel == 2 && best_isa < ISA_AVX2)) continue;
+
+        uint64_t hits = 0;
+        int mismatch = 0;
+        double t0 = now_sec_monotonic();
+        for (uint32_t rep=0; rep<reps; rep++) {
+            for (uint32_t p=0; p<np; p++) {
+                const BenchPair& bp = pairs[p];
+                const uint32_t* s = bp.a; uint32_t ns = bp.na;
+                const uint32_t* l = bp.b; uint32_t nl = bp.nb;
+                if (ns > nl) { s = bp.b; ns = bp.nb; l = bp.a; nl = bp.na; }
+                uint32_t k;
+                if (kernel == 0)      k = isect_scalar(s, ns, l, nl, out);
+                else if (kernel == 3) k = isect_gallop(s, ns, l, nl, out);
+                else if (kernel == 4) k = isect_auto(s, ns, l, nl, out);
+                else                  k = isect_kernel_for(kernel == 1 ? ISA_SSE42 : ISA_AVX2)(s, ns, l, nl, out);
+                hits += k;
+                if (rep == 0) {
+                    uint32_t rk = isect_scalar(s, ns, l, nl, ref);
+                    if (rk != k || (k && std::memcmp(ref, out, (size_t)k * sizeof(uint32_t)) != 0)) mismatch = 1;
+                }
+            }
+        }
+        double t = now_sec_monotonic() - t0;
+        double ns_per = elems ? (t * 1e9) / ((double)elems * reps) : 0.0;
+        std::printf("[BENCH] and set=%s pairs=%u reps=%u kernel=%s time=%.3f ms ns/elem=%.3f hits=%llu%s\n",
+            set_name, np, reps, names[kernel], t * 1e3, ns_per,
+            (unsigned long long)(hits / (reps ? reps : 1)), mismatch ? " MISMATCH" : "");
+    }
+    std::free(out);
+    std::free(ref);
+}
+
+static int run_bench_and(const Index& idx, uint32_t pairs_per_set, uint32_t reps, uint32_t min_df) {
+    uint32_t* cand = (uint32_t*)std::malloc((size_t)(idx.term_count() ? idx.term_count() : 1) * sizeof(uint32_t));
+    if (!cand) { std::fprintf(stderr, "malloc bench candidates failed\n"); return 1; }
+    uint32_t nc = 0;
+    for (uint32_t i=0; i<idx.term_count(); i++) if (idx.rec(i).df >= min_df) cand[nc++] = i;
+    if (nc < 2) {
+        std::fprintf(stderr, "Not enough terms with df >= %u for the benchmark\n", min_df);
+        std::free(cand);
+        return 1;
+    }
+
+    BenchPair* similar = (BenchPair*)std::calloc(pairs_per_set, sizeof(BenchPair));
+    BenchPair* skewed = (BenchPair*)std::calloc(pairs_per_set, sizeof(BenchPair));
+    if (!similar || !skewed) { std::fprintf(stderr, "calloc bench pairs failed\n"); return 1; }
+    uint32_t n_sim = 0, n_skew = 0;
+
+    uint64_t rng = 0x9E3779B97F4A7C15ULL;
+    for (uint64_t attempt=0; attempt < (uint64_t)pairs_per_set * 2000 && (n_sim < pairs_per_set || n_skew < pairs_per_set); attempt++) {
+        uint32_t x = cand[xorshift64(&rng) % nc];
+        uint32_t y = cand[xorshift64(&rng) % nc];
+        if (x == y) continue;
+        uint32_t dx = idx.rec(x).df, dy = idx.rec(y).df;
+        uint32_t lo = dx < dy ? dx : dy, hi = dx < dy ? dy : dx;
+        int is_skew = (hi / lo > GALLOP_RATIO);
+        if (is_skew ? (n_skew >= pairs_per_set) : (n_sim >= pairs_per_set)) continue;
+        BenchPair bp{};
+        bp.a = bench_load_list(idx, x, &bp.na);
+        bp.b = bench_load_list(idx, y, &bp.nb);
+        if (is_skew) skewed[n_skew++] = bp; else similar[n_sim++] = bp;
+    }
+
+    int best = detect_isa();
+    std::printf("[BENCH] cpu=%s candidates=%u (df>=%u) similar_pairs=%u skewed_pairs=%u gallop_ratio=%u\n",
+        isa_name(best), nc, min_df, n_sim, n_skew, GALLOP_RATIO);
+    if (n_sim) bench_and_set("similar", similar, n_sim, reps, best);
+    if (n_skew) bench_and_set("skewed", skewed, n_skew, reps, best);
+
+    for (uint32_t i=0; i<n_sim; i++) { std::free(similar[i].a); std::free(similar[i].b); }
+    for (uint32_t i=0; i<n_skew; i++) { std::free(skewed[i].a); std::free(skewed[i].b); }
+    std::free(similar); std::free(skewed); std::free(cand);
+    return 0;
+}
+
+// ---- document-at-a-time evaluation over posting cursors ----
+// Cursors read straight from the index buffers (raw lists in place, VByte
+// lists one 128-id block at a time) and are composed into an operator tree,
+// so no per-term or intermediate doc-id lists are allocated.
+
+static const uint32_t DOC_END = 0xFFFFFFFFu;
+
+enum CursorKind { C_EMPTY, C_RAW, C_VBYTE, C_BITMAP, C_ROARING, C_AND, C_OR, C_ANDNOT, C_NOT, C_PHRASE, C_NEAR };
+
+struct Cursor {
+    CursorKind kind = C_EMPTY;
+    uint32_t doc = DOC_END;
+
+    // C_RAW (tfp: uint16 tf per id, nullptr without LEX_F_TF)
+    const uint32_t* p = nullptr;
+    const uint16_t* tfp = nullptr;
+    uint32_t n = 0, i = 0;
+
+    // C_VBYTE
+    const PostBlockDir* dir = nullptr;
+    const uint8_t* data = nullptr;
+    const uint8_t* data_end = nullptr;
+    uint32_t df = 0, nblocks = 0, blk = 0, bn = 0, bi = 0;
+    int has_tf = 0;
+    uint32_t buf[POSTINGS_BLOCK];
+    uint32_t tfbuf[POSTINGS_BLOCK];
+
+    // C_BITMAP: i is the rank of doc (its posting index), n = df, tfp as for
+    // C_RAW; blast = last doc of each 128-posting block (top-k only)
+    const uint64_t* bits = nullptr;
+    uint32_t nwords = 0;
+    const uint32_t* blast = nullptr;
+
+    // C_ROARING: rc = current chunk of rl; rj = array index / run index within
+    // it, rrank = postings in the runs before rj; bits = bitmap container.
+    // i, n, tfp and blast as for C_BITMAP.
+    RoarList rl;
+    uint32_t rc = 0, rj = 0, rrank = 0;
+
+    // positions of the current posting (leaves under C_PHRASE/C_NEAR); pos_p is the
+    // record of posting pos_idx, posbuf holds the decoded positions
+    const uint8_t* pos_dir = nullptr;
+    const uint8_t* pos_data = nullptr;
+    const uint8_t* pos_end = nullptr;
+    const uint8_t* pos_p = nullptr;
+    uint32_t pos_idx = 0;
+    uint32_t* posbuf = nullptr;
+    uint32_t pos_n = 0, pos_cap = 0;
+
+    // C_AND / C_OR: kids[0..nk); C_ANDNOT: kids[0] \ kids[1]; C_NOT: complement of kids[0]
+    // C_PHRASE: AND of kids[] whose positions line up at offs[k] within the phrase
+    // C_NEAR: AND of kids[] with one position each inside a span of window tokens
+    Cursor** kids = nullptr;
+    uint32_t nk = 0;
+    uint32_t doc_count = 0;
+    const uint32_t* offs = nullptr;
+    uint32_t window = 0;
+
+    // planner estimate and term text, for --explain
+    uint32_t est = 0;
+    const char* label = nullptr;
+    uint16_t label_len = 0;
+};
+
+static void cur_next(Cursor* c);
+static void cur_advance(Cursor* c, uint32_t target);
+
+static void vbyte_load_block(Cursor* c, uint32_t b) {
+    c->blk = b;
+    uint32_t base = b ? c->dir[b-1].last_doc : 0;
+    uint32_t cnt = c->df - b * POSTINGS_BLOCK;
+    if (cnt > POSTINGS_BLOCK) cnt = POSTINGS_BLOCK;
+    const uint8_t* start = c->data + c->dir[b].byte_off;
+    const uint8_t* p = (start > c->data_end) ? nullptr : vbyte_decode_gaps(start, c->data_end, base, cnt, c->buf);
+    if (p && c->has_tf) p = vbyte_decode_u32(p, c->data_end, cnt, c->tfbuf);
+    if (!p) {
+        c->doc = DOC_END; c->bn = 0; c->bi = 0;
+        return;
+    }
+    c->bn = cnt;
+    c->bi = 0;
+    c->doc = c->buf[0];
+}
+
+static void and_align(Cursor* c) {
+    uint32_t target = c->kids[0]->doc;
+    uint32_t k = 0, matched = 0;
+    while (target != DOC_END) {
+        Cursor* kid = c->kids[k];
+        cur_advance(kid, target);
+        if (kid->doc != target) { target = kid->doc; matched = 1; }
+        else matched++;
+        if (matched == c->nk) break;
+        k = (k + 1) % c->nk;
+    }
+    c->doc = target;
+}
+
+static void or_align(Cursor* c) {
+    uint32_t m = DOC_END;
+    for (uint32_t k=0; k<c->nk; k++) if (c->kids[k]->doc < m) m = c->kids[k]->doc;
+    c->doc = m;
+}
+
+static void andnot_align(Cursor* c) {
+    Cursor* a = c->kids[0];
+    Cursor* b = c->kids[1];
+    while (a->doc != DOC_END) {
+        cur_advance(b, a->doc);
+        if (b->doc != a->doc) break;
+        cur_next(a);
+    }
+    c->doc = a->doc;
+}
+
+static inline uint32_t cur_posting_index(const Cursor* c) {
+    return (c->kind == C_RAW || c->kind == C_BITMAP || c->kind == C_ROARING) ? c->i : c->blk * POSTINGS_BLOCK + c->bi;
+}
+
+// First set bit >= target in w[0..nw) (cur < target is a set bit), adding
+// the set bits in [cur, target) to *rank on the way; nw*64 if there is none.
+static inline __attribute__((always_inline)) uint32_t bits_seek_body(const uint64_t* w, uint32_t nw, uint32_t cur,
+                                                                     uint32_t target, uint32_t* rank) {
+    uint32_t wd = cur >> 6, wt = target >> 6;
+    if (wt >= nw) return nw * 64;
+    if (wd == wt) {
+        uint64_t m = (~0ULL << (cur & 63)) & ((1ULL << (target & 63)) - 1);
+        *rank += (uint32_t)__builtin_popcountll(w[wd] & m);
+    } else {
+        *rank += (uint32_t)__builtin_popcountll(w[wd] >> (cur & 63));
+        for (uint32_t k = wd + 1; k < wt; k++) *rank += (uint32_t)__builtin_popcountll(w[k]);
+        *rank += (uint32_t)__builtin_popcountll(w[wt] & ((1ULL << (target & 63)) - 1));
+    }
+    uint64_t x = w[wt] & (~0ULL << (target & 63));
+    while (!x) {
+        if (++wt >= nw) return nw * 64;
+        x = w[wt];
+    }
+    return wt * 64 + (uint32_t)__builtin_ctzll(x);
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse4.2")))
+static uint32_t bits_seek_hw(const uint64_t* w, uint32_t nw, uint32_t cur, uint32_t target, uint32_t* rank) {
+    return bits_seek_body(w, nw, cur, target, rank);
+}
+#endif
+
+static uint32_t bits_seek(const uint64_t* w, uint32_t nw, uint32_t cur, uint32_t target, uint32_t* rank) {
+#ifdef HAVE_X86_SIMD
+    if (g_hw_popcnt) return bits_seek_hw(w, nw, cur, target, rank);
+#endif
+    return bits_seek_body(w, nw, cur, target, rank);
+}
+
+// Moves a bitmap cursor to the first set bit >= target (> doc), keeping i
+// the rank of doc.
+static void bitmap_seek(Cursor* c, uint32_t target) {
+    uint32_t d = bits_seek(c->bits, c->nwords, c->doc, target, &c->i);
+    c->doc = d < c->nwords * 64 ? d : DOC_END;
+}
+
+// Positions a roaring cursor on the first id of chunk k.
+static void roar_load(Cursor* c, uint32_t k) {
+    c->rc = k;
+    if (k >= c->rl.n) { c->doc = DOC_END; return; }
+    const RoarChunk& ch = c->rl.dir[k];
+    c->i = ch.rank;
+    c->rj = 0;
+    c->rrank = 0;
+    uint32_t low;
+    if (ch.type == ROAR_BITMAP) {
+        c->bits = roar_words(c->rl, ch);
+        uint32_t w = 0;
+        while (!c->bits[w]) w++;     // n > 0, checked by roaring_list
+        low = w * 64 + (uint32_t)__builtin_ctzll(c->bits[w]);
+    } else {
+        low = roar_u16(c->rl, ch)[0];
+    }
+    c->doc = ((uint32_t)ch.key << 16) | low;
+}
+
+// Moves a roaring cursor to the first id >= target (> doc): whole chunks
+// are skipped by key, then the container is searched by its own kind.
+static void roar_seek(Cursor* c, uint32_t target) {
+    uint32_t key = target >> 16;
+    if (key != c->rl.dir[c->rc].key) {
+        uint32_t lo = c->rc + 1, hi = c->rl.n;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (c->rl.dir[mid].key < key) lo = mid + 1; else hi = mid;
+        }
+        roar_load(c, lo);
+        if (c->doc >= target) return;
+    }
+    const RoarChunk& ch = c->rl.dir[c->rc];
+    uint32_t low = target & 0xFFFF, cur = c->doc & 0xFFFF, found;
+    if (ch.type == ROAR_BITMAP) {
+        uint32_t r = c->i;
+        found = bits_seek(c->bits, ROAR_WORDS, cur, low, &r);
+        if (found >= 65536) { roar_load(c, c->rc + 1); return; }
+        c->i = r;
+    } else if (ch.type == ROAR_ARRAY) {
+        const uint16_t* v = roar_u16(c->rl, ch);
+        uint32_t j = c->rj;
+        if (j + 8 < ch.n && v[j + 8] < low) {
+            uint32_t hi = ch.n;
+            while (j < hi) {
+                uint32_t mid = j + (hi - j) / 2;
+                if (v[mid] < low) j = mid + 1; else hi = mid;
+            }
+        } else {
+            while (j < ch.n && v[j] < low) j++;
+        }
+        if (j >= ch.n) { roar_load(c, c->rc + 1); return; }
+        c->rj = j;
+        c->i = ch.rank + j;
+        found = v[j];
+    } else {
+        const uint16_t* v = roar_u16(c->rl, ch);
+        uint32_t j = c->rj;
+        while (j < ch.n && v[2*j+1] < low) { c->rrank += (uint32_t)(v[2*j+1] - v[2*j]) + 1; j++; }
+        if (j >= ch.n) { roar_load(c, c->rc + 1); return; }
+        c->rj = j;
+        found = low > v[2*j] ? low : v[2*j];
+        c->i = ch.rank + c->rrank + (found - v[2*j]);
+    }
+    c->doc = ((uint32_t)ch.key << 16) | found;
+}
+
+// Next id of a roaring cursor: array and run containers step in place.
+static inline void roar_next(Cursor* c) {
+    const RoarChunk& ch = c->rl.dir[c->rc];
+    if (ch.type == ROAR_ARRAY) {
+        if (++c->rj >= ch.n) { roar_load(c, c->rc + 1); return; }
+        c->i++;
+        c->doc = (c->doc & 0xFFFF0000u) | roar_u16(c->rl, ch)[c->rj];
+        return;
+    }
+    if (ch.type == ROAR_RUN) {
+        const uint16_t* v = roar_u16(c->rl, ch);
+        uint32_t low = c->doc & 0xFFFF;
+        if (low < v[2*c->rj+1]) { c->doc++; c->i++; return; }
+        c->rrank += (uint32_t)(v[2*c->rj+1] - v[2*c->rj]) + 1;
+        if (++c->rj >= ch.n) { roar_load(c, c->rc + 1); return; }
+        c->i++;
+        c->doc = (c->doc & 0xFFFF0000u) | v[2*c->rj];
+        return;
+    }
+    roar_seek(c, c->doc + 1);
+}
+
+// Decodes the positions of the leaf's current posting into posbuf. Moves
+// forward within a block by skipping records; jumps via the block
+// directory otherwise. Returns 0 if the data is missing or corrupt.
+static int cur_load_positions(Cursor* c) {
+    c->pos_n = 0;
+    if (!c->pos_data) return 0;
+    uint32_t want = cur_posting_index(c);
+    uint32_t b = want / POSTINGS_BLOCK;
+    if (!c->pos_p || want < c->pos_idx || b != c->pos_idx / POSTINGS_BLOCK) {
+        uint32_t off;
+        std::memcpy(&off, c->pos_dir + (size_t)b * 4, 4);
+        if (off > (size_t)(c->pos_end - c->pos_data)) return 0;
+        c->pos_p = c->pos_data + off;
+        c->pos_idx = b * POSTINGS_BLOCK;
+    }
+    while (c->pos_idx < want) {
+        uint32_t cnt = 0;
+        const uint8_t* p = vbyte_decode_u32(c->pos_p, c->pos_end, 1, &cnt);
+        if (p) p = vbyte_skip(p, c->pos_end, cnt);
+        if (!p) { c->pos_p = nullptr; return 0; }
+        c->pos_p = p;
+        c->pos_idx++;
+    }
+    uint32_t cnt = 0;
+    const uint8_t* p = vbyte_decode_u32(c->pos_p, c->pos_end, 1, &cnt);
+    if (!p) return 0;
+    if (cnt > c->pos_cap) {
+        uint32_t nc = c->pos_cap ? c->pos_cap : 64;
+        while (nc < cnt) nc *= 2;
+        uint32_t* nb = (uint32_t*)std::realloc(c->posbuf, (size_t)nc * sizeof(uint32_t));
+        if (!nb) { std::fprintf(stderr, "realloc posbuf failed\n"); std::exit(1); }
+        c->posbuf = nb; c->pos_cap = nc;
+    }
+    if (!vbyte_decode_gaps(p, c->pos_end, 0, cnt, c->posbuf)) return 0;
+    c->pos_n = cnt;
+    return 1;
+}
+
+// All kids sit on c->doc. Walks the kid with the fewest positions and
+// looks up the other words at the matching offsets; stops at the first
+// occurrence of the phrase.
+static int phrase_match(Cursor* c) {
+    uint32_t drv = 0;
+    for (uint32_t k=0;k<c->nk;k++) {
+        if (!cur_load_positions(c->kids[k])) return 0;
+        if (c->kids[k]->pos_n < c->kids[drv]->pos_n) drv = k;
+    }
+    uint32_t idx[64];
+    for (uint32_t k=0;k<c->nk;k++) idx[k] = 0;
+    const Cursor* d = c->kids[drv];
+    for (uint32_t j=0;j<d->pos_n;j++) {
+        if (d->posbuf[j] < c->offs[drv]) continue;
+        uint32_t start = d->posbuf[j] - c->offs[drv];
+        uint32_t k = 0;
+        for (; k<c->nk; k++) {
+            if (k == drv) continue;
+            const Cursor* w = c->kids[k];
+            uint32_t want = start + c->offs[k];
+            while (idx[k] < w->pos_n && w->posbuf[idx[k]] < want) idx[k]++;
+            if (idx[k] >= w->pos_n) return 0;
+            if (w->posbuf[idx[k]] != want) break;
+        }
+        if (k == c->nk) return 1;
+    }
+    return 0;
+}
+
+// All kids sit on c->doc. Slides over the merged position lists, always
+// advancing the list with the smallest head, until the heads fit in
+// window tokens; stops at the first such window.
+static int near_match(Cursor* c) {
+    for (uint32_t k=0;k<c->nk;k++)
+        if (!cur_load_positions(c->kids[k]) || c->kids[k]->pos_n == 0) return 0;
+    uint32_t idx[64];
+    for (uint32_t k=0;k<c->nk;k++) idx[k] = 0;
+    while (1) {
+        uint32_t lo = 0, mx = 0;
+        for (uint32_t k=0;k<c->nk;k++) {
+            uint32_t v = c->kids[k]->posbuf[idx[k]];
+            if (v < c->kids[lo]->posbuf[idx[lo]]) lo = k;
+            if (v > mx) mx = v;
+        }
+        if (mx - c->kids[lo]->posbuf[idx[lo]] <= c->window) return 1;
+        if (++idx[lo] >= c->kids[lo]->pos_n) return 0;
+    }
+}
+
+static void positional_align(Cursor* c) {
+    while (1) {
+        and_align(c);
+        if (c->doc == DOC_END) return;
+        if (c->kind == C_PHRASE ? phrase_match(c) : near_match(c)) return;
+        cur_next(c->kids[0]);
+    }
+}
+
+static void not_align(Cursor* c, uint32_t d) {
+    Cursor* kid = c->kids[0];
+    while (d < c->doc_count) {
+        cur_advance(kid, d);
+        if (kid->doc != d) break;
+        d++;
+    }
+    c->doc = (d < c->doc_count) ? d : DOC_END;
+}
+
+static void cur_next(Cursor* c) {
+    if (c->doc == DOC_END) return;
+    switch (c->kind) {
+    case C_EMPTY: break;
+    case C_RAW:
+        c->i++;
+        c->doc = (c->i < c->n) ? c->p[c->i] : DOC_END;
+        break;
+    case C_VBYTE:
+        if (++c->bi < c->bn) c->doc = c->buf[c->bi];
+        else if (c->blk + 1 < c->nblocks) vbyte_load_block(c, c->blk + 1);
+        else c->doc = DOC_END;
+        break;
+    case C_BITMAP:
+        bitmap_seek(c, c->doc + 1);
+        break;
+    case C_ROARING:
+        roar_next(c);
+        break;
+    case C_AND:
+        cur_next(c->kids[0]);
+        and_align(c);
+        break;
+    case C_OR: {
+        uint32_t d = c->doc;
+        for (uint32_t k=0; k<c->nk; k++) if (c->kids[k]->doc == d) cur_next(c->kids[k]);
+        or_align(c);
+        break;
+    }
+    case C_ANDNOT:
+        cur_next(c->kids[0]);
+        andnot_align(c);
+        break;
+    case C_NOT:
+        not_align(c, c->doc + 1);
+        break;
+    case C_PHRASE:
+    case C_NEAR:
+        cur_next(c->kids[0]);
+        positional_align(c);
+        break;
+    }
+}
+
+static void cur_advance(Cursor* c, uint32_t target) {
+    if (c->doc >= target) return;
+    switch (c->kind) {
+    case C_EMPTY: break;
+    case C_RAW:
+        c->i = gallop_lower_bound(c->p, c->i, c->n, target);
+        c->doc = (c->i < c->n) ? c->p[c->i] : DOC_END;
+        break;
+    case C_VBYTE: {
+        if (c->dir[c->blk].last_doc < target) {
+            uint32_t b = c->blk + 1;
+            while (b < c->nblocks && c->dir[b].last_doc < target) b++;
+            if (b >= c->nblocks) { c->doc = DOC_END; break; }
+            vbyte_load_block(c, b);
+            if (c->doc == DOC_END) break;
+        }
+        while (c->buf[c->bi] < target) c->bi++;
+        c->doc = c->buf[c->bi];
+        break;
+    }
+    case C_BITMAP:
+        bitmap_seek(c, target);
+        break;
+    case C_ROARING:
+        roar_seek(c, target);
+        break;
+    case C_AND:
+        cur_advance(c->kids[0], target);
+        and_align(c);
+        break;
+    case C_OR:
+        for (uint32_t k=0; k<c->nk; k++) cur_advance(c->kids[k], target);
+        or_align(c);
+        break;
+    case C_ANDNOT:
+        cur_advance(c->kids[0], target);
+        andnot_align(c);
+        break;
+    case C_NOT:
+        not_align(c, target);
+        break;
+    case C_PHRASE:
+    case C_NEAR:
+        cur_advance(c->kids[0], target);
+        positional_align(c);
+        break;
+    }
+}
+
+// ---- result cache (--cache-mb) ----
+// Doc-id lists of whole sub-expressions, keyed by the canonical text of
+// their optimized plan (see plan_key) and evicted least-recently-used once
+// the byte budget is exceeded. Shared by all query threads: lookups pin an
+// entry (refs) for the lifetime of the query's CursorPool, so eviction only
+// unlinks it and the last holder frees it.
+
+struct CacheEntry {
+    char* key = nullptr;
+    uint32_t key_len = 0;
+    uint64_t hash = 0;
+    uint32_t* a = nullptr;
+    uint32_t n = 0;
+    int neg = 0;                  // list is the complement of the value (CurRef::neg)
+    std::atomic<uint32_t> refs{1};  // the cache itself + pinning queries
+    CacheEntry* hnext = nullptr;
+    CacheEntry* prev = nullptr;   // LRU list, head = most recent
+    CacheEntry* next = nullptr;
+    size_t bytes() const { return sizeof(CacheEntry) + key_len + (size_t)n * sizeof(uint32_t); }
+};
+
+static void cache_entry_release(CacheEntry* e) {
+    if (e->refs.fetch_sub(1) != 1) return;
+    std::free(e->a);
+    std::free(e->key);
+    delete e;
+}
+
+struct QueryCache {
+    std::mutex mu;
+    CacheEntry** buckets = nullptr;
+    uint32_t nbuckets = 0, n = 0;
+    size_t bytes = 0, cap_bytes = 0;
+    CacheEntry* head = nullptr;
+    CacheEntry* tail = nullptr;
+
+    void init(size_t cap) {
+        cap_bytes = cap;
+        nbuckets = 1024;
+        buckets = (CacheEntry**)std::calloc(nbuckets, sizeof(CacheEntry*));
+        if (!buckets) { std::fprintf(stderr, "calloc cache buckets failed\n"); std::exit(1); }
+    }
+
+    void destroy() {
+        while (head) { CacheEntry* e = head; head = e->next; cache_entry_release(e); }
+        std::free(buckets);
+        buckets = nullptr; tail = nullptr; nbuckets = n = 0; bytes = 0;
+    }
+
+    // Returns a pinned entry or nullptr.
+    CacheEntry* get(const char* key, uint32_t key_len) {
+        uint64_t h = fnv1a_64(key, (int)key_len);
+        std::lock_guard<std::mutex> lk(mu);
+        CacheEntry* e = buckets[h & (nbuckets - 1)];
+        while (e && !(e->hash == h && e->key_len == key_len && std::memcmp(e->key, key, key_len) == 0)) e = e->hnext;
+        if (!e) return nullptr;
+        lru_unlink(e);
+        lru_push_front(e);
+        e->refs.fetch_add(1);
+        return e;
+    }
+
+    // Takes ownership of a (malloc'd); copies key.
+    void put(const char* key, uint32_t key_len, uint32_t* a, uint32_t cnt, int neg) {
+        CacheEntry* e = new CacheEntry();
+        e->key = (char*)std::malloc(key_len ? key_len : 1);
+        if (!e->key) { std::fprintf(stderr, "malloc cache key failed\n"); std::exit(1); }
+        std::memcpy(e->key, key, key_len);
+        e->key_len = key_len;
+        e->hash = fnv1a_64(key, (int)key_len);
+        e->a = a; e->n = cnt; e->neg = neg;
+        if (e->bytes() > cap_bytes) { cache_entry_release(e); return; }
+
+        std::lock_guard<std::mutex> lk(mu);
+        CacheEntry** slot = &buckets[e->hash & (nbuckets - 1)];
+        for (CacheEntry* x = *slot; x; x = x->hnext) {
+            if (x->hash == e->hash && x->key_len == key_len && std::memcmp(x->key, key, key_len) == 0) {
+                cache_entry_release(e);   // another thread got there first
+                return;
+            }
+        }
+        e->hnext = *slot;
+        *slot = e;
+        lru_push_front(e);
+        n++;
+        bytes += e->bytes();
+        while (bytes > cap_bytes && tail != e) evict(tail);
+        if (n > nbuckets) rehash();
+    }
+
+private:
+    void lru_unlink(CacheEntry* e) {
+        if (e->prev) e->prev->next = e->next; else head = e->next;
+        if (e->next) e->next->prev = e->prev; else tail = e->prev;
+        e->prev = e->next = nullptr;
+    }
+    void lru_push_front(CacheEntry* e) {
+        e->next = head;
+        if (head) head->prev = e; else tail = e;
+        head = e;
+    }
+    void evict(CacheEntry* e) {
+        CacheEntry** slot = &buckets[e->hash & (nbuckets - 1)];
+        while (*slot != e) slot = &(*slot)->hnext;
+        *slot = e->hnext;
+        lru_unlink(e);
+        n--;
+        bytes -= e->bytes();
+        cache_entry_release(e);
+    }
+    void rehash() {
+        uint32_t nb = nbuckets * 2;
+        CacheEntry** b = (CacheEntry**)std::calloc(nb, sizeof(CacheEntry*));
+        if (!b) return;   // keep the longer chains
+        for (CacheEntry* e = head; e; e = e->next) {
+            CacheEntry** slot = &b[e->hash & (nb - 1)];
+            e->hnext = *slot;
+            *slot = e;
+        }
+        std::free(buckets);
+        buckets = b;
+        nbuckets = nb;
+    }
+};
+
+// Owns every Cursor, kids array and plan node of one query, and the cache
+// entries it pinned.
+struct CursorPool {
+    Cursor** nodes = nullptr;
+    uint32_t n = 0, cap = 0;
+    void** blocks = nullptr;
+    uint32_t nb = 0, bcap = 0;
+    CacheEntry** pins = nullptr;
+    uint32_t npins = 0, pcap = 0;
+
+    Cursor* make(CursorKind kind) {
+        if (n == cap) {
+            uint32_t nc = cap ? cap*2 : 16;
+            Cursor** p = (Cursor**)std::realloc(nodes, (size_t)nc * sizeof(Cursor*));
+            if (!p) { std::fprintf(stderr, "realloc CursorPool failed\n"); std::exit(1); }
+            nodes = p; cap = nc;
+        }
+        Cursor* c = new Cursor();
+        c->kind = kind;
+        nodes[n++] = c;
+        return c;
+    }
+    void* alloc(size_t bytes) {
+        void* m = std::calloc(1, bytes ? bytes : 1);
+        if (!m) { std::fprintf(stderr, "calloc CursorPool block failed\n"); std::exit(1); }
+        return own(m);
+    }
+    // Takes a malloc'd block (nullptr is ignored); freed by free_all.
+    void* own(void* m) {
+        if (!m) return m;
+        if (nb == bcap) {
+            uint32_t nc = bcap ? bcap*2 : 16;
+            void** p = (void**)std::realloc(blocks, (size_t)nc * sizeof(void*));
+            if (!p) { std::fprintf(stderr, "realloc CursorPool failed\n"); std::exit(1); }
+            blocks = p; bcap = nc;
+        }
+        blocks[nb++] = m;
+        return m;
+    }
+    Cursor** make_kids(uint32_t k) { return (Cursor**)alloc((size_t)k * sizeof(Cursor*)); }
+    void pin(CacheEntry* e) {
+        if (npins == pcap) {
+            uint32_t nc = pcap ? pcap*2 : 8;
+            CacheEntry** p = (CacheEntry**)std::realloc(pins, (size_t)nc * sizeof(CacheEntry*));
+            if (!p) { std::fprintf(stderr, "realloc CursorPool failed\n"); std::exit(1); }
+            pins = p; pcap = nc;
+        }
+        pins[npins++] = e;
+    }
+    void free_all() {
+        for (uint32_t i=0;i<n;i++) { std::free(nodes[i]->posbuf); delete nodes[i]; }
+        for (uint32_t i=0;i<nb;i++) std::free(blocks[i]);
+        for (uint32_t i=0;i<npins;i++) cache_entry_release(pins[i]);
+        std::free(nodes); std::free(blocks); std::free(pins);
+        nodes = nullptr; blocks = nullptr; pins = nullptr; n = cap = nb = bcap = npins = pcap = 0;
+    }
+};
+
+// Points a fresh cursor at term lex_i's list (C_EMPTY if there is none).
+static void init_lex_cursor(const Index& idx, uint32_t lex_i, Cursor* c) {
+    const LexRec r = idx.rec(lex_i);
+    c->kind = C_EMPTY;
+    c->doc = DOC_END;
+    if (idx.postings_count(r) == 0) return;
+
+    if (r.flags & LEX_F_BITMAP) {
+        const uint64_t* w = idx.bitmap_ptr(r);
+        if (!w) return;
+        c->kind = C_BITMAP;
+        c->bits = w;
+        c->nwords = (uint32_t)idx.bitmap_words();
+        c->n = r.df; c->i = 0;
+        c->tfp = idx.raw_tf_ptr(r);
+        uint32_t k = 0;
+        while (k < c->nwords && !w[k]) k++;
+        if (k < c->nwords) c->doc = k * 64 + (uint32_t)__builtin_ctzll(w[k]);
+        return;
+    }
+
+    if (r.flags & LEX_F_ROARING) {
+        if (!idx.roaring_list(r, &c->rl) || c->rl.n == 0) return;
+        c->kind = C_ROARING;
+        c->n = r.df;
+        c->tfp = idx.raw_tf_ptr(r);
+        roar_load(c, 0);
+        return;
+    }
+
+    if (!(r.flags & LEX_F_VBYTE)) {
+        const uint32_t* p = idx.postings_ptr(r);
+        if (!p) return;
+        c->kind = C_RAW;
+        c->p = p; c->n = r.postings_len; c->i = 0;
+        c->tfp = idx.raw_tf_ptr(r);
+        c->doc = p[0];
+        return;
+    }
+
+    if (r.postings_off + (uint64_t)r.postings_len > (uint64_t)idx.postings_size) return;
+    uint32_t nblocks = (r.df + POSTINGS_BLOCK - 1) / POSTINGS_BLOCK;
+    size_t dir_bytes = (size_t)nblocks * sizeof(PostBlockDir);
+    if (dir_bytes > r.postings_len) return;
+    const uint8_t* base = (const uint8_t*)idx.postings_file + r.postings_off;
+    c->kind = C_VBYTE;
+    c->dir = (const PostBlockDir*)base;
+    c->data = base + dir_bytes;
+    c->data_end = base + r.postings_len;
+    c->df = r.df;
+    c->nblocks = nblocks;
+    c->has_tf = (r.flags & LEX_F_TF) != 0;
+    vbyte_load_block(c, 0);
+}
+
+static Cursor* open_lex_cursor(const Index& idx, CursorPool* pool, uint32_t lex_i) {
+    Cursor* c = pool->make(C_EMPTY);
+    init_lex_cursor(idx, lex_i, c);
+    return c;
+}
+
+// ---- --stats-only counting ----
+// Shapes whose size follows from df and one pairwise intersection are
+// counted without building a plan or any list:
+//   a = df(a)   !a = N - df(a)   x AND/OR y for x, y in {a, !a}
+// The intersection runs the counting kernels on raw lists, popcount on
+// bitmaps (bit probes for bitmap vs raw), roar_and_count on two roaring
+// lists, or two stack cursors otherwise.
+// Anything else returns 0 and is evaluated normally.
+
+struct CountOperand { int found; uint32_t lex_i; uint32_t df; int neg; };
+
+static int count_operand(const Index& idx, const RpnVec& rpn, uint32_t* pos, CountOperand* o) {
+    if (*pos >= rpn.n || rpn.a[*pos].type != T_TERM) return 0;
+    const RpnItem& it = rpn.a[*pos];
+    LexRec r;
+    o->found = idx.find_term(it.text, it.len, &o->lex_i, &r);
+    o->df = o->found ? idx.postings_count(r) : 0;
+    o->neg = (*pos + 1 < rpn.n && rpn.a[*pos + 1].type == T_NOT);
+    *pos += 1 + o->neg;
+    return 1;
+}
+
+static uint32_t count_intersection(const Index& idx, const CountOperand& x, const CountOperand& y) {
+    if (x.df == 0 || y.df == 0) return 0;
+    const LexRec rx = idx.rec(x.lex_i);
+    const LexRec ry = idx.rec(y.lex_i);
+    const uint32_t* px = idx.postings_ptr(rx);
+    const uint32_t* py = idx.postings_ptr(ry);
+    const uint64_t* bx = idx.bitmap_ptr(rx);
+    const uint64_t* by = idx.bitmap_ptr(ry);
+    if (px && py) return count_and_auto(px, x.df, py, y.df);
+    if (bx && by) return (uint32_t)bm_and_count(bx, by, idx.bitmap_words());
+    if (bx && py) return bm_count_ids(bx, py, y.df);
+    if (by && px) return bm_count_ids(by, px, x.df);
+    RoarList lx, ly;
+    if (idx.roaring_list(rx, &lx) && idx.roaring_list(ry, &ly)) return (uint32_t)roar_and_count(lx, ly);
+
+    Cursor a, b;
+    init_lex_cursor(idx, x.lex_i, &a);
+    init_lex_cursor(idx, y.lex_i, &b);
+    uint32_t k = 0;
+    while (a.doc != DOC_END && b.doc != DOC_END) {
+        if (a.doc == b.doc) { k++; cur_next(&a); cur_next(&b); }
+        else if (a.doc < b.doc) cur_advance(&a, b.doc);
+        else cur_advance(&b, a.doc);
+    }
+    return k;
+}
+
+static int count_query(const Index& idx, const RpnVec& rpn, uint32_t* out) {
+    uint32_t N = idx.doc_count();
+    uint32_t pos = 0;
+    CountOperand x, y;
+    if (!count_operand(idx, rpn, &pos, &x)) return 0;
+    if (pos == rpn.n) {
+        *out = x.neg ? N - x.df : x.df;
+        return 1;
+    }
+    if (!count_operand(idx, rpn, &pos, &y)) return 0;
+    if (pos + 1 != rpn.n) return 0;
+    TokType op = rpn.a[pos].type;
+    if (op != T_AND && op != T_OR) return 0;
+    if (x.neg && !y.neg) { CountOperand t = x; x = y; y = t; }
+
+    uint32_t i = count_intersection(idx, x, y);
+    uint32_t uni = x.df + y.df - i;
+    if (!y.neg)      *out = (op == T_AND) ? i : uni;                        // a & b, a | b
+    else if (!x.neg) *out = (op == T_AND) ? x.df - i : N - (y.df - i);      // a & !b, a | !b
+    else             *out = (op == T_AND) ? N - uni : N - i;                // !a & !b, !a | !b
+    return 1;
+}
+
+// ---- query planner ----
+// The RPN is turned into a logical tree whose nested AND/OR chains are
+// flattened into n-ary nodes. Every node gets a cardinality estimate from
+// LexRec::df (AND = min, OR = sum, NOT = doc_count - x), empty AND children
+// short-circuit the whole conjunction, and AND children are ordered by
+// ascending estimate so the rarest list drives the leapfrog.
+
+enum PlanKind { P_EMPTY, P_TERM, P_AND, P_OR, P_NOT, P_PHRASE, P_NEAR, P_WILD };
+
+// Also the operand limit of one NEAR chain.
+static const uint32_t PHRASE_MAX_WORDS = 64;
+
+struct PlanNode {
+    PlanKind kind;
+    uint32_t est;
+    uint32_t window;      // P_NEAR
+    const char* text;     // term (or phrase word) text, for --explain
+    uint16_t text_len;
+    uint32_t lex_i;
+    Expansion* exp;       // P_WILD, arrays owned by the pool
+    PlanNode** kids;
+    uint32_t nk;
+};
+
+static PlanNode* plan_make(CursorPool* pool, PlanKind kind, uint32_t nk) {
+    PlanNode* p = (PlanNode*)pool->alloc(sizeof(PlanNode));
+    p->kind = kind;
+    if (nk) p->kids = (PlanNode**)pool->alloc((size_t)nk * sizeof(PlanNode*));
+    return p;
+}
+
+static PlanNode* plan_combine(CursorPool* pool, PlanKind kind, PlanNode* a, PlanNode* b) {
+    uint32_t na = (a->kind == kind) ? a->nk : 1;
+    uint32_t nb = (b->kind == kind) ? b->nk : 1;
+    PlanNode* p = plan_make(pool, kind, na + nb);
+    if (a->kind == kind) for (uint32_t i=0;i<a->nk;i++) p->kids[p->nk++] = a->kids[i];
+    else p->kids[p->nk++] = a;
+    if (b->kind == kind) for (uint32_t i=0;i<b->nk;i++) p->kids[p->nk++] = b->kids[i];
+    else p->kids[p->nk++] = b;
+    return p;
+}
+
+// Phrase: one P_TERM kid per word in phrase order; empty if a word is
+// unknown. est = rarest word's df.
+static PlanNode* plan_phrase(const Index& idx, const RpnItem& it, CursorPool* pool) {
+    PlanNode* p = plan_make(pool, P_PHRASE, PHRASE_MAX_WORDS);
+    p->text = it.text;
+    p->text_len = it.len;
+    p->est = DOC_END;
+    uint16_t i = 0;
+    while (i < it.len && p->nk < PHRASE_MAX_WORDS) {
+        uint16_t b = i;
+        while (i < it.len && it.text[i] != ' ') i++;
+        uint32_t lex_i = 0;
+        LexRec r;
+        if (!idx.find_term(it.text + b, (uint16_t)(i - b), &lex_i, &r) || idx.postings_count(r) == 0) {
+            PlanNode* e = plan_make(pool, P_EMPTY, 0);
+            e->text = it.text; e->text_len = it.len;
+            return e;
+        }
+        PlanNode* w = plan_make(pool, P_TERM, 0);
+        w->lex_i = lex_i;
+        w->est = idx.postings_count(r);
+        w->text = it.text + b;
+        w->text_len = (uint16_t)(i - b);
+        p->kids[p->nk++] = w;
+        if (w->est < p->est) p->est = w->est;
+        i++;
+    }
+    return p;
+}
+
+// term* or another wildcard: the expansion is chosen here, the lists are
+// merged by plan_lower. est = the chosen postings (an upper bound on the
+// union).
+static PlanNode* plan_wildcard(const Index& idx, const RpnItem& it, CursorPool* pool) {
+    Expansion* e = (Expansion*)pool->alloc(sizeof(Expansion));
+    expand_item(idx, it, e);
+    pool->own(e->ords);
+    pool->own(e->recs);
+    PlanNode* p = plan_make(pool, e->total ? P_WILD : P_EMPTY, 0);
+    p->exp = e;
+    p->est = e->total < idx.doc_count() ? (uint32_t)e->total : idx.doc_count();
+    p->text = it.text;
+    p->text_len = it.len;
+    return p;
+}
+
+// a NEAR/k b over terms; chains with the same k (a /3 b /3 c) merge into one
+// n-ary node. Other operands are rejected up front by near_operands_ok.
+static PlanNode* plan_near(CursorPool* pool, uint32_t window, PlanNode* a, PlanNode* b) {
+    if (a->kind == P_EMPTY) return a;
+    if (b->kind == P_EMPTY) return b;
+    PlanNode* ops[2] = { a, b };
+    uint32_t nk = 0;
+    int ok = 1;
+    for (int i=0;i<2;i++) {
+        if (ops[i]->kind == P_TERM) nk++;
+        else if (ops[i]->kind == P_NEAR && ops[i]->window == window) nk += ops[i]->nk;
+        else ok = 0;
+    }
+    if (!ok || nk > PHRASE_MAX_WORDS) return plan_make(pool, P_EMPTY, 0);
+    PlanNode* p = plan_make(pool, P_NEAR, nk);
+    p->window = window;
+    p->est = DOC_END;
+    for (int i=0;i<2;i++) {
+        if (ops[i]->kind == P_TERM) p->kids[p->nk++] = ops[i];
+        else for (uint32_t j=0;j<ops[i]->nk;j++) p->kids[p->nk++] = ops[i]->kids[j];
+    }
+    for (uint32_t j=0;j<p->nk;j++) if (p->kids[j]->est < p->est) p->est = p->kids[j]->est;
+    return p;
+}
+
+// NEAR only knows the positions of single terms: every operand must be a
+// term or a NEAR chain with the same k, at most PHRASE_MAX_WORDS terms in
+// all. Phrases, groups, NOT, wildcards, mixed k and a missing operand make
+// the query invalid rather than a silent AND.
+static int near_operands_ok(const RpnVec& rpn) {
+    uint32_t i = 0;
+    while (i < rpn.n && rpn.a[i].type != T_NEAR) i++;
+    if (i == rpn.n) return 1;
+    // per stack entry: 0 = other value, 1 = term, 2+k = NEAR/k chain; term count
+    U32Vec kind, terms;
+    int ok = 1;
+    for (i=0;i<rpn.n && ok;i++) {
+        const RpnItem& it = rpn.a[i];
+        if (it.type == T_NEAR) {
+            uint32_t want = 2 + it.len, nt = 0;
+            if (kind.n < 2) ok = 0;
+            for (int j=0;j<2 && kind.n;j++) {
+                kind.n--; terms.n--;
+                uint32_t k = kind.a[kind.n];
+                if (k != 1 && k != want) ok = 0;
+                nt += terms.a[terms.n];
+            }
+            if (nt > PHRASE_MAX_WORDS) ok = 0;
+            kind.push(want); terms.push(nt);
+        } else if (it.type == T_NOT) {
+            if (kind.n) { kind.n--; terms.n--; }
+            kind.push(0); terms.push(0);
+        } else if (it.type == T_AND || it.type == T_OR) {
+            for (int j=0;j<2 && kind.n;j++) { kind.n--; terms.n--; }
+            kind.push(0); terms.push(0);
+        } else {
+            kind.push(it.type == T_TERM ? 1 : 0);
+            terms.push(it.type == T_TERM ? 1 : 0);
+        }
+    }
+    kind.free_mem();
+    terms.free_mem();
+    return ok;
+}
+
+static PlanNode* plan_from_rpn(const Index& idx, const RpnVec& rpn, CursorPool* pool) {
+    PlanNode** st = (PlanNode**)pool->alloc((size_t)(rpn.n ? rpn.n : 1) * sizeof(PlanNode*));
+    uint32_t sn = 0;
+
+    for (uint32_t i=0;i<rpn.n;i++) {
+        const RpnItem& it = rpn.a[i];
+        if (it.type == T_TERM) {
+            uint32_t lex_i = 0;
+            PlanNode* p;
+            LexRec r;
+            if (idx.find_term(it.text, it.len, &lex_i, &r) && idx.postings_count(r) > 0) {
+                p = plan_make(pool, P_TERM, 0);
+                p->lex_i = lex_i;
+                p->est = idx.postings_count(r);
+            } else {
+                p = plan_make(pool, P_EMPTY, 0);
+            }
+            p->text = it.text;
+            p->text_len = it.len;
+            st[sn++] = p;
+        } else if (it.type == T_PREFIX || it.type == T_WILD) {
+            st[sn++] = plan_wildcard(idx, it, pool);
+        } else if (it.type == T_PHRASE) {
+            st[sn++] = plan_phrase(idx, it, pool);
+        } else if (it.type == T_NOT) {
+            PlanNode* a = sn ? st[--sn] : plan_make(pool, P_EMPTY, 0);
+            if (a->kind == P_NOT) st[sn++] = a->kids[0];
+            else {
+                PlanNode* p = plan_make(pool, P_NOT, 1);
+                p->kids[p->nk++] = a;
+                st[sn++] = p;
+            }
+        } else if (it.type == T_AND || it.type == T_OR) {
+            PlanNode* b = sn ? st[--sn] : plan_make(pool, P_EMPTY, 0);
+            PlanNode* a = sn ? st[--sn] : plan_make(pool, P_EMPTY, 0);
+            st[sn++] = plan_combine(pool, it.type == T_AND ? P_AND : P_OR, a, b);
+        } else if (it.type == T_NEAR) {
+            PlanNode* b = sn ? st[--sn] : plan_make(pool, P_EMPTY, 0);
+            PlanNode* a = sn ? st[--sn] : plan_make(pool, P_EMPTY, 0);
+            st[sn++] = plan_near(pool, it.len, a, b);
+        }
+    }
+    return sn ? st[sn-1] : plan_make(pool, P_EMPTY, 0);
+}
+
+static int plan_is_all(const PlanNode* p) { return p->kind == P_NOT && p->kids[0]->kind == P_EMPTY; }
+
+static int plan_cmp_est(const void* pa, const void* pb) {
+    const PlanNode* a = *(const PlanNode* const*)pa;
+    const PlanNode* b = *(const PlanNode* const*)pb;
+    int na = (a->kind == P_NOT), nb = (b->kind == P_NOT);
+    if (na != nb) return na - nb;
+    if (a->est != b->est) return (a->est < b->est) ? -1 : 1;
+    return 0;
+}
+
+// Simplifies bottom-up and fills est; returns the replacement node.
+static PlanNode* plan_optimize(PlanNode* p, uint32_t doc_count, CursorPool* pool) {
+    if (p->kind == P_EMPTY) { p->est = 0; return p; }
+    if (p->kind == P_TERM || p->kind == P_PHRASE || p->kind == P_NEAR || p->kind == P_WILD) return p;
+
+    for (uint32_t i=0;i<p->nk;i++) p->kids[i] = plan_optimize(p->kids[i], doc_count, pool);
+
+    if (p->kind == P_NOT) {
+        PlanNode* k = p->kids[0];
+        if (k->kind == P_NOT) return k->kids[0];
+        p->est = doc_count > k->est ? doc_count - k->est : 0;
+        return p;
+    }
+
+    // Children may have collapsed into the same operator; flatten again.
+    uint32_t total = 0;
+    for (uint32_t i=0;i<p->nk;i++) total += (p->kids[i]->kind == p->kind) ? p->kids[i]->nk : 1;
+    if (total != p->nk) {
+        PlanNode** kids = (PlanNode**)pool->alloc((size_t)total * sizeof(PlanNode*));
+        uint32_t k = 0;
+        for (uint32_t i=0;i<p->nk;i++) {
+            PlanNode* c = p->kids[i];
+            if (c->kind == p->kind) for (uint32_t j=0;j<c->nk;j++) kids[k++] = c->kids[j];
+            else kids[k++] = c;
+        }
+        p->kids = kids;
+        p->nk = total;
+    }
+
+    PlanNode* all = nullptr;
+    uint32_t k = 0;
+    for (uint32_t i=0;i<p->nk;i++) {
+        PlanNode* c = p->kids[i];
+        if (p->kind == P_AND) {
+            if (c->kind == P_EMPTY) { p->kind = P_EMPTY; p->nk = 0; p->est = 0; return p; }
+            if (plan_is_all(c)) { all = c; continue; }
+        } else {
+            if (c->kind == P_EMPTY) continue;
+            if (plan_is_all(c)) return c;
+        }
+        p->kids[k++] = c;
+    }
+    p->nk = k;
+    if (k == 0) {
+        if (all) return all;
+        p->kind = P_EMPTY; p->est = 0;
+        return p;
+    }
+    if (k == 1) return p->kids[0];
+
+    if (p->kind == P_AND) {
+        std::qsort(p->kids, p->nk, sizeof(PlanNode*), plan_cmp_est);
+        uint32_t m = doc_count;
+        for (uint32_t i=0;i<p->nk;i++) if (p->kids[i]->kind != P_NOT && p->kids[i]->est < m) m = p->kids[i]->est;
+        p->est = m;
+    } else {
+        uint64_t sum = 0;
+        for (uint32_t i=0;i<p->nk;i++) sum += p->kids[i]->est;
+        p->est = (sum > doc_count) ? doc_count : (uint32_t)sum;
+    }
+    return p;
+}
+
+struct CurRef { Cursor* c; int neg; };
+
+// Canonical text of an optimized plan, the result cache key: AND/OR/NEAR
+// kids are sorted, so "b a", "(a b)" and "a && b" share one entry.
+//   term | pre*, *x* | "w1 w2" | !x | AND(x y) | OR(x y) | NEAR/k(x y) | #  (empty)
+struct KeyBuf {
+    char* a = nullptr;
+    uint32_t n = 0, cap = 0;
+    void free_mem() { std::free(a); a = nullptr; n = cap = 0; }
+    void put(const char* s, uint32_t len) {
+        if (n + len + 1 > cap) {
+            uint32_t nc = cap ? cap : 64;
+            while (nc < n + len + 1) nc *= 2;
+            char* nb = (char*)std::realloc(a, nc);
+            if (!nb) { std::fprintf(stderr, "realloc KeyBuf failed\n"); std::exit(1); }
+            a = nb; cap = nc;
+        }
+        std::memcpy(a + n, s, len);
+        n += len;
+        a[n] = '\0';
+    }
+    void puts(const char* s) { put(s, (uint32_t)std::strlen(s)); }
+};
+
+static int keybuf_cmp(const void* pa, const void* pb) {
+    return std::strcmp(((const KeyBuf*)pa)->a, ((const KeyBuf*)pb)->a);
+}
+
+static void plan_key(const PlanNode* p, KeyBuf* out) {
+    switch (p->kind) {
+    case P_EMPTY: out->puts("#"); return;
+    case P_TERM:
+    case P_WILD: out->put(p->text, p->text_len); return;
+    case P_PHRASE: out->puts("\""); out->put(p->text, p->text_len); out->puts("\""); return;
+    case P_NOT: out->puts("!"); plan_key(p->kids[0], out); return;
+    case P_AND: out->puts("AND("); break;
+    case P_OR: out->puts("OR("); break;
+    case P_NEAR: {
+        char b[24];
+        std::snprintf(b, sizeof(b), "NEAR/%u(", p->window);
+        out->puts(b);
+        break;
+    }
+    }
+    KeyBuf* kk = (KeyBuf*)std::calloc(p->nk, sizeof(KeyBuf));
+    if (!kk) { std::fprintf(stderr, "calloc plan_key failed\n"); std::exit(1); }
+    for (uint32_t i=0;i<p->nk;i++) plan_key(p->kids[i], &kk[i]);
+    std::qsort(kk, p->nk, sizeof(KeyBuf), keybuf_cmp);
+    for (uint32_t i=0;i<p->nk;i++) {
+        if (i) out->puts(" ");
+        out->put(kk[i].a, kk[i].n);
+        kk[i].free_mem();
+    }
+    std::free(kk);
+    out->puts(")");
+}
+
+// Cache state of one query. plan_lower looks up every composite node; a
+// missed inner node is materialized and stored on the spot, the root's key
+// is kept so the drained result can be stored.
+struct QueryCacheCtx {
+    QueryCache* cache = nullptr;
+    const PlanNode* root_plan = nullptr;
+    KeyBuf root_key;
+    int root_neg = 0;
+    uint32_t hits = 0, misses = 0;
+};
+
+static Cursor* cached_cursor(CursorPool* pool, CacheEntry* e) {
+    pool->pin(e);
+    if (e->n == 0) return pool->make(C_EMPTY);
+    Cursor* c = pool->make(C_RAW);
+    c->p = e->a; c->n = e->n; c->i = 0;
+    c->doc = e->a[0];
+    c->est = e->n;
+    c->label = e->key;
+    c->label_len = (uint16_t)(e->key_len > 0xFFFF ? 0xFFFF : e->key_len);
+    return c;
+}
+
+static Cursor* make_nary(CursorPool* pool, CursorKind kind, Cursor** kids, uint32_t nk, uint32_t est) {
+    if (nk == 1) return kids[0];
+    Cursor* c = pool->make(kind);
+    c->kids = pool->make_kids(nk);
+    std::memcpy(c->kids, kids, (size_t)nk * sizeof(Cursor*));
+    c->nk = nk;
+    c->est = est;
+    if (kind == C_AND) and_align(c);
+    else if (kind == C_OR) or_align(c);
+    else andnot_align(c);
+    return c;
+}
+
+static std::atomic<int> g_warned_no_positions{0};
+
+// Phrase or NEAR. Words are ordered by df for the leapfrog; offs keeps each
+// one's place in the phrase. Without positions.bin both degrade to a plain AND.
+static Cursor* lower_positional(const Index& idx, const PlanNode* p, CursorPool* pool) {
+    Cursor** kids = pool->make_kids(p->nk);
+    uint32_t* offs = (uint32_t*)pool->alloc((size_t)p->nk * sizeof(uint32_t));
+    int have_pos = 1;
+    for (uint32_t i=0;i<p->nk;i++) {
+        Cursor* c = open_lex_cursor(idx, pool, p->kids[i]->lex_i);
+        c->label = p->kids[i]->text;
+        c->label_len = p->kids[i]->text_len;
+        c->est = p->kids[i]->est;
+        const uint8_t* b = nullptr;
+        const uint8_t* e = nullptr;
+        uint32_t nblocks = (idx.rec(p->kids[i]->lex_i).df + POSTINGS_BLOCK - 1) / POSTINGS_BLOCK;
+        if (idx.positions_range(p->kids[i]->lex_i, &b, &e) && (size_t)(e - b) >= (size_t)nblocks * 4) {
+            c->pos_dir = b;
+            c->pos_data = b + (size_t)nblocks * 4;
+            c->pos_end = e;
+        } else have_pos = 0;
+        uint32_t j = i;
+        while (j > 0 && kids[j-1]->est > c->est) { kids[j] = kids[j-1]; offs[j] = offs[j-1]; j--; }
+        kids[j] = c;
+        offs[j] = i;
+    }
+    if (!have_pos) {
+        if (!g_warned_no_positions.exchange(1))
+            std::fprintf(stderr, "WARN: index has no positions (indexer --positions), phrases and NEAR match as AND\n");
+        return make_nary(pool, C_AND, kids, p->nk, p->est);
+    }
+    Cursor* c = pool->make(p->kind == P_NEAR ? C_NEAR : C_PHRASE);
+    c->kids = kids;
+    c->nk = p->nk;
+    c->offs = offs;
+    c->window = p->window;
+    c->est = p->est;
+    c->label = p->text;
+    c->label_len = p->text_len;
+    positional_align(c);
+    return c;
+}
+
+// Wildcard: the merged union as one list cursor (raw ids, or a bitmap
+// cursor without tf), so the rest of the tree sees a single operand.
+static Cursor* lower_wildcard(const Index& idx, const PlanNode* p, CursorPool* pool) {
+    uint32_t* a;
+    uint64_t* bits;
+    uint32_t cnt = expansion_union(idx, *p->exp, &a, &bits);
+    if (cnt == 0) return pool->make(C_EMPTY);
+    Cursor* c;
+    if (bits) {
+        c = pool->make(C_BITMAP);
+        c->bits = (const uint64_t*)pool->own(bits);
+        c->nwords = (uint32_t)idx.bitmap_words();
+        c->n = cnt; c->i = 0;
+        uint32_t k = 0;
+        while (!bits[k]) k++;
+        c->doc = k * 64 + (uint32_t)__builtin_ctzll(bits[k]);
+    } else {
+        c = pool->make(C_RAW);
+        c->p = (const uint32_t*)pool->own(a);
+        c->n = cnt; c->i = 0;
+        c->doc = a[0];
+    }
+    c->est = cnt;
+    c->label = p->text;
+    c->label_len = p->text_len;
+    return c;
+}
+
+static CurRef plan_lower_node(const Index& idx, const PlanNode* p, CursorPool* pool, QueryCacheCtx* qc);
+
+// Drains a missed sub-expression into a list, stores a copy in the cache
+// and returns a cursor over the list, so the same sub-expression inside
+// another query hits. The root is drained by the caller instead.
+static CurRef materialize_node(const Index& idx, const PlanNode* p, CursorPool* pool, QueryCacheCtx* qc,
+                               const KeyBuf& key) {
+    CurRef r = plan_lower_node(idx, p, pool, qc);
+    U32Vec v;
+    for (; r.c->doc != DOC_END; cur_next(r.c)) v.push(r.c->doc);
+    qc->cache->put(key.a, key.n, copy_list(v.a, v.n), v.n, r.neg);
+    if (v.n == 0) { v.free_mem(); return CurRef{ pool->make(C_EMPTY), r.neg }; }
+    Cursor* c = pool->make(C_RAW);
+    c->p = (const uint32_t*)pool->own(v.a);
+    c->n = v.n; c->i = 0;
+    c->doc = v.a[0];
+    c->est = v.n;
+    char* label = (char*)pool->alloc(key.n + 1);
+    std::memcpy(label, key.a, key.n);
+    c->label = label;
+    c->label_len = (uint16_t)(key.n > 0xFFFF ? 0xFFFF : key.n);
+    return CurRef{ c, r.neg };
+}
+
+// Lowers a plan into cursors. A node whose value is only cheap to express
+// negated comes back with neg=1 (same rewrites as eval_rpn):
+//   AND(P.., !N..) = AND(P) \ OR(N)     AND(!N..) = !OR(N)
+//   OR(P..)                             OR(P.., !N..) = !(AND(N) \ OR(P))
+static CurRef plan_lower(const Index& idx, const PlanNode* p, CursorPool* pool, QueryCacheCtx* qc) {
+    if (qc && (p->kind == P_AND || p->kind == P_OR || p->kind == P_PHRASE || p->kind == P_NEAR || p->kind == P_WILD)) {
+        KeyBuf key;
+        plan_key(p, &key);
+        CacheEntry* e = qc->cache->get(key.a, key.n);
+        if (e) {
+            qc->hits++;
+            key.free_mem();
+            return CurRef{ cached_cursor(pool, e), e->neg };
+        }
+        qc->misses++;
+        if (p == qc->root_plan) {
+            qc->root_key = key;
+        } else {
+            CurRef r = materialize_node(idx, p, pool, qc, key);
+            key.free_mem();
+            return r;
+        }
+    }
+    return plan_lower_node(idx, p, pool, qc);
+}
+
+static CurRef plan_lower_node(const Index& idx, const PlanNode* p, CursorPool* pool, QueryCacheCtx* qc) {
+    if (p->kind == P_EMPTY) return CurRef{ pool->make(C_EMPTY), 0 };
+    if (p->kind == P_TERM) {
+        Cursor* c = open_lex_cursor(idx, pool, p->lex_i);
+        c->label = p->text;
+        c->label_len = p->text_len;
+        c->est = p->est;
+        return CurRef{ c, 0 };
+    }
+    if (p->kind == P_WILD) return CurRef{ lower_wildcard(idx, p, pool), 0 };
+    if (p->kind == P_PHRASE || p->kind == P_NEAR) return CurRef{ lower_positional(idx, p, pool), 0 };
+    if (p->kind == P_NOT) {
+        CurRef r = plan_lower(idx, p->kids[0], pool, qc);
+        r.neg = !r.neg;
+        return r;
+    }
+
+    Cursor** pos = pool->make_kids(p->nk);
+    Cursor** neg = pool->make_kids(p->nk);
+    uint32_t np = 0, nn = 0;
+    uint64_t pos_sum = 0, neg_sum = 0;
+    for (uint32_t i=0;i<p->nk;i++) {
+        CurRef r = plan_lower(idx, p->kids[i], pool, qc);
+        if (r.neg) { neg[nn++] = r.c; neg_sum += r.c->est; }
+        else       { pos[np++] = r.c; pos_sum += r.c->est; }
+    }
+    // OR of the halves: a sum of dfs, no more than the whole corpus
+    uint32_t pos_est = pos_sum > idx.doc_count() ? idx.doc_count() : (uint32_t)pos_sum;
+    uint32_t neg_est = neg_sum > idx.doc_count() ? idx.doc_count() : (uint32_t)neg_sum;
+
+    if (p->kind == P_AND) {
+        if (np == 0) return CurRef{ make_nary(pool, C_OR, neg, nn, neg_est), 1 };
+        Cursor* base = make_nary(pool, C_AND, pos, np, p->est);
+        if (nn == 0) return CurRef{ base, 0 };
+        Cursor* two[2] = { base, make_nary(pool, C_OR, neg, nn, neg_est) };
+        return CurRef{ make_nary(pool, C_ANDNOT, two, 2, p->est), 0 };
+    }
+
+    if (nn == 0) return CurRef{ make_nary(pool, C_OR, pos, np, p->est), 0 };
+    uint32_t m = DOC_END;
+    for (uint32_t i=0;i<nn;i++) if (neg[i]->est < m) m = neg[i]->est;
+    Cursor* inner = make_nary(pool, C_AND, neg, nn, m);
+    if (np == 0) return CurRef{ inner, 1 };
+    Cursor* two[2] = { inner, make_nary(pool, C_OR, pos, np, pos_est) };
+    return CurRef{ make_nary(pool, C_ANDNOT, two, 2, m), 1 };
+}
+
+// qc may be nullptr (no result cache).
+static Cursor* build_cursor_tree(const Index& idx, const RpnVec& rpn, CursorPool* pool, const PlanNode** out_plan,
+                                 QueryCacheCtx* qc) {
+    PlanNode* plan = plan_optimize(plan_from_rpn(idx, rpn, pool), idx.doc_count(), pool);
+    if (out_plan) *out_plan = plan;
+    if (qc) qc->root_plan = plan;
+    CurRef root = plan_lower(idx, plan, pool, qc);
+    if (qc) qc->root_neg = root.neg;
+    if (!root.neg) return root.c;
+
+    Cursor* c = pool->make(C_NOT);
+    c->kids = pool->make_kids(1);
+    c->kids[0] = root.c; c->nk = 1;
+    c->doc_count = idx.doc_count();
+    c->est = idx.doc_count() > root.c->est ? idx.doc_count() - root.c->est : 0;
+    not_align(c, 0);
+    return c;
+}
+
+// Materialized matches of rpn[from..to] (a phrase or a NEAR subexpression)
+// for the rpn engine: positional operators need the terms, not their lists.
+static uint32_t* positional_docs(const Index& idx, const RpnVec& rpn, uint32_t from, uint32_t to, uint32_t* out_n) {
+    RpnVec sub;
+    for (uint32_t i=from;i<=to;i++) sub.push(rpn.a[i]);
+    CursorPool pool;
+    Cursor* c = build_cursor_tree(idx, sub, &pool, nullptr, nullptr);
+    U32Vec v;
+    for (; c->doc != DOC_END; cur_next(c)) v.push(c->doc);
+    pool.free_all();
+    sub.free_mem();
+    *out_n = v.n;
+    if (v.n == 0) { v.free_mem(); return nullptr; }
+    return v.a;
+}
+
+static void explain_cursor(FILE* out, const Cursor* c) {
+    switch (c->kind) {
+    case C_EMPTY: std::fprintf(out, "EMPTY"); return;
+    case C_RAW:
+    case C_VBYTE:
+    case C_BITMAP:
+    case C_ROARING: std::fprintf(out, "%.*s[df=%u]", (int)c->label_len, c->label, c->est); return;
+    case C_AND:    std::fprintf(out, "AND"); break;
+    case C_OR:     std::fprintf(out, "OR"); break;
+    case C_ANDNOT: std::fprintf(out, "ANDNOT"); break;
+    case C_NOT:    std::fprintf(out, "NOT"); break;
+    case C_PHRASE: std::fprintf(out, "PHRASE"); break;
+    case C_NEAR:   std::fprintf(out, "NEAR/%u", c->window); break;
+    }
+    std::fprintf(out, "{est=%u}(", c->est);
+    for (uint32_t i=0;i<c->nk;i++) {
+        if (i) std::fprintf(out, " ");
+        explain_cursor(out, c->kids[i]);
+    }
+    std::fprintf(out, ")");
+}
+
+// ---- --rank bm25 ----
+// Matching stays with the boolean cursor tree; each hit is then scored from
+// separate cursors over the query's positive terms (those under an even
+// number of NOTs), and the best offset+limit hits are kept in a bounded
+// min-heap, so ranking costs O(hits * terms + hits * log k).
+
+struct Bm25Params {
+    double k1 = 1.2;
+    double b = 0.75;
+};
+
+struct ScoreTerm {
+    Cursor* c;
+    uint32_t lex_i;
+    double idf;
+    double ub;              // idf * LexRec::max_tf_score (0 without LEX_F_BLOCKMAX)
+    const uint8_t* bmax;    // per-block tf-part bounds, see Index::block_max_ptr
+    uint32_t nblocks;
+    uint32_t sb;            // last block probed by shallow_bound
+};
+
+// Upper bound on the terms collect_score_terms can return.
+static uint32_t plan_leaf_count(const PlanNode* p) {
+    if (p->kind == P_TERM) return 1;
+    uint32_t n = 0;
+    for (uint32_t i=0;i<p->nk;i++) n += plan_leaf_count(p->kids[i]);
+    return n;
+}
+
+static void collect_score_terms(const Index& idx, const PlanNode* p, int neg, CursorPool* pool,
+                                ScoreTerm* out, uint32_t* n) {
+    if (p->kind == P_NOT) { collect_score_terms(idx, p->kids[0], !neg, pool, out, n); return; }
+    if (p->kind == P_AND || p->kind == P_OR || p->kind == P_PHRASE || p->kind == P_NEAR) {
+        for (uint32_t i=0;i<p->nk;i++) collect_score_terms(idx, p->kids[i], neg, pool, out, n);
+        return;
+    }
+    if (p->kind != P_TERM || neg) return;
+    for (uint32_t i=0;i<*n;i++) if (out[i].lex_i == p->lex_i) return;
+    const LexRec r = idx.rec(p->lex_i);
+    double N = (double)idx.doc_count();
+    double df = (double)p->est;
+    ScoreTerm& t = out[(*n)++];
+    t.c = open_lex_cursor(idx, pool, p->lex_i);
+    t.c->label = p->text;
+    t.c->label_len = p->text_len;
+    t.lex_i = p->lex_i;
+    t.idf = std::log(1.0 + (N - df + 0.5) / (df + 0.5));
+    t.bmax = idx.block_max_ptr(r);
+    t.ub = t.bmax ? t.idf * (double)r.max_tf_score : 0.0;
+    t.nblocks = (r.df + POSTINGS_BLOCK - 1) / POSTINGS_BLOCK;
+    t.sb = 0;
+    if ((t.c->kind == C_BITMAP || t.c->kind == C_ROARING) && t.bmax) {
+        // block boundaries for shallow_bound
+        uint32_t* last = (uint32_t*)pool->alloc((size_t)t.nblocks * sizeof(uint32_t));
+        if (t.c->kind == C_ROARING) {
+            roar_block_lasts(t.c->rl, r.df, last);
+        } else {
+            bm_block_lasts(t.c->bits, t.c->nwords, 0, 0, last);
+            uint32_t k = t.c->nwords;
+            while (!t.c->bits[k - 1]) k--;
+            last[t.nblocks - 1] = (k - 1) * 64 + 63 - (uint32_t)__builtin_clzll(t.c->bits[k - 1]);
+        }
+        t.c->blast = last;
+    }
+}
+
+static inline uint32_t cur_tf(const Cursor* c) {
+    if (c->kind == C_RAW) return c->tfp ? c->tfp[c->i] : 1;
+    if (c->kind == C_VBYTE) return c->has_tf ? c->tfbuf[c->bi] : 1;
+    if (c->kind == C_BITMAP || c->kind == C_ROARING) return c->tfp ? c->tfp[c->i] : 1;
+    return 0;
+}
+
+static inline double bm25_norm(const Index& idx, const Bm25Params& bp, uint32_t doc) {
+    if (idx.doc_lens && idx.avg_doc_len > 0.0 && doc < idx.doc_count())
+        return bp.k1 * (1.0 - bp.b + bp.b * (double)idx.doc_lens[doc] / idx.avg_doc_len);
+    return bp.k1;
+}
+
+// Contribution of t, whose cursor must sit on the scored doc.
+static inline double term_score(const Bm25Params& bp, const ScoreTerm& t, double norm) {
+    double tf = (double)cur_tf(t.c);
+    return t.idf * tf * (bp.k1 + 1.0) / (tf + norm);
+}
+
+// Hits arrive in doc-id order, so every score cursor only moves forward.
+static double bm25_score(const Index& idx, const Bm25Params& bp, ScoreTerm* t, uint32_t n, uint32_t doc) {
+    double norm = bm25_norm(idx, bp, doc);
+    double s = 0.0;
+    for (uint32_t i=0;i<n;i++) {
+        cur_advance(t[i].c, doc);
+        if (t[i].c->doc == doc) s += term_score(bp, t[i], norm);
+    }
+    return s;
+}
+
+struct ScoredDoc {
+    uint32_t doc;
+    double score;
+};
+
+// a ranks below b: lower score, ties broken by larger doc id
+static inline int scored_worse(const ScoredDoc& a, const ScoredDoc& b) {
+    return a.score < b.score || (a.score == b.score && a.doc > b.doc);
+}
+
+static int scored_cmp_desc(const void* pa, const void* pb) {
+    const ScoredDoc* a = (const ScoredDoc*)pa;
+    const ScoredDoc* b = (const ScoredDoc*)pb;
+    if (scored_worse(*a, *b)) return 1;
+    if (scored_worse(*b, *a)) return -1;
+    return 0;
+}
+
+// Min-heap of the best k hits; the root is the current k-th best.
+struct TopK {
+    ScoredDoc* a = nullptr;
+    uint32_t n = 0, cap = 0, k = 0;
+
+    void reset(uint32_t want) { n = 0; k = want; }
+
+    void push(uint32_t doc, double score) {
+        if (k == 0) return;
+        ScoredDoc x{doc, score};
+        if (n < k) {
+            if (n == cap) {
+                uint32_t nc = cap ? cap*2 : 64;
+                if (nc > k) nc = k;
+                ScoredDoc* p = (ScoredDoc*)std::realloc(a, (size_t)nc * sizeof(ScoredDoc));
+                if (!p) { std::fprintf(stderr, "realloc TopK failed\n"); std::exit(1); }
+                a = p; cap = nc;
+            }
+            uint32_t i = n++;
+            while (i > 0) {
+                uint32_t par = (i - 1) / 2;
+                if (!scored_worse(x, a[par])) break;
+                a[i] = a[par];
+                i = par;
+            }
+            a[i] = x;
+            return;
+        }
+        if (!scored_worse(a[0], x)) return;
+        uint32_t i = 0;
+        while (1) {
+            uint32_t l = 2*i + 1, m = i;
+            const ScoredDoc* cur = &x;
+            if (l < n && scored_worse(a[l], *cur)) { m = l; cur = &a[l]; }
+            if (l + 1 < n && scored_worse(a[l+1], *cur)) m = l + 1;
+            if (m == i) break;
+            a[i] = a[m];
+            i = m;
+        }
+        a[i] = x;
+    }
+
+    // Best first.
+    void sort_desc() { if (n) std::qsort(a, n, sizeof(ScoredDoc), scored_cmp_desc); }
+
+    void free_mem() { std::free(a); a = nullptr; n = cap = k = 0; }
+};
+
+// ---- top-k disjunctions: MaxScore, WAND, Block-Max WAND ----
+// For a pure OR of terms under --rank bm25 the boolean tree is bypassed and
+// the term cursors are driven directly. Upper bounds come from the indexer
+// (LexRec::max_tf_score, per-block bounds after each list); a doc is skipped
+// once its bound cannot beat the heap root. Docs are visited in id order and
+// ties go to the smaller id, so `bound <= threshold` is a safe cut and every
+// algorithm returns exactly the exhaustive top-k.
+
+enum TopKAlgo { TK_EXHAUSTIVE, TK_MAXSCORE, TK_WAND, TK_BMW };
+
+static const char* topk_algo_name(int a) {
+    switch (a) {
+    case TK_MAXSCORE: return "maxscore";
+    case TK_WAND: return "wand";
+    case TK_BMW: return "bmw";
+    default: return "exhaustive";
+    }
+}
+
+struct TopKStats {
+    uint64_t scored = 0;        // docs fully scored
+    uint64_t block_skips = 0;   // BMW pivots rejected by block bounds
+};
+
+static inline double topk_threshold(const TopK* top) {
+    return (top->n == top->k) ? top->a[0].score : -1.0;
+}
+
+static inline float load_f32(const uint8_t* p) {
+    float f;
+    std::memcpy(&f, p, sizeof(f));
+    return f;
+}
+
+static inline uint32_t cur_block(const Cursor* c) {
+    return (c->kind == C_RAW || c->kind == C_BITMAP || c->kind == C_ROARING) ? c->i / POSTINGS_BLOCK : c->blk;
+}
+
+static inline uint32_t cur_block_last(const Cursor* c, uint32_t b) {
+    if (c->kind == C_BITMAP || c->kind == C_ROARING) return c->blast[b];
+    if (c->kind == C_RAW) {
+        uint32_t e = (b + 1) * POSTINGS_BLOCK;
+        return c->p[(e < c->n ? e : c->n) - 1];
+    }
+    return c->dir[b].last_doc;
+}
+
+// Bound of t over docs >= target, from the block holding target; the cursor
+// does not move. *block_last gets that block's last doc id.
+static double shallow_bound(ScoreTerm* t, uint32_t target, uint32_t* block_last) {
+    uint32_t b = cur_block(t->c);
+    if (t->sb > b && cur_block_last(t->c, t->sb - 1) < target) b = t->sb;
+    while (b < t->nblocks && cur_block_last(t->c, b) < target) b++;
+    t->sb = b;
+    if (b >= t->nblocks) { *block_last = DOC_END; return 0.0; }
+    *block_last = cur_block_last(t->c, b);
+    return t->idf * (double)load_f32(t->bmax + (size_t)b * 4);
+}
+
+static void topk_exhaustive(const Index& idx, const Bm25Params& bp, ScoreTerm* t, uint32_t n,
+                            TopK* top, TopKStats* st) {
+    while (1) {
+        uint32_t d = DOC_END;
+        for (uint32_t i=0;i<n;i++) if (t[i].c->doc < d) d = t[i].c->doc;
+        if (d == DOC_END) break;
+        double norm = bm25_norm(idx, bp, d);
+        double s = 0.0;
+        for (uint32_t i=0;i<n;i++) {
+            if (t[i].c->doc != d) continue;
+            s += term_score(bp, t[i], norm);
+            cur_next(t[i].c);
+        }
+        top->push(d, s);
+        st->scored++;
+    }
+}
+
+// Contributions are added up in term order, whatever order an algorithm
+// visits the terms in, so every algorithm produces bit-identical scores.
+static inline double sum_parts(double* part, uint32_t n) {
+    double s = 0.0;
+    for (uint32_t i=0;i<n;i++) { s += part[i]; part[i] = 0.0; }
+    return s;
+}
+
+static int score_term_cmp_ub(const void* pa, const void* pb) {
+    const ScoreTerm* a = *(const ScoreTerm* const*)pa;
+    const ScoreTerm* b = *(const ScoreTerm* const*)pb;
+    if (a->ub != b->ub) return (a->ub < b->ub) ? -1 : 1;
+    return 0;
+}
+
+// Terms sorted by bound; the prefix whose summed bounds cannot beat the
+// threshold is "non-essential": it only scores docs found by the others.
+static void topk_maxscore(const Index& idx, const Bm25Params& bp, ScoreTerm* t, uint32_t n,
+                          TopK* top, TopKStats* st, CursorPool* pool) {
+    ScoreTerm** ord = (ScoreTerm**)pool->alloc((size_t)n * sizeof(ScoreTerm*));
+    double* cum = (double*)pool->alloc((size_t)n * sizeof(double));
+    double* part = (double*)pool->alloc((size_t)n * sizeof(double));
+    for (uint32_t i=0;i<n;i++) ord[i] = &t[i];
+    std::qsort(ord, n, sizeof(ScoreTerm*), score_term_cmp_ub);
+    double acc = 0.0;
+    for (uint32_t i=0;i<n;i++) { acc += ord[i]->ub; cum[i] = acc; }
+
+    uint32_t first_ess = 0;
+    while (1) {
+        double theta = topk_threshold(top);
+        while (first_ess < n && cum[first_ess] <= theta) first_ess++;
+        if (first_ess == n) break;
+
+        uint32_t d = DOC_END;
+        for (uint32_t i=first_ess;i<n;i++) if (ord[i]->c->doc < d) d = ord[i]->c->doc;
+        if (d == DOC_END) break;
+
+        double norm = bm25_norm(idx, bp, d);
+        double s = 0.0;
+        for (uint32_t i=first_ess;i<n;i++) {
+            if (ord[i]->c->doc != d) continue;
+            double v = term_score(bp, *ord[i], norm);
+            part[ord[i] - t] = v;
+            s += v;
+            cur_next(ord[i]->c);
+        }
+        uint32_t j = first_ess;
+        for (; j>0; j--) {
+            if (s + cum[j-1] <= theta) break;
+            cur_advance(ord[j-1]->c, d);
+            if (ord[j-1]->c->doc != d) continue;
+            double v = term_score(bp, *ord[j-1], norm);
+            part[ord[j-1] - t] = v;
+            s += v;
+        }
+        s = sum_parts(part, n);
+        if (j == 0) {
+            top->push(d, s);
+            st->scored++;
+        }
+    }
+}
+
+static void sort_by_doc(ScoreTerm** ord, uint32_t n) {
+    for (uint32_t i=1;i<n;i++) {
+        ScoreTerm* x = ord[i];
+        uint32_t j = i;
+        while (j > 0 && ord[j-1]->c->doc > x->c->doc) { ord[j] = ord[j-1]; j--; }
+        ord[j] = x;
+    }
+}
+
+// WAND: with terms ordered by current doc, the pivot is the first term at
+// which the summed bounds exceed the threshold; no doc before the pivot doc
+// can qualify. BMW additionally checks the block bounds at the pivot doc and
+// jumps past the shortest current block when they fall short.
+static void topk_wand(const Index& idx, const Bm25Params& bp, ScoreTerm* t, uint32_t n,
+                      TopK* top, TopKStats* st, CursorPool* pool, int block_max) {
+    ScoreTerm** ord = (ScoreTerm**)pool->alloc((size_t)n * sizeof(ScoreTerm*));
+    double* part = (double*)pool->alloc((size_t)n * sizeof(double));
+    for (uint32_t i=0;i<n;i++) ord[i] = &t[i];
+
+    while (1) {
+        sort_by_doc(ord, n);
+        if (ord[0]->c->doc == DOC_END) break;
+
+        double theta = topk_threshold(top);
+        double acc = 0.0;
+        uint32_t p = n;
+        for (uint32_t i=0;i<n;i++) {
+            if (ord[i]->c->doc == DOC_END) break;
+            acc += ord[i]->ub;
+            if (acc > theta) { p = i; break; }
+        }
+        if (p == n) break;
+        uint32_t pd = ord[p]->c->doc;
+        while (p + 1 < n && ord[p+1]->c->doc == pd) p++;
+
+        if (block_max) {
+            double bsum = 0.0;
+            uint32_t next = DOC_END;
+            for (uint32_t i=0;i<=p;i++) {
+                uint32_t last = DOC_END;
+                bsum += shallow_bound(ord[i], pd, &last);
+                if (last != DOC_END && last + 1 < next) next = last + 1;
+            }
+            if (bsum <= theta) {
+                if (p + 1 < n && ord[p+1]->c->doc < next) next = ord[p+1]->c->doc;
+                if (next <= pd) next = pd + 1;
+                uint32_t j = 0;
+                for (uint32_t i=1;i<=p;i++) if (ord[i]->ub > ord[j]->ub) j = i;
+                cur_advance(ord[j]->c, next);
+                st->block_skips++;
+                continue;
             }
         }
-        else if(it.type==T_NOT){
-            Res a = st.pop_safe();
-            op_not(idx.doc_count(), a.a, a.n, &tmp);
-            std::free(a.a);
-            st.push(copy_list(tmp.a,tmp.n), tmp.n);
+
+        if (ord[0]->c->doc == pd) {
+            double norm = bm25_norm(idx, bp, pd);
+            for (uint32_t i=0;i<=p;i++) {
+                part[ord[i] - t] = term_score(bp, *ord[i], norm);
+                cur_next(ord[i]->c);
+            }
+            top->push(pd, sum_parts(part, n));
+            st->scored++;
+        } else {
+            uint32_t j = 0;
+            for (uint32_t i=1;i<p && ord[i]->c->doc < pd;i++) if (ord[i]->ub > ord[j]->ub) j = i;
+            cur_advance(ord[j]->c, pd);
         }
-        else if(it.type==T_AND || it.type==T_OR){
-            Res b = st.pop_safe();
-            Res a = st.pop_safe();
+    }
+}
 
-            if(it.type==T_AND){
-                if (a.n==0 || b.n==0) {
-                    std::free(a.a); std::free(b.a);
-                    st.push(nullptr,0);
-                } else {
-                    op_and(a.a,a.n,b.a,b.n,&tmp);
-                    std::free(a.a); std::free(b.a);
-                    st.push(copy_list(tmp.a,tmp.n), tmp.n);
-                }
-            } else {
-                if (a.n==0 && b.n==0) {
-                    std::free(a.a); std::free(b.a);
-                    st.push(nullptr,0);
-                } else if (a.n==0) {
-                    st.push(b.a, b.n);
-                    std::free(a.a);
-                } else if (b.n==0) {
-                    st.push(a.a, a.n);
-                    std::free(b.a);
-                } else {
-                    op_or(a.a,a.n,b.a,b.n,&tmp);
-                    std::free(a.a); std::free(b.a);
-                    st.push(copy_list(tmp.a,tmp.n), tmp.n);
+static void run_topk(int algo, const Index& idx, const Bm25Params& bp, ScoreTerm* t, uint32_t n,
+                     TopK* top, TopKStats* st, CursorPool* pool) {
+    switch (algo) {
+    case TK_MAXSCORE: topk_maxscore(idx, bp, t, n, top, st, pool); break;
+    case TK_WAND: topk_wand(idx, bp, t, n, top, st, pool, 0); break;
+    case TK_BMW: topk_wand(idx, bp, t, n, top, st, pool, 1); break;
+    default: topk_exhaustive(idx, bp, t, n, top, st); break;
+    }
+    top->sort_desc();
+}
+
+// Pure disjunction of terms (a single term included): the only shape the
+// pruning algorithms handle.
+static int plan_is_term_or(const PlanNode* p) {
+    if (p->kind == P_TERM) return 1;
+    if (p->kind != P_OR) return 0;
+    for (uint32_t i=0;i<p->nk;i++) if (p->kids[i]->kind != P_TERM) return 0;
+    return 1;
+}
+
+// Bounds exist for every term and were computed with the query's k1/b.
+static int topk_bounds_usable(const Index& idx, const Bm25Params& bp, const ScoreTerm* t, uint32_t n) {
+    const PostHeader* ph = idx.post_header();
+    if (ph->bm25_k1 != (float)bp.k1 || ph->bm25_b != (float)bp.b) return 0;
+    for (uint32_t i=0;i<n;i++) if (!t[i].bmax) return 0;
+    return 1;
+}
+
+static void print_doc(FILE* out, const Index& idx, uint32_t id) {
+    uint32_t tl=0, ul=0;
+    const char* title=idx.doc_title(id,&tl);
+    const char* url=idx.doc_url(id,&ul);
+    std::fprintf(out, "%u\t%.*s\t%.*s\n", id, (int)tl, title, (int)ul, url);
+}
+
+// --bench-topk: every algorithm on each pure-OR query from stdin; results
+// are checked against the exhaustive top-k.
+static int run_bench_topk(const Index& idx, const Bm25Params& bp, uint32_t k, uint32_t reps) {
+    const int algos[4] = { TK_EXHAUSTIVE, TK_MAXSCORE, TK_WAND, TK_BMW };
+    double time_sum[4] = {0, 0, 0, 0};
+    TopKStats stats[4];
+    uint32_t mismatches[4] = {0, 0, 0, 0};
+    uint32_t nq = 0, skipped = 0;
+    TopK ref, top;
+    char line[8192];
+
+    while (std::fgets(line, sizeof(line), stdin)) {
+        size_t len = std::strlen(line);
+        while (len > 0 && (line[len-1]=='\n' || line[len-1]=='\r')) line[--len] = '\0';
+        if (len == 0) continue;
+
+        RpnVec rpn;
+        to_rpn(line, &rpn);
+        CursorPool pool;
+        const PlanNode* plan = plan_optimize(plan_from_rpn(idx, rpn, &pool), idx.doc_count(), &pool);
+        uint32_t max_terms = plan_leaf_count(plan);
+        ScoreTerm* probe = (ScoreTerm*)pool.alloc((size_t)max_terms * sizeof(ScoreTerm));
+        uint32_t nt = 0;
+        if (plan_is_term_or(plan)) collect_score_terms(idx, plan, 0, &pool, probe, &nt);
+        if (nt == 0 || !topk_bounds_usable(idx, bp, probe, nt)) {
+            skipped++;
+            pool.free_all();
+            rpn.free_mem();
+            continue;
+        }
+        nq++;
+
+        for (int a=0;a<4;a++) {
+            TopK* out = (a == 0) ? &ref : &top;
+            for (uint32_t r=0;r<reps;r++) {
+                CursorPool qp;
+                ScoreTerm* t = (ScoreTerm*)qp.alloc((size_t)max_terms * sizeof(ScoreTerm));
+                uint32_t n = 0;
+                double t0 = now_sec_monotonic();
+                collect_score_terms(idx, plan, 0, &qp, t, &n);
+                out->reset(k);
+                TopKStats st;
+                run_topk(algos[a], idx, bp, t, n, out, &st, &qp);
+                time_sum[a] += now_sec_monotonic() - t0;
+                if (r == 0) {
+                    stats[a].scored += st.scored;
+                    stats[a].block_skips += st.block_skips;
                 }
+                qp.free_all();
             }
+            if (a == 0) continue;
+            int same = (top.n == ref.n);
+            for (uint32_t i=0; same && i<top.n; i++)
+                same = (top.a[i].doc == ref.a[i].doc && top.a[i].score == ref.a[i].score);
+            if (!same) mismatches[a]++;
         }
+        pool.free_all();
+        rpn.free_mem();
     }
-    Res res = st.pop_safe();
-    while(!st.empty()){
-        Res x = st.pop_safe();
-        std::free(x.a);
+
+    std::printf("[BENCH-TOPK] queries=%u skipped=%u k=%u reps=%u\n", nq, skipped, k, reps);
+    for (int a=0;a<4;a++) {
+        double ms = nq ? time_sum[a] * 1000.0 / ((double)nq * reps) : 0.0;
+        std::printf("[BENCH-TOPK] algo=%-10s avg=%.4f ms/query scored=%llu block_skips=%llu mismatches=%u speedup=%.2fx\n",
+            topk_algo_name(algos[a]), ms,
+            (unsigned long long)stats[a].scored, (unsigned long long)stats[a].block_skips,
+            mismatches[a], time_sum[a] > 0 ? time_sum[0] / time_sum[a] : 0.0);
     }
-    std::free(st.a);
-    tmp.free_mem();
+    ref.free_mem();
+    top.free_mem();
+    return 0;
+}
 
-    *out_res = res;
+// Times find_term on the terms read from stdin (one per line, looked up as
+// given: no case folding or stemming), sorted lexicon vs lexicon.mph.
+static int run_bench_lookup(const Index& idx, uint32_t reps) {
+    char* pool = nullptr;
+    uint32_t* offs = nullptr;
+    size_t used = 0, pool_cap = 0;
+    uint32_t nt = 0, offs_cap = 0;
+    char line[8192];
+    while (std::fgets(line, sizeof(line), stdin)) {
+        size_t len = std::strlen(line);
+        while (len > 0 && (line[len-1]=='\n' || line[len-1]=='\r')) line[--len] = '\0';
+        if (len == 0 || len > 0xFFFF) continue;
+        if (used + len > pool_cap) {
+            size_t nc = pool_cap ? pool_cap : 4096;
+            while (nc < used + len) nc *= 2;
+            char* nb = (char*)std::realloc(pool, nc);
+            if (!nb) { std::fprintf(stderr, "realloc bench terms failed\n"); std::exit(1); }
+            pool = nb; pool_cap = nc;
+        }
+        if (nt + 2 > offs_cap) {
+            uint32_t nc = offs_cap ? offs_cap * 2 : 1024;
+            uint32_t* nb = (uint32_t*)std::realloc(offs, (size_t)nc * sizeof(uint32_t));
+            if (!nb) { std::fprintf(stderr, "realloc bench terms failed\n"); std::exit(1); }
+            offs = nb; offs_cap = nc;
+        }
+        offs[nt++] = (uint32_t)used;
+        std::memcpy(pool + used, line, len);
+        used += len;
+    }
+    if (nt == 0) { std::fprintf(stderr, "--bench-lookup: no terms on stdin\n"); std::free(pool); std::free(offs); return 2; }
+    offs[nt] = (uint32_t)used;
+
+    // ordinal + 1 per term (0 = absent), from the sorted lexicon
+    uint32_t* ref = (uint32_t*)std::malloc((size_t)nt * sizeof(uint32_t));
+    if (!ref) { std::fprintf(stderr, "malloc bench terms failed\n"); std::exit(1); }
+    uint32_t found = 0;
+    for (uint32_t i=0; i<nt; i++) {
+        uint32_t li;
+        ref[i] = idx.find_term_sorted(pool + offs[i], (uint16_t)(offs[i+1] - offs[i]), &li) ? li + 1 : 0;
+        if (ref[i]) found++;
+    }
+
+    std::printf("[BENCH-LOOKUP] terms=%u found=%u reps=%u lexicon=v%u term_count=%u\n",
+                nt, found, reps, idx.lex_version, idx.term_count());
+    // sorted lexicon (not in v3), lexicon.fst, lexicon.mph
+    const char* names[3] = { "sorted", "fst", "mph" };
+    double t_first = 0.0;
+    for (int m=0; m<3; m++) {
+        if (m == 0 && idx.lex_version == 3) continue;
+        if (m == 1 && !idx.fst_nodes) {
+            std::printf("[BENCH-LOOKUP] method=fst    (no lexicon.fst, indexer --fst)\n");
+            continue;
+        }
+        if (m == 2 && !idx.mph_words) {
+            std::printf("[BENCH-LOOKUP] method=mph    (no lexicon.mph, indexer --mph)\n");
+            continue;
+        }
+        uint64_t sink = 0;
+        uint32_t mismatches = 0;
+        double t0 = now_sec_monotonic();
+        for (uint32_t r=0; r<reps; r++) {
+            for (uint32_t i=0; i<nt; i++) {
+                const char* t = pool + offs[i];
+                uint16_t tlen = (uint16_t)(offs[i+1] - offs[i]);
+                uint32_t li = 0;
+                int ok = m == 0 ? idx.find_term_sorted(t, tlen, &li)
+                       : m == 1 ? idx.fst_find(t, tlen, &li) : idx.find_term_mph(t, tlen, &li, nullptr);
+                sink += ok ? li + 1 : 0;
+                if (r == 0 && (ok ? li + 1 : 0) != ref[i]) mismatches++;
+            }
+        }
+        double dt = now_sec_monotonic() - t0;
+        if (t_first == 0.0) t_first = dt;
+        std::printf("[BENCH-LOOKUP] method=%-6s time=%.3f ms ns/term=%.1f mismatches=%u speedup=%.2fx checksum=%llu\n",
+                    names[m], dt * 1000.0, dt * 1e9 / ((double)nt * reps), mismatches,
+                    dt > 0 ? t_first / dt : 0.0, (unsigned long long)sink);
+    }
+    std::free(ref);
+    std::free(pool);
+    std::free(offs);
+    return 0;
+}
+
+// --terms PREFIX or FROM:TO (half-open, empty TO = to the end): the
+// matching lexicon terms with their df, in order, from lexicon.fst.
+static int run_list_terms(const Index& idx, const char* arg, uint32_t limit) {
+    if (!idx.fst_nodes) {
+        std::fprintf(stderr, "--terms needs lexicon.fst (indexer --fst)\n");
+        return 2;
+    }
+    char buf[1024];
+    size_t n = std::strlen(arg);
+    if (n >= sizeof(buf)) { std::fprintf(stderr, "--terms: argument too long\n"); return 2; }
+    for (size_t i=0; i<n; i++) buf[i] = (char)to_lower_ascii((unsigned char)arg[i]);
+    buf[n] = '\0';
+    uint32_t lo, hi;
+    const char* colon = std::strchr(buf, ':');
+    if (colon) {
+        size_t fl = (size_t)(colon - buf), tl = n - fl - 1;
+        lo = idx.fst_lower_bound(buf, (uint16_t)fl);
+        hi = tl ? idx.fst_lower_bound(colon + 1, (uint16_t)tl) : idx.term_count();
+        if (hi < lo) hi = lo;
+    } else {
+        idx.fst_prefix_range(buf, (uint16_t)n, &lo, &hi);
+    }
+    FstIter it;
+    it.init(idx);
+    uint32_t shown = 0;
+    for (it.seek(lo); it.valid && it.ord < hi && shown < limit; it.next(), shown++)
+        std::printf("%.*s\t%u\n", (int)it.len, it.term, idx.rec(it.ord).df);
+    it.destroy();
+    std::printf("[TERMS] ordinals=[%u,%u) terms=%u shown=%u\n", lo, hi, hi - lo, shown);
+    return 0;
+}
+
+static void print_scored_doc(FILE* out, const Index& idx, const ScoredDoc& d) {
+    uint32_t tl=0, ul=0;
+    const char* title=idx.doc_title(d.doc,&tl);
+    const char* url=idx.doc_url(d.doc,&ul);
+    std::fprintf(out, "%u\t%.4f\t%.*s\t%.*s\n", d.doc, d.score, (int)tl, title, (int)ul, url);
 }
 
 static void chomp(char* s) {
@@ -534,21 +4960,614 @@ static void chomp(char* s) {
     while (n>0 && (s[n-1]=='\n' || s[n-1]=='\r')) { s[n-1]='\0'; n--; }
 }
 
+struct QueryOpts {
+    uint32_t limit = 50;
+    uint32_t offset = 0;
+    int stats_only = 0;
+    int use_rpn_engine = 0;
+    int explain = 0;
+    int rank_bm25 = 0;
+    Bm25Params bm25;
+    int topk_algo = TK_MAXSCORE;
+    QueryCache* cache = nullptr;   // shared, daat engine only
+    int estimate_hits = 0;         // --estimate-hits: stop at offset+limit, estimate the total
+};
+
+// Per-thread buffers reused across queries.
+struct QueryScratch {
+    RpnVec rpn;
+    U32Vec page;
+    U32Vec all;   // full result, for the cache
+    TopK top;
+    void free_mem() { rpn.free_mem(); page.free_mem(); all.free_mem(); top.free_mem(); }
+};
+
+// Stores the drained root result if its lookup missed.
+static void cache_store_root(const QueryOpts& qo, QueryCacheCtx* qc, U32Vec* fill) {
+    if (fill) qo.cache->put(qc->root_key.a, qc->root_key.n, copy_list(fill->a, fill->n), fill->n, 0);
+    qc->root_key.free_mem();
+}
+
+// Hits counted before an unranked query may stop early: below this the hit
+// rate of the prefix is too noisy to extrapolate.
+static const uint32_t EST_MIN_SEEN = 1024;
+
+// 1 if p->est bounds the result from above: N - est of a negation is only
+// a lower bound, and so is an OR or AND that takes it in.
+static int plan_est_is_upper(const PlanNode* p) {
+    if (p->kind == P_NOT) return 0;
+    for (uint32_t i=0;i<p->nk;i++) {
+        const PlanNode* c = p->kids[i];
+        if (p->kind == P_AND && c->kind == P_NOT) continue;   // not counted in AND's est
+        if (!plan_est_is_upper(c)) return 0;
+    }
+    return 1;
+}
+
+// Total for an unranked query cut off after `seen` hits, the last at doc
+// last_doc: the hit rate so far extrapolated over the whole id range,
+// capped by the planner's df estimate (0 if it is not an upper bound) and
+// above seen (one more hit is known to exist).
+static uint32_t estimate_hits(uint32_t seen, uint32_t last_doc, uint32_t doc_count, uint32_t plan_est) {
+    uint64_t e = seen ? (uint64_t)seen * doc_count / ((uint64_t)last_doc + 1) : plan_est;
+    if (plan_est > seen && e > plan_est) e = plan_est;
+    if (e <= seen) e = (uint64_t)seen + 1;
+    if (e > doc_count && doc_count > seen) e = doc_count;
+    return (uint32_t)e;
+}
+
+static const char* cache_stats(const QueryOpts& qo, const QueryCacheCtx& qc, char* buf, size_t cap) {
+    if (!qo.cache) return "";
+    std::snprintf(buf, cap, " cache_hits=%u cache_misses=%u", qc.hits, qc.misses);
+    return buf;
+}
+
+// Evaluates one query line and writes its result lines and [STATS] to out.
+static void run_query(const Index& idx, const QueryOpts& qo, const char* line, QueryScratch* qs, FILE* out) {
+    uint32_t limit = qo.limit, offset = qo.offset;
+    double t0=now_sec_monotonic();
+
+    RpnVec& rpn = qs->rpn;
+    to_rpn(line,&rpn);
+
+    if (!near_operands_ok(rpn)) {
+        double t1=now_sec_monotonic();
+        std::fprintf(out, "[STATS] query=\"%s\" hits=0 shown=0 offset=%u time=%.6f sec error=near_operand\n",
+            line, offset, t1-t0);
+        return;
+    }
+
+    uint32_t cnt = 0;
+    if (qo.stats_only && !qo.explain && count_query(idx, rpn, &cnt)) {
+        double t1=now_sec_monotonic();
+        uint32_t shown = cnt > offset ? cnt - offset : 0;
+        if (shown > limit) shown = limit;
+        std::fprintf(out, "[STATS] query=\"%s\" hits=%u shown=%u offset=%u time=%.6f sec%s\n",
+            line, cnt, shown, offset, t1-t0, qo.cache ? " cache_hits=0 cache_misses=0" : "");
+        return;
+    }
+
+    if (qo.use_rpn_engine) {
+        Res res{};
+        eval_rpn(idx,rpn,&res);
+
+        double t1=now_sec_monotonic();
+        double elapsed=t1-t0;
+
+        uint32_t shown=0;
+        if (!qo.stats_only) {
+            for(uint32_t i=offset;i<res.n && shown<limit;i++){
+                uint32_t id=res.a[i];
+                if(id>=idx.doc_count()) continue;
+                print_doc(out, idx, id);
+                shown++;
+            }
+        } else {
+            if (offset < res.n) {
+                uint32_t left = res.n - offset;
+                shown = (left < limit) ? left : limit;
+            } else shown = 0;
+        }
+
+        std::fprintf(out, "[STATS] query=\"%s\" hits=%u shown=%u offset=%u time=%.6f sec\n",
+            line, res.n, shown, offset, elapsed);
+
+        std::free(res.a);
+        return;
+    }
+
+    CursorPool pool;
+    const PlanNode* plan = nullptr;
+    QueryCacheCtx qc;
+    qc.cache = qo.cache;
+    Cursor* root = build_cursor_tree(idx, rpn, &pool, &plan, qo.cache ? &qc : nullptr);
+    U32Vec* fill = (qc.root_key.n && !qc.root_neg) ? &qs->all : nullptr;
+    uint64_t fill_max = qo.cache ? qo.cache->cap_bytes / sizeof(uint32_t) : 0;
+    if (fill) fill->clear();
+    char cbuf[64];
+    if (qo.explain) {
+        std::fprintf(out, "[PLAN] query=\"%s\" plan=", line);
+        explain_cursor(out, root);
+        std::fprintf(out, "\n");
+    }
+
+    U32Vec& page = qs->page;
+    TopK& top = qs->top;
+    uint32_t hits=0;
+    page.clear();
+    if (qo.rank_bm25 && !qo.stats_only) {
+        uint32_t nst=0;
+        ScoreTerm* sterms=(ScoreTerm*)pool.alloc((size_t)plan_leaf_count(plan) * sizeof(ScoreTerm));
+        collect_score_terms(idx, plan, 0, &pool, sterms, &nst);
+        uint64_t k=(uint64_t)offset + limit;
+        top.reset(k > 0xFFFFFFFFull ? 0xFFFFFFFFu : (uint32_t)k);
+        int exact=1;
+        if (plan_is_term_or(plan) && nst > 0) {
+            // pure disjunction: drive the term cursors directly
+            int algo = topk_bounds_usable(idx, qo.bm25, sterms, nst) ? qo.topk_algo : TK_EXHAUSTIVE;
+            TopKStats tks;
+            run_topk(algo, idx, qo.bm25, sterms, nst, &top, &tks, &pool);
+            exact = (algo == TK_EXHAUSTIVE);
+            if (exact) hits = (uint32_t)tks.scored;
+            else if (qo.estimate_hits) hits = plan->est;
+            else {
+                // pruning skips documents, so the union is counted separately
+                for(; root->doc != DOC_END; cur_next(root)){
+                    if (fill) { if (fill->n < fill_max) fill->push(root->doc); else fill = nullptr; }
+                    hits++;
+                }
+                cache_store_root(qo, &qc, fill);
+                exact = 1;
+            }
+        } else {
+            for(; root->doc != DOC_END; cur_next(root)){
+                uint32_t id=root->doc;
+                if(id<idx.doc_count()) top.push(id, bm25_score(idx, qo.bm25, sterms, nst, id));
+                if (fill) { if (fill->n < fill_max) fill->push(id); else fill = nullptr; }
+                hits++;
+            }
+            top.sort_desc();
+            cache_store_root(qo, &qc, fill);
+        }
+
+        double t1=now_sec_monotonic();
+        uint32_t shown = top.n > offset ? top.n - offset : 0;
+        for(uint32_t i=offset;i<top.n;i++) print_scored_doc(out, idx, top.a[i]);
+
+        std::fprintf(out, "[STATS] query=\"%s\" hits=%u shown=%u offset=%u time=%.6f sec%s%s\n",
+            line, hits, shown, offset, t1-t0, exact ? "" : " hits_exact=0", cache_stats(qo, qc, cbuf, sizeof(cbuf)));
+
+        qc.root_key.free_mem();
+        pool.free_all();
+        return;
+    }
+    // With --estimate-hits unranked pages stop after offset+limit hits (and at
+    // least EST_MIN_SEEN); --stats-only and --limit 0 only count, so they
+    // count everything. With the cache on the root is drained so its full
+    // list can be stored.
+    int early = qo.estimate_hits && !qo.stats_only && !qo.cache && limit > 0;
+    uint64_t want = (uint64_t)offset + limit;
+    if (want < EST_MIN_SEEN) want = EST_MIN_SEEN;
+    int truncated = 0;
+    uint32_t last = 0;
+    for(; root->doc != DOC_END; cur_next(root)){
+        if (early && hits >= want) { truncated = 1; break; }
+        uint32_t id=root->doc;
+        if(hits>=offset && page.n<limit){
+            if (qo.stats_only || id<idx.doc_count()) page.push(id);
+        }
+        if (fill) { if (fill->n < fill_max) fill->push(id); else fill = nullptr; }
+        hits++;
+        last = id;
+    }
+    if (truncated) {
+        fill = nullptr;
+        hits = estimate_hits(hits, last, idx.doc_count(), plan_est_is_upper(plan) ? plan->est : 0);
+    }
+    cache_store_root(qo, &qc, fill);
+
+    double t1=now_sec_monotonic();
+    double elapsed=t1-t0;
+
+    if (!qo.stats_only) {
+        for(uint32_t i=0;i<page.n;i++) print_doc(out, idx, page.a[i]);
+    }
+
+    std::fprintf(out, "[STATS] query=\"%s\" hits=%u shown=%u offset=%u time=%.6f sec%s%s\n",
+        line, hits, page.n, offset, elapsed, truncated ? " hits_exact=0" : "", cache_stats(qo, qc, cbuf, sizeof(cbuf)));
+
+    pool.free_all();
+}
+
+static int is_blank_query(const char* line) {
+    for (const char* p=line; *p; p++) if (!(*p==' '||*p=='\t')) return 0;
+    return 1;
+}
+
+// ---- --batch: all of stdin on a worker pool ----
+// Workers claim queries through an atomic counter and render each into its
+// own buffer; the main thread writes the buffers in input order as soon as
+// the next one is done, so the output matches the serial loop byte for byte
+// (apart from the per-query times).
+
+struct BatchSlot {
+    char* out = nullptr;
+    size_t len = 0;
+    int done = 0;
+};
+
+struct BatchState {
+    const Index* idx = nullptr;
+    const QueryOpts* qo = nullptr;
+    char** lines = nullptr;
+    BatchSlot* slots = nullptr;
+    uint32_t n = 0;
+    std::atomic<uint32_t> next{0};
+    std::mutex mu;
+    std::condition_variable cv;
+};
+
+static void batch_worker(BatchState* st) {
+    QueryScratch qs;
+    while (1) {
+        uint32_t i = st->next.fetch_add(1);
+        if (i >= st->n) break;
+        char* buf = nullptr;
+        size_t len = 0;
+        FILE* out = open_memstream(&buf, &len);
+        if (!out) { std::fprintf(stderr, "open_memstream failed\n"); std::exit(1); }
+        run_query(*st->idx, *st->qo, st->lines[i], &qs, out);
+        std::fclose(out);
+        {
+            std::lock_guard<std::mutex> lk(st->mu);
+            st->slots[i].out = buf;
+            st->slots[i].len = len;
+            st->slots[i].done = 1;
+        }
+        st->cv.notify_all();
+    }
+    qs.free_mem();
+}
+
+static int run_batch(const Index& idx, const QueryOpts& qo, uint32_t threads) {
+    BatchState st;
+    st.idx = &idx;
+    st.qo = &qo;
+    uint32_t cap = 0;
+    char line[8192];
+    while (std::fgets(line, sizeof(line), stdin)) {
+        chomp(line);
+        if (is_blank_query(line)) continue;
+        if (st.n == cap) {
+            uint32_t nc = cap ? cap*2 : 1024;
+            char** nb = (char**)std::realloc(st.lines, (size_t)nc * sizeof(char*));
+            if (!nb) { std::fprintf(stderr, "realloc batch lines failed\n"); std::exit(1); }
+            st.lines = nb; cap = nc;
+        }
+        char* copy = strdup(line);
+        if (!copy) { std::fprintf(stderr, "strdup failed\n"); std::exit(1); }
+        st.lines[st.n++] = copy;
+    }
+    st.slots = new BatchSlot[st.n ? st.n : 1];
+
+    double t0 = now_sec_monotonic();
+    if (threads > st.n) threads = st.n ? st.n : 1;
+    std::thread* workers = new std::thread[threads];
+    for (uint32_t w=0; w<threads; w++) workers[w] = std::thread(batch_worker, &st);
+
+    for (uint32_t i=0; i<st.n; i++) {
+        {
+            std::unique_lock<std::mutex> lk(st.mu);
+            st.cv.wait(lk, [&st, i]{ return st.slots[i].done != 0; });
+        }
+        std::fwrite(st.slots[i].out, 1, st.slots[i].len, stdout);
+        std::free(st.slots[i].out);
+        std::free(st.lines[i]);
+    }
+    for (uint32_t w=0; w<threads; w++) workers[w].join();
+    double t1 = now_sec_monotonic();
+
+    std::fprintf(stderr, "[BATCH] queries=%u threads=%u time=%.3f sec qps=%.1f\n",
+        st.n, threads, t1 - t0, (t1 > t0) ? st.n / (t1 - t0) : 0.0);
+
+    delete[] workers;
+    delete[] st.slots;
+    std::free(st.lines);
+    return 0;
+}
+
+// ---- --serve: query server on a Unix socket ----
+// The index is loaded once. Each request is a native-endian uint32 length
+// followed by that many bytes of query text; each response is a uint32
+// length followed by exactly what stdin mode prints for that query (result
+// lines and the [STATS] line; empty for a blank query). A connection may
+// send any number of requests. Accepted connections are queued to a pool of
+// --threads workers; a worker serves one connection until the peer closes.
+
+static const uint32_t SERVE_MAX_QUERY = 8191;
+static const uint32_t SERVE_QUEUE = 256;
+
+struct ServeState {
+    const Index* idx = nullptr;
+    const QueryOpts* qo = nullptr;
+    std::mutex mu;
+    std::condition_variable cv_put, cv_get;
+    int queue[SERVE_QUEUE];
+    uint32_t q_head = 0, q_n = 0;
+    int* active = nullptr;   // connection each worker is serving, -1 if idle
+    int stop = 0;
+};
+
+static volatile sig_atomic_t g_serve_stop = 0;
+
+static void serve_on_signal(int) { g_serve_stop = 1; }
+
+static int read_full(int fd, void* buf, size_t n) {
+    uint8_t* p = (uint8_t*)buf;
+    while (n > 0) {
+        ssize_t r = recv(fd, p, n, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return 0;
+        p += r; n -= (size_t)r;
+    }
+    return 1;
+}
+
+static int write_full(int fd, const void* buf, size_t n) {
+    const uint8_t* p = (const uint8_t*)buf;
+    while (n > 0) {
+        ssize_t r = send(fd, p, n, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return 0;
+        p += r; n -= (size_t)r;
+    }
+    return 1;
+}
+
+static void serve_connection(ServeState* st, int fd, QueryScratch* qs) {
+    char line[SERVE_MAX_QUERY + 1];
+    while (1) {
+        uint32_t len = 0;
+        if (!read_full(fd, &len, sizeof(len))) return;
+        if (len > SERVE_MAX_QUERY) {
+            std::fprintf(stderr, "serve: query of %u bytes exceeds %u, closing connection\n", len, SERVE_MAX_QUERY);
+            return;
+        }
+        if (!read_full(fd, line, len)) return;
+        line[len] = '\0';
+        chomp(line);
+
+        char* resp = nullptr;
+        size_t resp_len = 0;
+        FILE* out = open_memstream(&resp, &resp_len);
+        if (!out) { std::fprintf(stderr, "open_memstream failed\n"); std::exit(1); }
+        if (!is_blank_query(line)) run_query(*st->idx, *st->qo, line, qs, out);
+        std::fclose(out);
+
+        if (resp_len > 0xFFFFFFFFu) resp_len = 0xFFFFFFFFu;
+        uint32_t rl = (uint32_t)resp_len;
+        int ok = write_full(fd, &rl, sizeof(rl)) && write_full(fd, resp, rl);
+        std::free(resp);
+        if (!ok) return;
+    }
+}
+
+static void serve_worker(ServeState* st, uint32_t w) {
+    QueryScratch qs;
+    while (1) {
+        int fd;
+        {
+            std::unique_lock<std::mutex> lk(st->mu);
+            st->cv_get.wait(lk, [st]{ return st->stop || st->q_n > 0; });
+            if (st->stop) break;
+            fd = st->queue[st->q_head];
+            st->q_head = (st->q_head + 1) % SERVE_QUEUE;
+            st->q_n--;
+            st->active[w] = fd;
+        }
+        st->cv_put.notify_one();
+        serve_connection(st, fd, &qs);
+        {
+            std::lock_guard<std::mutex> lk(st->mu);
+            st->active[w] = -1;
+        }
+        close(fd);
+    }
+    qs.free_mem();
+}
+
+// Runs until SIGINT/SIGTERM; returns the process exit code.
+static int run_serve(const Index& idx, const QueryOpts& qo, const char* path, uint32_t threads) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (std::strlen(path) >= sizeof(addr.sun_path)) {
+        std::fprintf(stderr, "Socket path too long: %s\n", path);
+        return 2;
+    }
+    std::strcpy(addr.sun_path, path);
+
+    struct stat sst;
+    if (stat(path, &sst) == 0) {
+        if (!S_ISSOCK(sst.st_mode)) { std::fprintf(stderr, "%s exists and is not a socket\n", path); return 1; }
+        unlink(path);
+    }
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd < 0) { std::perror("socket"); return 1; }
+    if (bind(lfd, (sockaddr*)&addr, sizeof(addr)) != 0) { std::perror("bind"); close(lfd); return 1; }
+    if (listen(lfd, 128) != 0) { std::perror("listen"); close(lfd); unlink(path); return 1; }
+
+    // Workers inherit a mask with SIGINT/SIGTERM blocked, so the signals
+    // interrupt accept() in this thread only.
+    sigset_t sigs, old;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, &old);
+
+    ServeState st;
+    st.idx = &idx;
+    st.qo = &qo;
+    st.active = new int[threads];
+    for (uint32_t w=0; w<threads; w++) st.active[w] = -1;
+    std::thread* workers = new std::thread[threads];
+    for (uint32_t w=0; w<threads; w++) workers[w] = std::thread(serve_worker, &st, w);
+
+    struct sigaction sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serve_on_signal;   // no SA_RESTART: accept() returns EINTR
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+
+    std::printf("[SERVE] socket=%s threads=%u docs=%u\n", path, threads, idx.doc_count());
+    std::fflush(stdout);
+
+    while (!g_serve_stop) {
+        int fd = accept(lfd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            std::perror("accept");
+            break;
+        }
+        std::unique_lock<std::mutex> lk(st.mu);
+        st.cv_put.wait(lk, [&st]{ return st.q_n < SERVE_QUEUE || g_serve_stop; });
+        if (g_serve_stop) { close(fd); break; }
+        st.queue[(st.q_head + st.q_n) % SERVE_QUEUE] = fd;
+        st.q_n++;
+        lk.unlock();
+        st.cv_get.notify_one();
+    }
+
+    close(lfd);
+    unlink(path);
+    {
+        // wake workers blocked in recv() on idle connections
+        std::lock_guard<std::mutex> lk(st.mu);
+        st.stop = 1;
+        for (uint32_t w=0; w<threads; w++) if (st.active[w] >= 0) shutdown(st.active[w], SHUT_RDWR);
+        for (uint32_t i=0; i<st.q_n; i++) close(st.queue[(st.q_head + i) % SERVE_QUEUE]);
+        st.q_n = 0;
+    }
+    st.cv_get.notify_all();
+    for (uint32_t w=0; w<threads; w++) workers[w].join();
+    delete[] workers;
+    delete[] st.active;
+    std::printf("[SERVE] stopped\n");
+    return 0;
+}
+
 int main(int argc, char** argv){
     const char* index_dir="./out";
     uint32_t limit=50;
     uint32_t offset=0;
     int stats_only=0;
+    int estimate_hits=0;
     int print_doccount=0;
+    LoadOpts lopts;
+    int isa = detect_isa();
+    int bench_and = 0;
+    int use_rpn_engine = 0;
+    int explain = 0;
+    int rank_bm25 = 0;
+    Bm25Params bm25;
+    int topk_algo = TK_MAXSCORE;
+    int bench_topk = 0;
+    int bench_lookup = 0;
+    const char* list_terms = nullptr;
+    uint32_t bench_pairs = 200, bench_reps = 20, bench_min_df = 64;
+    const char* serve_path = nullptr;
+    uint32_t threads = 0;
+    int batch = 0;
+    uint32_t cache_mb = 0;
 
     for(int i=1;i<argc;i++){
         if(std::strcmp(argv[i],"--index")==0 && i+1<argc) index_dir=argv[++i];
         else if(std::strcmp(argv[i],"--limit")==0 && i+1<argc) limit=(uint32_t)std::strtoul(argv[++i],nullptr,10);
         else if(std::strcmp(argv[i],"--offset")==0 && i+1<argc) offset=(uint32_t)std::strtoul(argv[++i],nullptr,10);
         else if(std::strcmp(argv[i],"--stats-only")==0) stats_only=1;
+        else if(std::strcmp(argv[i],"--estimate-hits")==0) estimate_hits=1;
+        else if(std::strcmp(argv[i],"--exact-hits")==0) estimate_hits=0;   // the default
         else if(std::strcmp(argv[i],"--print-doccount")==0) print_doccount=1;
+        else if(std::strcmp(argv[i],"--mmap")==0) lopts.use_mmap=1;
+        else if(std::strcmp(argv[i],"--populate")==0) lopts.populate=1;
+        else if(std::strcmp(argv[i],"--advise-docs")==0 && i+1<argc){
+            if(!parse_madvise(argv[++i], &lopts.advise_docs)){ std::fprintf(stderr,"Bad madvise hint: %s\n", argv[i]); return 2; }
+        }
+        else if(std::strcmp(argv[i],"--advise-lex")==0 && i+1<argc){
+            if(!parse_madvise(argv[++i], &lopts.advise_lex)){ std::fprintf(stderr,"Bad madvise hint: %s\n", argv[i]); return 2; }
+        }
+        else if(std::strcmp(argv[i],"--advise-post")==0 && i+1<argc){
+            if(!parse_madvise(argv[++i], &lopts.advise_post)){ std::fprintf(stderr,"Bad madvise hint: %s\n", argv[i]); return 2; }
+        }
+        else if(std::strcmp(argv[i],"--isa")==0 && i+1<argc){
+            const char* v=argv[++i];
+            int want;
+            if(std::strcmp(v,"scalar")==0) want=ISA_SCALAR;
+            else if(std::strcmp(v,"sse4.2")==0 || std::strcmp(v,"sse")==0) want=ISA_SSE42;
+            else if(std::strcmp(v,"avx2")==0) want=ISA_AVX2;
+            else if(std::strcmp(v,"auto")==0) want=detect_isa();
+            else { std::fprintf(stderr,"Unknown --isa %s (auto|scalar|sse4.2|avx2)\n", v); return 2; }
+            if(want > detect_isa()){ std::fprintf(stderr,"CPU does not support %s\n", v); return 2; }
+            isa=want;
+        }
+        else if(std::strcmp(argv[i],"--engine")==0 && i+1<argc){
+            const char* v=argv[++i];
+            if(std::strcmp(v,"daat")==0) use_rpn_engine=0;
+            else if(std::strcmp(v,"rpn")==0) use_rpn_engine=1;
+            else { std::fprintf(stderr,"Unknown --engine %s (daat|rpn)\n", v); return 2; }
+        }
+        else if(std::strcmp(argv[i],"--explain")==0) explain=1;
+        else if(std::strcmp(argv[i],"--rank")==0 && i+1<argc){
+            const char* v=argv[++i];
+            if(std::strcmp(v,"none")==0) rank_bm25=0;
+            else if(std::strcmp(v,"bm25")==0) rank_bm25=1;
+            else { std::fprintf(stderr,"Unknown --rank %s (none|bm25)\n", v); return 2; }
+        }
+        else if(std::strcmp(argv[i],"--topk")==0 && i+1<argc){
+            const char* v=argv[++i];
+            if(std::strcmp(v,"exhaustive")==0) topk_algo=TK_EXHAUSTIVE;
+            else if(std::strcmp(v,"maxscore")==0) topk_algo=TK_MAXSCORE;
+            else if(std::strcmp(v,"wand")==0) topk_algo=TK_WAND;
+            else if(std::strcmp(v,"bmw")==0) topk_algo=TK_BMW;
+            else { std::fprintf(stderr,"Unknown --topk %s (exhaustive|maxscore|wand|bmw)\n", v); return 2; }
+        }
+        else if(std::strcmp(argv[i],"--bench-topk")==0) bench_topk=1;
+        else if(std::strcmp(argv[i],"--bench-lookup")==0) bench_lookup=1;
+        else if(std::strcmp(argv[i],"--no-mph")==0) lopts.no_mph=1;
+        else if(std::strcmp(argv[i],"--no-fst")==0) lopts.no_fst=1;
+        else if(std::strcmp(argv[i],"--no-kgram")==0) lopts.no_kgram=1;
+        else if(std::strcmp(argv[i],"--terms")==0 && i+1<argc) list_terms=argv[++i];
+        else if(std::strcmp(argv[i],"--max-expansions")==0 && i+1<argc){
+            g_max_expansions=(uint32_t)std::strtoul(argv[++i],nullptr,10);
+            if(g_max_expansions==0){ std::fprintf(stderr,"--max-expansions must be >= 1\n"); return 2; }
+        }
+        else if(std::strcmp(argv[i],"--expansions-by-df")==0) g_expand_by_df=1;
+        else if(std::strcmp(argv[i],"--k1")==0 && i+1<argc) bm25.k1=std::strtod(argv[++i],nullptr);
+        else if(std::strcmp(argv[i],"--b")==0 && i+1<argc) bm25.b=std::strtod(argv[++i],nullptr);
+        else if(std::strcmp(argv[i],"--serve")==0 && i+1<argc) serve_path=argv[++i];
+        else if(std::strcmp(argv[i],"--threads")==0 && i+1<argc) threads=(uint32_t)std::strtoul(argv[++i],nullptr,10);
+        else if(std::strcmp(argv[i],"--batch")==0) batch=1;
+        else if(std::strcmp(argv[i],"--cache-mb")==0 && i+1<argc) cache_mb=(uint32_t)std::strtoul(argv[++i],nullptr,10);
+        else if(std::strcmp(argv[i],"--bench-and")==0) bench_and=1;
+        else if(std::strcmp(argv[i],"--bench-pairs")==0 && i+1<argc) bench_pairs=(uint32_t)std::strtoul(argv[++i],nullptr,10);
+        else if(std::strcmp(argv[i],"--bench-reps")==0 && i+1<argc) bench_reps=(uint32_t)std::strtoul(argv[++i],nullptr,10);
+        else if(std::strcmp(argv[i],"--bench-min-df")==0 && i+1<argc) bench_min_df=(uint32_t)std::strtoul(argv[++i],nullptr,10);
         else if(std::strcmp(argv[i],"--help")==0){
-            std::printf("Usage: %s --index <dir> [--limit 50] [--offset 0] [--stats-only] [--print-doccount]\n", argv[0]);
+            std::printf("Usage: %s --index <dir> [--limit 50] [--offset 0] [--estimate-hits] [--stats-only] [--print-doccount]\n"
+                        "       [--mmap] [--populate] [--advise-docs H] [--advise-lex H] [--advise-post H]\n"
+                        "       H = normal|random|sequential|willneed|dontneed (only with --mmap)\n"
+                        "       [--isa auto|scalar|sse4.2|avx2] [--engine daat|rpn] [--explain]\n"
+                        "       [--rank none|bm25] [--k1 1.2] [--b 0.75]   (bm25 needs --engine daat)\n"
+                        "       [--topk exhaustive|maxscore|wand|bmw] [--bench-topk [--bench-reps 20]]\n"
+                        "       [--batch] [--serve <socket-path>] [--threads N]   (N defaults to the CPU count)\n"
+                        "       [--cache-mb 0]   (result cache, daat engine)\n"
+                        "       [--bench-and [--bench-pairs 200] [--bench-reps 20] [--bench-min-df 64]]\n"
+                        "       [--no-mph] [--no-fst] [--no-kgram]   (ignore lexicon.mph / lexicon.fst / lexicon.kgram)\n"
+                        "       [--bench-lookup [--bench-reps 20]]   (terms on stdin)\n"
+                        "       [--terms PREFIX|FROM:TO]   (list lexicon terms and df, up to --limit; needs lexicon.fst)\n"
+                        "       [--max-expansions 1024] [--expansions-by-df]   (terms per wildcard)\n", argv[0]);
             return 0;
         } else {
             std::fprintf(stderr,"Unknown arg: %s\n", argv[i]);
@@ -557,62 +5576,98 @@ int main(int argc, char** argv){
     }
 
     Index idx;
-    if(!idx.load(index_dir)){
+    if(!idx.load(index_dir, lopts)){
         std::fprintf(stderr,"Index load failed\n");
         return 1;
     }
 
-    if (print_doccount) {
-        std::printf("%u\n", idx.doc_count());
+    set_isa(isa);
+
+    if (rank_bm25) {
+        if (use_rpn_engine) {
+            std::fprintf(stderr,"--rank bm25 needs --engine daat\n");
+            idx.destroy();
+            return 2;
+        }
+        if (idx.term_count() > 0 && !(idx.rec(0).flags & LEX_F_TF))
+            std::fprintf(stderr,"WARN: index has no term frequencies (indexer --with-tf), BM25 uses tf=1\n");
+        if (!idx.doc_lens)
+            std::fprintf(stderr,"WARN: no doclen.bin, BM25 without length normalisation\n");
+    }
+
+    if (bench_and) {
+        int rc = run_bench_and(idx, bench_pairs, bench_reps, bench_min_df ? bench_min_df : 1);
         idx.destroy();
-        return 0;
+        return rc;
     }
 
-    char line[8192];
-    while(std::fgets(line,sizeof(line),stdin)){
-        chomp(line);
-        int only_ws=1;
-        for(size_t i=0;i<std::strlen(line);i++){
-            if(!(line[i]==' '||line[i]=='\t')) { only_ws=0; break; }
-        }
-        if(only_ws) continue;
+    if (list_terms) {
+        int rc = run_list_terms(idx, list_terms, limit);
+        idx.destroy();
+        return rc;
+    }
 
-        double t0=now_sec_monotonic();
+    if (bench_lookup) {
+        int rc = run_bench_lookup(idx, bench_reps ? bench_reps : 1);
+        idx.destroy();
+        return rc;
+    }
 
-        RpnVec rpn;
-        to_rpn(line,&rpn);
+    if (bench_topk) {
+        uint64_t k = (uint64_t)offset + limit;
+        int rc = run_bench_topk(idx, bm25, k > 0xFFFFFFFFull ? 0xFFFFFFFFu : (uint32_t)k, bench_reps ? bench_reps : 1);
+        idx.destroy();
+        return rc;
+    }
 
-        Res res{};
-        eval_rpn(idx,rpn,&res);
+    if (print_doccount) {
+        std::printf("%u\n", idx.doc_count());
+        idx.destroy();
+        return 0;
+    }
 
-        double t1=now_sec_monotonic();
-        double elapsed=t1-t0;
+    QueryOpts qo;
+    qo.limit = limit;
+    qo.offset = offset;
+    qo.stats_only = stats_only;
+    qo.use_rpn_engine = use_rpn_engine;
+    qo.explain = explain;
+    qo.rank_bm25 = rank_bm25;
+    qo.bm25 = bm25;
+    qo.topk_algo = topk_algo;
+    qo.estimate_hits = estimate_hits;
 
-        uint32_t shown=0;
-        if (!stats_only) {
-            for(uint32_t i=offset;i<res.n && shown<limit;i++){
-                uint32_t id=res.a[i];
-                if(id>=idx.doc_count()) continue;
-                uint32_t tl=0, ul=0;
-                const char* title=idx.doc_title(id,&tl);
-                const char* url=idx.doc_url(id,&ul);
-                std::printf("%u\t%.*s\t%.*s\n", id, (int)tl, title, (int)ul, url);
-                shown++;
-            }
-        } else {
-            if (offset < res.n) {
-                uint32_t left = res.n - offset;
-                shown = (left < limit) ? left : limit;
-            } else shown = 0;
+    QueryCache cache;
+    if (cache_mb > 0) {
+        if (use_rpn_engine) std::fprintf(stderr,"WARN: --cache-mb needs --engine daat, cache disabled\n");
+        else {
+            cache.init((size_t)cache_mb << 20);
+            qo.cache = &cache;
         }
+    }
 
-        std::printf("[STATS] query=\"%s\" hits=%u shown=%u offset=%u time=%.6f sec\n",
-            line, res.n, shown, offset, elapsed);
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+        if (threads == 0) threads = 1;
+    }
 
-        std::free(res.a);
-        rpn.free_mem();
+    if (serve_path || batch) {
+        int rc = serve_path ? run_serve(idx, qo, serve_path, threads) : run_batch(idx, qo, threads);
+        cache.destroy();
+        idx.destroy();
+        return rc;
+    }
+
+    QueryScratch qs;
+    char line[8192];
+    while(std::fgets(line,sizeof(line),stdin)){
+        chomp(line);
+        if(is_blank_query(line)) continue;
+        run_query(idx, qo, line, &qs, stdout);
     }
 
+    qs.free_mem();
+    cache.destroy();
     idx.destroy();
     return 0;
 }